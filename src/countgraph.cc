@@ -0,0 +1,375 @@
+/*
+ * Copyright 2015 Kevin Murray <spam@kdmurray.id.au>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "countgraph.hh"
+#include "kwip-utils.hh"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#ifdef _OPENMP
+    #include <omp.h>
+#else
+    #define omp_get_max_threads() (1)
+#endif
+
+namespace kwip
+{
+
+const std::string BLOCK_COUNTGRAPH_SIGNATURE = "KWBC";
+
+void *
+map_file(const std::string &filename, size_t &len)
+{
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Cannot open k-mer count file: " + filename +
+                                 " " + strerror(errno));
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        throw std::runtime_error("Cannot stat k-mer count file: " + filename);
+    }
+    len = st.st_size;
+    void *map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        throw std::runtime_error("Cannot map k-mer count file: " + filename +
+                                 " " + strerror(errno));
+    }
+    return map;
+}
+
+std::string
+file_signature(const std::string &filename)
+{
+    std::ifstream fp(filename, std::ios::binary);
+    char signature[4];
+
+    if (!fp.read(signature, 4)) {
+        return "";
+    }
+    return std::string(signature, 4);
+}
+
+MappedCountingHash::
+MappedCountingHash(const std::string &filename) :
+    khmer::CountingHash(1, 1),
+    _map(MAP_FAILED),
+    _map_len(0)
+{
+    _map = map_file(filename, _map_len);
+    // Tables are read front to back by every kernel, so read ahead hard.
+    madvise(_map, _map_len, MADV_SEQUENTIAL);
+    madvise(_map, _map_len, MADV_WILLNEED);
+
+    // Drop the placeholder table from the base constructor
+    for (size_t i = 0; i < _n_tables; i++) {
+        delete[] _counts[i];
+    }
+    delete[] _counts;
+    _counts = NULL;
+    _n_tables = 0;
+    _tablesizes.clear();
+
+    try {
+        MapCursor cur(_map, _map_len, filename);
+        if (std::string(cur.skip(4), 4) != SAVED_SIGNATURE) {
+            throw std::runtime_error("Not an oxli countgraph: " + filename);
+        }
+        uint8_t version = cur.read<uint8_t>();
+        uint8_t ht_type = cur.read<uint8_t>();
+        if (version != SAVED_FORMAT_VERSION || ht_type != SAVED_COUNTING_HT) {
+            throw std::runtime_error("Incorrect countgraph file version or "
+                                     "type: " + filename);
+        }
+        _use_bigcount = cur.read<uint8_t>();
+        _ksize = cur.read<uint32_t>();
+        size_t n_tables = cur.read<uint8_t>();
+        _occupied_bins = cur.read<uint64_t>();
+        _init_bitstuff();
+
+        _counts = new khmer::Byte*[n_tables];
+        for (size_t i = 0; i < n_tables; i++) {
+            _counts[i] = NULL;
+        }
+        _n_tables = n_tables;
+        for (size_t i = 0; i < n_tables; i++) {
+            uint64_t tablesize = cur.read<uint64_t>();
+            _tablesizes.push_back(tablesize);
+            _counts[i] = (khmer::Byte *)cur.skip(tablesize);
+        }
+
+        uint64_t n_counts = cur.read<uint64_t>();
+        for (uint64_t n = 0; n < n_counts; n++) {
+            khmer::HashIntoType kmer = cur.read<khmer::HashIntoType>();
+            _bigcounts[kmer] = cur.read<khmer::BoundedCounterType>();
+        }
+    } catch (...) {
+        // The base class destructor still runs, so just release the mapping
+        _unmap();
+        throw;
+    }
+}
+
+MappedCountingHash::
+~MappedCountingHash()
+{
+    _unmap();
+}
+
+void
+MappedCountingHash::
+_unmap()
+{
+    // The tables belong to the mapping, so stop the base class freeing them
+    if (_counts != NULL) {
+        for (size_t i = 0; i < _n_tables; i++) {
+            _counts[i] = NULL;
+        }
+    }
+    if (_map != MAP_FAILED) {
+        munmap(_map, _map_len);
+        _map = MAP_FAILED;
+    }
+}
+
+size_t
+countgraph_bytes(const CountingHashShrPtr &ht)
+{
+    size_t bytes = 0;
+    for (const auto &tablesize: ht->get_tablesizes()) {
+        bytes += tablesize;
+    }
+    return bytes;
+}
+
+BlockCountingHash::
+BlockCountingHash(const std::string &filename, int n_threads) :
+    khmer::CountingHash(1, 1)
+{
+    struct Chunk
+    {
+        khmer::Byte        *dest;
+        size_t              len;
+        const char         *src;
+        size_t              src_len;
+    };
+    std::vector<Chunk> chunks;
+    size_t map_len = 0;
+    void *map = map_file(filename, map_len);
+    madvise(map, map_len, MADV_SEQUENTIAL);
+    madvise(map, map_len, MADV_WILLNEED);
+
+    // Drop the placeholder table from the base constructor
+    for (size_t i = 0; i < _n_tables; i++) {
+        delete[] _counts[i];
+    }
+    delete[] _counts;
+    _counts = NULL;
+    _n_tables = 0;
+    _tablesizes.clear();
+
+    try {
+        MapCursor cur(map, map_len, filename);
+        if (std::string(cur.skip(4), 4) != BLOCK_COUNTGRAPH_SIGNATURE) {
+            throw std::runtime_error("Not a block-compressed countgraph: " +
+                                     filename);
+        }
+        if (cur.read<uint8_t>() != BLOCK_COUNTGRAPH_VERSION) {
+            throw std::runtime_error("Incorrect block-compressed countgraph "
+                                     "version: " + filename);
+        }
+        _use_bigcount = cur.read<uint8_t>();
+        _ksize = cur.read<uint32_t>();
+        size_t n_tables = cur.read<uint8_t>();
+        _occupied_bins = cur.read<uint64_t>();
+        size_t chunk_size = cur.read<uint64_t>();
+        _init_bitstuff();
+        if (chunk_size == 0) {
+            throw std::runtime_error("Invalid chunk size in countgraph: " +
+                                     filename);
+        }
+
+        _counts = new khmer::Byte*[n_tables];
+        for (size_t i = 0; i < n_tables; i++) {
+            _counts[i] = NULL;
+        }
+        _n_tables = n_tables;
+        for (size_t i = 0; i < n_tables; i++) {
+            uint64_t tablesize = cur.read<uint64_t>();
+            uint64_t n_chunks = cur.read<uint64_t>();
+            if (n_chunks != (tablesize + chunk_size - 1) / chunk_size) {
+                throw std::runtime_error("Corrupt chunk index in countgraph: "
+                                         + filename);
+            }
+            _tablesizes.push_back(tablesize);
+            _counts[i] = new khmer::Byte[tablesize];
+
+            std::vector<uint64_t> src_lens;
+            for (uint64_t c = 0; c < n_chunks; c++) {
+                src_lens.push_back(cur.read<uint64_t>());
+            }
+            for (uint64_t c = 0; c < n_chunks; c++) {
+                size_t start = c * chunk_size;
+                Chunk chunk;
+                chunk.dest = _counts[i] + start;
+                chunk.len = std::min(chunk_size, (size_t)tablesize - start);
+                chunk.src_len = src_lens[c];
+                chunk.src = cur.skip(chunk.src_len);
+                chunks.push_back(chunk);
+            }
+        }
+
+        bool ok = true;
+        #pragma omp parallel for schedule(dynamic) \
+                num_threads(std::max(n_threads, 1)) reduction(&&:ok)
+        for (size_t c = 0; c < chunks.size(); c++) {
+            uLongf len = chunks[c].len;
+            int ret = uncompress(chunks[c].dest, &len,
+                                 (const Bytef *)chunks[c].src,
+                                 chunks[c].src_len);
+            ok = ok && ret == Z_OK && len == chunks[c].len;
+        }
+        if (!ok) {
+            throw std::runtime_error("Corrupt chunk in countgraph: " +
+                                     filename);
+        }
+
+        uint64_t n_counts = cur.read<uint64_t>();
+        for (uint64_t n = 0; n < n_counts; n++) {
+            khmer::HashIntoType kmer = cur.read<khmer::HashIntoType>();
+            _bigcounts[kmer] = cur.read<khmer::BoundedCounterType>();
+        }
+    } catch (...) {
+        // The base class destructor frees any tables allocated so far
+        munmap(map, map_len);
+        throw;
+    }
+    munmap(map, map_len);
+}
+
+void
+save_block_countgraph(khmer::CountingHash &ht, const std::string &filename,
+                      size_t chunk_size, int level, int n_threads)
+{
+    std::vector<khmer::HashIntoType> tablesizes = ht.get_tablesizes();
+    khmer::Byte **counts = ht.get_raw_tables();
+
+    if (chunk_size == 0) {
+        throw std::invalid_argument("Chunk size must be positive");
+    }
+    if (n_threads < 1) {
+        n_threads = omp_get_max_threads();
+    }
+
+    std::ofstream out(filename, std::ios::binary);
+    if (!out) {
+        throw std::runtime_error("Cannot open countgraph for writing: " +
+                                 filename);
+    }
+    out.write(BLOCK_COUNTGRAPH_SIGNATURE.data(), 4);
+    write_val<uint8_t>(out, BLOCK_COUNTGRAPH_VERSION);
+    write_val<uint8_t>(out, ht.get_use_bigcount());
+    write_val<uint32_t>(out, ht.ksize());
+    write_val<uint8_t>(out, ht.n_tables());
+    write_val<uint64_t>(out, ht.n_occupied());
+    write_val<uint64_t>(out, chunk_size);
+
+    // Deflate a table at a time to bound memory use
+    for (size_t tab = 0; tab < tablesizes.size(); tab++) {
+        size_t n_chunks = (tablesizes[tab] + chunk_size - 1) / chunk_size;
+        std::vector<std::vector<Bytef>> chunks(n_chunks);
+        bool ok = true;
+
+        #pragma omp parallel for schedule(dynamic) num_threads(n_threads) \
+                reduction(&&:ok)
+        for (size_t c = 0; c < n_chunks; c++) {
+            size_t start = c * chunk_size;
+            size_t len = std::min(chunk_size, (size_t)tablesizes[tab] - start);
+            uLongf dest_len = compressBound(len);
+            chunks[c].resize(dest_len);
+            int ret = compress2(chunks[c].data(), &dest_len,
+                                counts[tab] + start, len, level);
+            ok = ok && ret == Z_OK;
+            chunks[c].resize(dest_len);
+        }
+        if (!ok) {
+            throw std::runtime_error("Failed to compress countgraph: " +
+                                     filename);
+        }
+
+        write_val<uint64_t>(out, tablesizes[tab]);
+        write_val<uint64_t>(out, n_chunks);
+        for (const auto &chunk: chunks) {
+            write_val<uint64_t>(out, chunk.size());
+        }
+        for (const auto &chunk: chunks) {
+            out.write((const char *)chunk.data(), chunk.size());
+        }
+    }
+
+    write_val<uint64_t>(out, ht._bigcounts.size());
+    for (const auto &bigcount: ht._bigcounts) {
+        write_val<khmer::HashIntoType>(out, bigcount.first);
+        write_val<khmer::BoundedCounterType>(out, bigcount.second);
+    }
+    if (!out) {
+        throw std::runtime_error("Failed to write countgraph: " + filename);
+    }
+}
+
+bool
+countgraph_is_mappable(const std::string &filename)
+{
+    // Gzipped files start with the gzip magic, not the oxli signature
+    return file_signature(filename) == SAVED_SIGNATURE;
+}
+
+bool
+countgraph_is_block(const std::string &filename)
+{
+    return file_signature(filename) == BLOCK_COUNTGRAPH_SIGNATURE;
+}
+
+CountingHashShrPtr
+load_countgraph(const std::string &filename, bool use_mmap, int n_threads)
+{
+    std::string signature = file_signature(filename);
+    if (signature == BLOCK_COUNTGRAPH_SIGNATURE) {
+        return std::make_shared<BlockCountingHash>(filename, n_threads);
+    }
+    if (use_mmap && signature == SAVED_SIGNATURE) {
+        return std::make_shared<MappedCountingHash>(filename);
+    }
+    CountingHashShrPtr ht = std::make_shared<khmer::CountingHash>(1, 1);
+    khmer::CountingHashFile::load(filename, *ht);
+    return ht;
+}
+
+} // end namespace kwip
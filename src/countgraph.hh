@@ -0,0 +1,158 @@
+/*
+ * Copyright 2015 Kevin Murray <spam@kdmurray.id.au>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COUNTGRAPH_HH
+#define COUNTGRAPH_HH
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#include <oxli/counting.hh> // liboxli countgraphs
+
+
+namespace kwip
+{
+
+typedef std::shared_ptr<khmer::CountingHash> CountingHashShrPtr;
+
+// Block-compressed countgraph files: the oxli header, then each table as
+// independently deflated chunks with an index of their compressed sizes, then
+// the (uncompressed) big counts. Chunks can be inflated in parallel.
+extern const std::string BLOCK_COUNTGRAPH_SIGNATURE;
+const uint8_t BLOCK_COUNTGRAPH_VERSION = 1;
+const size_t BLOCK_COUNTGRAPH_CHUNK = 1 << 22;
+
+// Bounds-checked reads from a mapped file
+class MapCursor
+{
+protected:
+    const char         *_data;
+    size_t              _len;
+    size_t              _pos;
+    const std::string  &_filename;
+
+public:
+    MapCursor(const void *data, size_t len, const std::string &filename) :
+        _data((const char *)data),
+        _len(len),
+        _pos(0),
+        _filename(filename)
+    {
+    }
+
+    const char *
+    skip(size_t n)
+    {
+        if (n > _len - _pos) {
+            throw std::runtime_error("Unexpected end of k-mer count file: " +
+                                     _filename);
+        }
+        const char *here = _data + _pos;
+        _pos += n;
+        return here;
+    }
+
+    // Skip to the next multiple of `align` bytes from the start
+    void
+    align(size_t align)
+    {
+        skip((align - _pos % align) % align);
+    }
+
+    template<typename val_tp>
+    val_tp
+    read()
+    {
+        val_tp val;
+        memcpy(&val, skip(sizeof(val)), sizeof(val));
+        return val;
+    }
+};
+
+// Map all of `filename` read-only, setting `len` to its size
+void *
+map_file                        (const std::string     &filename,
+                                 size_t                &len);
+
+// The first four bytes of `filename`, or "" if it is shorter.
+std::string
+file_signature                  (const std::string     &filename);
+
+// A countgraph whose tables point directly into a read-only, shared mapping
+// of an uncompressed oxli countgraph file. Concurrent users of the same file,
+// in this or other processes, share one page cache copy. Writing to the
+// tables is an error.
+class MappedCountingHash : public khmer::CountingHash
+{
+protected:
+    void                       *_map;
+    size_t                      _map_len;
+
+    void
+    _unmap                      ();
+
+public:
+    MappedCountingHash          (const std::string     &filename);
+    ~MappedCountingHash         ();
+};
+
+// A countgraph read from a block-compressed file, with its chunks inflated in
+// parallel straight into the tables.
+class BlockCountingHash : public khmer::CountingHash
+{
+public:
+    // Inflate with `n_threads` threads. Callers loading on several threads
+    // at once share their budget out between them.
+    BlockCountingHash           (const std::string     &filename,
+                                 int                    n_threads=1);
+};
+
+// Save `ht` as a block-compressed countgraph of `chunk_size` byte chunks,
+// deflated in parallel at zlib compression `level`.
+void
+save_block_countgraph           (khmer::CountingHash   &ht,
+                                 const std::string     &filename,
+                                 size_t                 chunk_size=BLOCK_COUNTGRAPH_CHUNK,
+                                 int                    level=6,
+                                 int                    n_threads=0);
+
+// Total size of a countgraph's tables
+size_t
+countgraph_bytes                (const CountingHashShrPtr &ht);
+
+// True if `filename` is an uncompressed oxli countgraph that can be mapped.
+bool
+countgraph_is_mappable          (const std::string     &filename);
+
+// True if `filename` is a block-compressed countgraph.
+bool
+countgraph_is_block             (const std::string     &filename);
+
+// Load a countgraph. Block-compressed countgraphs are inflated on
+// `n_threads` threads, uncompressed countgraphs are mapped if `use_mmap` is
+// set, and anything else is read with liboxli.
+CountingHashShrPtr
+load_countgraph                 (const std::string     &filename,
+                                 bool                   use_mmap=true,
+                                 int                    n_threads=1);
+
+} // end namespace kwip
+
+#endif /* COUNTGRAPH_HH */
@@ -20,6 +20,7 @@
 
 
 #include <array>
+#include <cstddef>
 #include <vector>
 
 namespace kwip
@@ -0,0 +1,197 @@
+/*
+ * Copyright 2015 Kevin Murray <spam@kdmurray.id.au>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "journal.hh"
+#include "kwip-utils.hh"
+
+#include <unistd.h>
+
+namespace kwip
+{
+
+const std::string JOURNAL_SIGNATURE = "KWJN";
+
+// Journals are a header, then records appended as pairs complete:
+//
+//   signature[4] u8:version u8:0 u8:0 u8:0
+//   u64:n_samples u64:label_bytes
+//   labels[label_bytes] (sample names, each ending in a newline; padded)
+//   for each completed pair: u32:i u32:j f32:kernel f32:standard_error
+static const size_t journal_record_bytes = 16;
+
+static std::string
+journal_labels(const std::vector<std::string> &labels)
+{
+    std::string joined;
+    for (const auto &label: labels) {
+        joined += label + "\n";
+    }
+    return joined;
+}
+
+PairJournal::
+PairJournal(const std::string &filename,
+            const std::vector<std::string> &labels, bool resume,
+            std::vector<PairKernel> &done) :
+    _filename(filename),
+    _stop(false),
+    _writing(false),
+    _failed(false)
+{
+    done.clear();
+    const bool exists = access(filename.c_str(), F_OK) == 0;
+    if (resume && exists) {
+        // Drop any record cut short, so appended records stay aligned
+        size_t len = _read(labels, done);
+        if (truncate(filename.c_str(), len) != 0) {
+            throw std::runtime_error("Cannot truncate journal: " + filename);
+        }
+        _out.open(filename, std::ios::binary | std::ios::app);
+    } else {
+        const std::string joined = journal_labels(labels);
+        _out.open(filename, std::ios::binary | std::ios::trunc);
+        _out.write(JOURNAL_SIGNATURE.data(), 4);
+        write_val<uint8_t>(_out, JOURNAL_VERSION);
+        write_val<uint8_t>(_out, 0);
+        write_val<uint8_t>(_out, 0);
+        write_val<uint8_t>(_out, 0);
+        write_val<uint64_t>(_out, labels.size());
+        write_val<uint64_t>(_out, joined.size());
+        _out.write(joined.data(), joined.size());
+        write_padding(_out, joined.size());
+        _out.flush();
+    }
+    if (!_out) {
+        throw std::runtime_error("Cannot open journal for writing: " +
+                                 filename);
+    }
+    _thread = std::thread(&PairJournal::_run, this);
+}
+
+PairJournal::
+~PairJournal()
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stop = true;
+    }
+    _cond.notify_all();
+    _thread.join();
+}
+
+size_t
+PairJournal::
+_read(const std::vector<std::string> &labels, std::vector<PairKernel> &done)
+{
+    std::ifstream in(_filename, std::ios::binary);
+    const std::string what = "journal: " + _filename;
+    char sig[4];
+    if (!in.read(sig, 4) || std::string(sig, 4) != JOURNAL_SIGNATURE) {
+        throw std::runtime_error("Not a kWIP journal: " + _filename);
+    }
+    if (read_val<uint8_t>(in, what) != JOURNAL_VERSION) {
+        throw std::runtime_error("Incorrect kWIP journal version: " +
+                                 _filename);
+    }
+    for (int i = 0; i < 3; i++) {
+        read_val<uint8_t>(in, what);
+    }
+    const uint64_t n_samples = read_val<uint64_t>(in, what);
+    const uint64_t label_bytes = read_val<uint64_t>(in, what);
+    std::string joined(label_bytes, '\0');
+    if (!in.read(&joined[0], label_bytes)) {
+        throw std::runtime_error("Unexpected end of " + what);
+    }
+    if (n_samples != labels.size() || joined != journal_labels(labels)) {
+        throw std::runtime_error("Journal is of other samples: " + _filename);
+    }
+    size_t len = 4 + 4 + 16 + label_bytes + (8 - label_bytes % 8) % 8;
+    in.ignore((8 - label_bytes % 8) % 8);
+
+    uint32_t record[4];
+    while (in.read((char *)record, journal_record_bytes)) {
+        const size_t i = record[0];
+        const size_t j = record[1];
+        if (i > j || j >= n_samples) {
+            throw std::runtime_error("Invalid pair in journal: " + _filename);
+        }
+        PairKernel pair_kernel;
+        pair_kernel.pair = std::make_pair(i, j);
+        memcpy(&pair_kernel.kernel, &record[2], sizeof(float));
+        memcpy(&pair_kernel.error, &record[3], sizeof(float));
+        done.push_back(pair_kernel);
+        len += journal_record_bytes;
+    }
+    return len;
+}
+
+void
+PairJournal::
+append(const std::vector<PairKernel> &kernels)
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _queue.insert(_queue.end(), kernels.begin(), kernels.end());
+    }
+    _cond.notify_all();
+}
+
+void
+PairJournal::
+flush()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    _cond.wait(lock, [this] { return _queue.empty() && !_writing; });
+    if (_failed) {
+        throw std::runtime_error("Failed to write journal: " + _filename);
+    }
+}
+
+void
+PairJournal::
+_run()
+{
+    std::vector<PairKernel> batch;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _writing = false;
+            _cond.notify_all();
+            _cond.wait(lock, [this] { return _stop || !_queue.empty(); });
+            if (_queue.empty()) {
+                return;
+            }
+            batch.swap(_queue);
+            _writing = true;
+        }
+        // Written outside the lock, so compute threads never wait on I/O
+        for (const auto &kernel: batch) {
+            write_val<uint32_t>(_out, kernel.pair.first);
+            write_val<uint32_t>(_out, kernel.pair.second);
+            write_val<float>(_out, kernel.kernel);
+            write_val<float>(_out, kernel.error);
+        }
+        _out.flush();
+        batch.clear();
+        if (!_out) {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _failed = true;
+        }
+    }
+}
+
+} // end namespace kwip
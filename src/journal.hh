@@ -0,0 +1,95 @@
+/*
+ * Copyright 2015 Kevin Murray <spam@kdmurray.id.au>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef JOURNAL_HH
+#define JOURNAL_HH
+
+#include <condition_variable>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace kwip
+{
+
+// Journals hold the kernels of the pairs completed by a pairwise calculation
+extern const std::string JOURNAL_SIGNATURE;
+const uint8_t JOURNAL_VERSION = 2;
+
+// The kernel of the pair of samples (i, j), and its standard error if it was
+// estimated from a subset of bins (else 0)
+struct PairKernel
+{
+    std::pair<size_t, size_t>   pair;
+    float                       kernel;
+    float                       error;
+};
+
+// An append-only journal of the kernels of completed pairs, from which an
+// interrupted pairwise calculation can resume. Kernels are appended by a
+// background thread, so the compute threads only queue them. A record cut
+// short by the process being killed is dropped on resuming.
+class PairJournal
+{
+public:
+    // Open the journal `filename` of a calculation over samples `labels`. If
+    // `resume` is set and the journal exists, the kernels it holds are read
+    // into `done` and more are appended; it throws if the journal is of other
+    // samples. Otherwise a new journal is started.
+    PairJournal                 (const std::string     &filename,
+                                 const std::vector<std::string> &labels,
+                                 bool                   resume,
+                                 std::vector<PairKernel> &done);
+
+    // Writes the kernels still queued
+    ~PairJournal                ();
+
+    // Queue kernels to be written
+    void
+    append                      (const std::vector<PairKernel> &kernels);
+
+    // Wait until every queued kernel is written. Throws if any write failed.
+    void
+    flush                       ();
+
+protected:
+    std::string                 _filename;
+    std::ofstream               _out;
+    std::vector<PairKernel>     _queue;
+    std::mutex                  _mutex;
+    std::condition_variable     _cond;
+    bool                        _stop;
+    bool                        _writing;
+    bool                        _failed;
+    std::thread                 _thread;
+
+    // Read the kernels of an existing journal into `done`, returning the
+    // length of its complete records
+    size_t
+    _read                       (const std::vector<std::string> &labels,
+                                 std::vector<PairKernel> &done);
+
+    void
+    _run                        ();
+};
+
+} // end namespace kwip
+
+#endif /* JOURNAL_HH */
@@ -16,30 +16,62 @@
  */
 
 #include "kernel.hh"
+#include "simd.hh"
 
-#include <Eigen/Eigenvalues>
+#include <exception>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+
+#include <unistd.h>
 
 namespace kwip
 {
 
+const std::string SHARD_SIGNATURE = "KWSH";
+
+// Per-core cache target for one block of bins across all samples of a tile.
+static const size_t kernel_block_bytes = 1 << 18;
+
+// Below this fraction of occupied bins, kernels iterating over occupied bins
+// beat the dense SIMD kernels, even with the index's extra bytes per bin.
+static const double kernel_default_sparse_below = 0.05;
+
+// Largest automatic tile size. Beyond this, blocks of bins shrink to the
+// minimum and spill out of cache, so a larger budget is better spent holding
+// more tiles.
+static const size_t kernel_max_auto_tile = 64;
+
+// Batches of bins per table that the standard errors of estimated kernels are
+// taken from
+static const size_t kernel_error_batches = 64;
+
 Kernel::
 Kernel() :
-    _kernel_m(1,1),
-    _hash_cache(1),
+    _n_queries(0),
+    _knn(0),
+    _bin_fraction(1.0),
+    _tile_size_auto(true),
+    _cache_mem(0),
+    _io_threads(2),
+    _prefetch_depth(1),
+    _sparse_below(kernel_default_sparse_below),
+    _hash_cache(0, 1, sample_bytes),
+    _shard(0),
+    _n_shards(1),
+    _resume(false),
     verbosity(1),
     num_samples(0)
 {
-    omp_init_lock(&_hash_cache_lock);
     _num_threads = omp_get_max_threads();
-    _hash_cache = CountingHashCache(_num_threads + 1);
+    _tile_size = std::max((_num_threads + 1) / 2, 1);
+    _resize_hash_cache();
 }
 
 Kernel::
 ~Kernel()
 {
-    // Lock these to avoid a race. Very unlikely but doesn't hurt
-    omp_set_lock(&_hash_cache_lock);
-    omp_destroy_lock(&_hash_cache_lock);
+    _remove_scratch_copies();
 }
 
 float
@@ -54,11 +86,72 @@ kernel(const khmer::CountingHash &a, const khmer::CountingHash &b)
 void
 Kernel::
 calculate_pairwise(std::vector<std::string> &hash_fnames)
+{
+    _calculate_pairs(hash_fnames, 0);
+}
+
+void
+Kernel::
+calculate_cross(std::vector<std::string> &queries,
+                std::vector<std::string> &references)
+{
+    if (_n_shards > 1 || !_previous.empty()) {
+        throw std::invalid_argument("Kernels of queries against references "
+                                    "can't be sharded or extend a matrix");
+    }
+    if (queries.empty() || references.empty()) {
+        throw std::invalid_argument("Kernels of queries against references "
+                                    "need both queries and references");
+    }
+    std::vector<std::string> hash_fnames(queries);
+    hash_fnames.insert(hash_fnames.end(), references.begin(),
+                       references.end());
+    _calculate_pairs(hash_fnames, queries.size());
+}
+
+void
+Kernel::
+_calculate_pairs(std::vector<std::string> &hash_fnames, size_t n_queries)
 {
     num_samples = hash_fnames.size();
+    _n_queries = n_queries;
 
-    _kernel_m.resize(num_samples, num_samples);
-    _kernel_m.fill(0);
+    if (_knn > 0 && (_n_queries > 0 || _n_shards > 1 ||
+                     !_previous.empty())) {
+        throw std::invalid_argument("Neighbours can't be kept for sharded "
+                                    "calculations, extended matrices or "
+                                    "queries against references");
+    }
+
+    // Shards hold only the kernels they compute, not the whole matrix
+    _shard_kernels.clear();
+    _done_pairs.clear();
+    _self_kernels.clear();
+    _neighbours.clear();
+    // Standard errors are kept for kernel matrices alone. Those of a previous
+    // matrix's kernels are unknown, so none are kept when extending one.
+    if (_bin_fraction < 1 && _knn == 0 && _n_queries == 0 &&
+            _n_shards == 1 && _previous.empty()) {
+        _stderr_m.resize(num_samples);
+    } else {
+        _stderr_m.resize(0);
+    }
+    if (_knn > 0) {
+        // Neighbours are kept instead of any matrix
+        _kernel_m.resize(0);
+        _cross_m.resize(0, 0);
+        _self_kernels.assign(num_samples, 0.0);
+        _neighbours.assign(num_samples, {});
+    } else if (_n_queries > 0) {
+        _kernel_m.resize(0);
+        _cross_m.resize(_n_queries, num_samples - _n_queries);
+    } else if (_n_shards > 1) {
+        _cross_m.resize(0, 0);
+        _plan_shards();
+    } else {
+        _cross_m.resize(0, 0);
+        _kernel_m.resize(num_samples);
+    }
 
     if (sample_names.empty()) {
         for (size_t i = 0; i < num_samples; i++) {
@@ -70,115 +163,644 @@ calculate_pairwise(std::vector<std::string> &hash_fnames)
                 base = hash_fnames[i];
             }
             std::vector<std::string> exts {
+                ".ks",
                 ".kh",
                 ".ct",
                 ".cg",
                 ".countgraph",
             };
+            // Strip from the first extension, e.g. both of ".ct.ks"
             size_t ext_idx = std::string::npos;
             for (const auto &ext: exts) {
-                ext_idx = base.find(ext);
-                if (ext_idx != std::string::npos) {
-                    base.erase(ext_idx);
-                    break;
-                }
+                ext_idx = std::min(ext_idx, base.find(ext));
+            }
+            if (ext_idx != std::string::npos) {
+                base.erase(ext_idx);
             }
             sample_names.push_back(std::string(base));
         }
     }
+    _use_previous();
+    _open_checkpoint();
 
-    #pragma omp parallel for schedule(dynamic) num_threads(_num_threads)
-    for (size_t i = 0; i < num_samples; i++) {
-        CountingHashShrPtr ht1 = _get_hash(hash_fnames[i]);
-        for (size_t j = 0; j < num_samples; j++) {
-            float kernel = 0.0;
-            if (i > j) {
-                // Skip calculating the bottom half of the matrix
-                continue;
+    if (verbosity > 0 && _bin_fraction < 1) {
+        *outstream << "Estimating kernels from " << _bin_fraction * 100
+                   << "% of bins" << std::endl;
+    }
+    if (verbosity > 1) {
+        *outstream << "Using " << simd::level_name(simd::level())
+                   << " inner product kernels" << std::endl;
+    }
+    size_t cache_tiles = _plan_tiles(hash_fnames);
+
+    // Walk the upper triangle one pair of tiles at a time, so that each block
+    // of each sample is read once per tile rather than once per pair. Tile
+    // pairs are ordered so that as few tiles as possible drop out of the
+    // sample cache before they are next used.
+    size_t n_tiles = (num_samples + _tile_size - 1) / _tile_size;
+    std::vector<TilePair> schedule = schedule_tile_pairs(n_tiles, cache_tiles);
+    if (verbosity > 1) {
+        *outstream << "Scheduled " << schedule.size() << " tile pairs over "
+                   << cache_tiles << " cached tiles, for about "
+                   << count_tile_loads(schedule, cache_tiles) << " tile loads"
+                   << std::endl;
+    }
+
+    // Load the samples of upcoming tile pairs in the background while this
+    // one is computed.
+    Prefetcher prefetcher(_prefetch_tiles() > 0 ? _io_threads : 0,
+                          [this](const std::string &fname) {
+                              _get_sample(fname, _prefetch_load_threads());
+                          });
+    if (_knn > 0) {
+        _calculate_self_kernels(hash_fnames);
+    }
+    size_t next_prefetch = 1;
+    for (size_t k = 0; k < schedule.size(); k++) {
+        size_t ahead = std::min(k + _prefetch_tiles() + 1, schedule.size());
+        for (; next_prefetch < ahead; next_prefetch++) {
+            _prefetch_tile_pair(prefetcher, hash_fnames,
+                                schedule[next_prefetch]);
+        }
+        _calculate_tile(hash_fnames,
+                        _tile_pairs(schedule[k].first, schedule[k].second));
+    }
+    if (verbosity > 0) {
+        SampleCacheStats stats = _hash_cache.stats();
+        *outstream << "Done all!" << std::endl;
+        if (verbosity > 1) {
+            *outstream << "Made " << prefetcher.started()
+                       << " prefetch requests on " << _io_threads
+                       << " I/O threads"
+                       << std::endl;
+        }
+        *outstream << "Sample cache: " << stats.hits << " hits, "
+                   << stats.misses << " misses, " << stats.evictions
+                   << " evictions" << std::endl;
+        size_t n_pairs = num_samples * (num_samples + 1) / 2;
+        if (_n_queries > 0) {
+            n_pairs = _n_queries * (num_samples - _n_queries) + num_samples;
+        }
+        *outstream << "Loaded " << stats.misses << " samples ("
+                   << format_size(stats.bytes_loaded) << ") to compute "
+                   << n_pairs << " pairs" << std::endl;
+    }
+
+    if (_journal) {
+        _journal->flush();
+        _journal.reset();
+    }
+    _done_pairs.clear();
+    _remove_scratch_copies();
+
+    // The kernels of queries against references are no kernel matrix
+    if (_n_shards == 1 && _n_queries == 0 && _knn == 0) {
+        _check_psd();
+    }
+}
+
+void
+Kernel::
+_store_kernel(size_t i, size_t j, float kernel)
+{
+    if (_knn > 0) {
+        if (i == j) {
+            _self_kernels[i] = kernel;
+            return;
+        }
+        const float distance = derive_kernel(kernel, _self_kernels[i],
+                                             _self_kernels[j],
+                                             KernelMatrix::DISTANCE);
+        _add_neighbour(i, j, distance);
+        _add_neighbour(j, i, distance);
+    } else if (_n_queries > 0) {
+        if (i == j && i < _n_queries) {
+            _cross_m.query_self(i) = kernel;
+        } else if (i == j) {
+            _cross_m.ref_self(i - _n_queries) = kernel;
+        } else {
+            _cross_m(i, j - _n_queries) = kernel;
+        }
+    } else if (_n_shards > 1) {
+        _shard_kernels.emplace_back(SamplePair(i, j), kernel);
+    } else {
+        // Both halves of the matrix share the packed upper triangle
+        _kernel_m(i, j) = kernel;
+    }
+}
+
+void
+Kernel::
+_add_neighbour(size_t i, size_t j, float distance)
+{
+    std::vector<std::pair<float, uint32_t>> &heap = _neighbours[i];
+    const std::pair<float, uint32_t> neighbour(distance, j);
+    if (heap.size() < _knn) {
+        heap.push_back(neighbour);
+        std::push_heap(heap.begin(), heap.end());
+    } else if (neighbour < heap.front()) {
+        std::pop_heap(heap.begin(), heap.end());
+        heap.back() = neighbour;
+        std::push_heap(heap.begin(), heap.end());
+    }
+}
+
+void
+Kernel::
+_calculate_self_kernels(std::vector<std::string> &hash_fnames)
+{
+    for (size_t first = 0; first < num_samples; first += _tile_size) {
+        const size_t end = std::min(first + _tile_size, num_samples);
+        std::vector<SamplePair> pairs;
+        for (size_t i = first; i < end; i++) {
+            if (!_pair_done(i, i)) {
+                pairs.emplace_back(i, i);
             }
-            CountingHashShrPtr ht2 = _get_hash(hash_fnames[j]);
-            kernel = this->kernel(*ht1, *ht2);
-            // Fill in both halves of the matrix
-            _kernel_m(i, j) = kernel;
-            _kernel_m(j, i) = kernel;
-            if (verbosity > 0) {
-                #pragma omp critical
-                {
-                    *outstream << i + 1 << " x " << j + 1 << " done!"
-                               << std::endl;
-                }
+        }
+        _calculate_tile(hash_fnames, pairs);
+    }
+}
+
+void
+Kernel::
+_mark_done(size_t i, size_t j, float kernel)
+{
+    if (_done_pairs.empty()) {
+        _done_pairs.assign(num_samples * (num_samples + 1) / 2, false);
+    }
+    _done_pairs[i * (2 * num_samples - i - 1) / 2 + j] = true;
+    _store_kernel(i, j, kernel);
+}
+
+void
+Kernel::
+_use_previous()
+{
+    const size_t n_prev = _previous.size();
+    if (n_prev == 0) {
+        return;
+    }
+    if (n_prev > num_samples) {
+        throw std::runtime_error("The previous kernel matrix has more samples "
+                                 "than are given");
+    }
+    for (size_t i = 0; i < n_prev; i++) {
+        if (sample_names[i] != _previous_names[i]) {
+            throw std::runtime_error("Sample " + std::to_string(i + 1) +
+                                     " is " + sample_names[i] + ", but is " +
+                                     _previous_names[i] + " in the previous "
+                                     "kernel matrix");
+        }
+    }
+    for (size_t i = 0; i < n_prev; i++) {
+        for (size_t j = i; j < n_prev; j++) {
+            if (_owns_pair(i, j)) {
+                _mark_done(i, j, _previous(i, j));
             }
         }
     }
     if (verbosity > 0) {
-        *outstream << "Done all!" << std::endl;
+        *outstream << "Extending a kernel matrix of " << n_prev
+                   << " samples with " << num_samples - n_prev
+                   << " more" << std::endl;
     }
+}
 
-    if (!matrix_is_pos_semidef(_kernel_m)) {
-        *outstream << "WARNING: The kernel matrix is not positive semidefinite."
-                   << std::endl;
+void
+Kernel::
+_open_checkpoint()
+{
+    if (_checkpoint.empty()) {
+        return;
+    }
+    std::vector<PairKernel> done;
+    _journal.reset(new PairJournal(_checkpoint, sample_names, _resume, done));
+    if (done.empty()) {
+        return;
+    }
+    // Self kernels first, as neighbours' distances need them
+    std::stable_partition(done.begin(), done.end(),
+                          [](const PairKernel &pair_kernel) {
+                              return pair_kernel.pair.first ==
+                                     pair_kernel.pair.second;
+                          });
+    size_t n_resumed = 0;
+    for (const auto &pair_kernel: done) {
+        const size_t i = pair_kernel.pair.first;
+        const size_t j = pair_kernel.pair.second;
+        // A journal of an unsharded run may hold pairs of other shards
+        if (_pair_done(i, j) || !_owns_pair(i, j) || !_wanted_pair(i, j)) {
+            continue;
+        }
+        // A journal of a run without neighbours may lack a pair's self
+        // kernels, without which its distance can't be derived. The pair is
+        // computed again after them.
+        if (_knn > 0 && i != j && (!_pair_done(i, i) || !_pair_done(j, j))) {
+            continue;
+        }
+        _mark_done(i, j, pair_kernel.kernel);
+        if (!_stderr_m.empty()) {
+            _stderr_m(i, j) = pair_kernel.error;
+        }
+        n_resumed++;
+    }
+    if (verbosity > 0) {
+        *outstream << "Resuming with " << n_resumed << " pairs done, from "
+                   << _checkpoint << std::endl;
+    }
+}
+
+void
+Kernel::
+_check_psd()
+{
+    if (!check_psd) {
+        return;
+    }
+    auto start = std::chrono::steady_clock::now();
+    const bool psd = _kernel_m.is_pos_semidef(1e-5, _num_threads);
+    std::chrono::duration<double> secs =
+            std::chrono::steady_clock::now() - start;
+    if (!psd) {
+        *outstream << "WARNING: The kernel matrix is not positive "
+                   << "semidefinite.";
     } else {
-        *outstream << "The kernel matrix is positive semidefinite."
-                   << std::endl;
+        *outstream << "The kernel matrix is positive semidefinite.";
+    }
+    std::ostringstream took;
+    took << std::fixed << std::setprecision(3) << secs.count();
+    *outstream << " (checked in " << took.str() << "s)" << std::endl;
+}
+
+void
+Kernel::
+_calculate_tile(std::vector<std::string> &hash_fnames,
+                const std::vector<SamplePair> &pairs)
+{
+    std::vector<size_t> samples;
+
+    if (pairs.empty()) {
+        return;
+    }
+
+    for (const auto &pair: pairs) {
+        samples.push_back(pair.first);
+        samples.push_back(pair.second);
+    }
+    std::sort(samples.begin(), samples.end());
+    samples.erase(std::unique(samples.begin(), samples.end()), samples.end());
+
+    // Threads are shared out between the tile's loads, which may each use
+    // several, so this region's loads may nest parallel regions of their own
+    std::vector<SampleShrPtr> loaded(samples.size());
+    const int n_loaders = std::min<size_t>(_num_threads, samples.size());
+    const int load_threads = std::max(_num_threads / n_loaders, 1);
+    const int max_levels = omp_get_max_active_levels();
+    omp_set_max_active_levels(std::max(max_levels, 2));
+    #pragma omp parallel for schedule(dynamic) num_threads(n_loaders)
+    for (size_t s = 0; s < samples.size(); s++) {
+        loaded[s] = _get_sample(hash_fnames[samples[s]], load_threads);
+    }
+    omp_set_max_active_levels(max_levels);
+    for (size_t s = 1; s < loaded.size(); s++) {
+        _check_sample_dimensions(*loaded[0], *loaded[s]);
+    }
+
+    // Each side of each pair
+    std::vector<const Sample *> a_samples, b_samples;
+    for (const auto &pair: pairs) {
+        size_t a = std::lower_bound(samples.begin(), samples.end(),
+                                    pair.first) - samples.begin();
+        size_t b = std::lower_bound(samples.begin(), samples.end(),
+                                    pair.second) - samples.begin();
+        a_samples.push_back(loaded[a].get());
+        b_samples.push_back(loaded[b].get());
+    }
+
+    std::vector<khmer::HashIntoType> tablesizes = loaded[0]->tablesizes();
+    const size_t n_tables = tablesizes.size();
+    const size_t n_pairs = pairs.size();
+    const size_t block = _bin_block_size(samples.size());
+    std::vector<std::vector<double>> tab_kernels(n_pairs,
+                                                 std::vector<double>(n_tables));
+    // Samples hold a subset of bins, from which kernels are estimated
+    const bool estimating = _bin_subset &&
+                            tablesizes == _bin_subset->subset_sizes();
+    std::vector<std::vector<double>> tab_errors(n_pairs,
+                                                std::vector<double>(n_tables));
+
+    for (size_t tab = 0; tab < n_tables; tab++) {
+        const size_t tabsz = tablesizes[tab];
+        const size_t n_blocks = (tabsz + block - 1) / block;
+        // The standard error is taken from each pair's kernels over a fixed
+        // number of batches of the table's bins, equal in size but for one
+        // bin. Blocks are split where they cross batches. Exact kernels need
+        // one batch.
+        const size_t n_batches = estimating ?
+                std::min(kernel_error_batches, tabsz) : 1;
+        auto batch_start = [tabsz, n_batches](size_t b) {
+            return b * tabsz / n_batches;
+        };
+        auto batch_of = [tabsz, n_batches](size_t bin) {
+            return ((bin + 1) * n_batches + tabsz - 1) / tabsz - 1;
+        };
+        // Per-thread partial sums, reduced in thread order below so the
+        // result doesn't depend on scheduling.
+        std::vector<std::vector<double>> partials(_num_threads,
+                std::vector<double>(n_pairs * n_batches));
+
+        // Exceptions can't leave a parallel region, so the first is kept and
+        // rethrown after it
+        std::exception_ptr error;
+        #pragma omp parallel num_threads(_num_threads)
+        {
+            std::vector<double> &partial = partials[omp_get_thread_num()];
+            #pragma omp for schedule(static)
+            for (size_t blk = 0; blk < n_blocks; blk++) {
+                const size_t start = blk * block;
+                const size_t end = std::min(start + block, tabsz);
+                try {
+                    for (size_t p = 0; p < n_pairs; p++) {
+                        double *pair_batches = &partial[p * n_batches];
+                        for (size_t lo = start, hi; lo < end; lo = hi) {
+                            const size_t b = batch_of(lo);
+                            hi = std::min(end, batch_start(b + 1));
+                            pair_batches[b] +=
+                                    _sample_table_kernel(*a_samples[p],
+                                                         *b_samples[p],
+                                                         tab, lo, hi);
+                        }
+                    }
+                } catch (...) {
+                    #pragma omp critical
+                    if (!error) {
+                        error = std::current_exception();
+                    }
+                }
+            }
+        }
+        if (error) {
+            std::rethrow_exception(error);
+        }
+        std::vector<double> batches(n_batches);
+        for (size_t p = 0; p < n_pairs; p++) {
+            std::fill(batches.begin(), batches.end(), 0.0);
+            for (int t = 0; t < _num_threads; t++) {
+                for (size_t b = 0; b < n_batches; b++) {
+                    batches[b] += partials[t][p * n_batches + b];
+                }
+            }
+            double sum = 0;
+            for (const double batch: batches) {
+                sum += batch;
+            }
+            if (!estimating) {
+                tab_kernels[p][tab] = sum;
+                continue;
+            }
+
+            // Scale up to the whole table. The variance of the subset's sum
+            // is the batches' variance times their number, less the fraction
+            // of the table sampled.
+            const double scale = _bin_subset->scale(tab);
+            double var = 0;
+            if (n_batches > 1) {
+                const double mean = sum / n_batches;
+                for (const double batch: batches) {
+                    var += (batch - mean) * (batch - mean);
+                }
+                var = var / (n_batches - 1) * n_batches * (1 - 1 / scale);
+            }
+            tab_kernels[p][tab] = sum * scale;
+            tab_errors[p][tab] = scale * sqrt(var);
+        }
+    }
+
+    std::vector<PairKernel> kernels;
+    for (size_t p = 0; p < n_pairs; p++) {
+        const size_t i = pairs[p].first;
+        const size_t j = pairs[p].second;
+        // The kernel, and the error, of the table with the least kernel
+        const size_t min_tab = std::min_element(tab_kernels[p].begin(),
+                                                tab_kernels[p].end()) -
+                               tab_kernels[p].begin();
+        PairKernel pair_kernel;
+        pair_kernel.pair = pairs[p];
+        pair_kernel.kernel = tab_kernels[p][min_tab];
+        pair_kernel.error = tab_errors[p][min_tab];
+        _store_kernel(i, j, pair_kernel.kernel);
+        if (!_stderr_m.empty()) {
+            _stderr_m(i, j) = pair_kernel.error;
+        }
+        kernels.push_back(pair_kernel);
+        if (verbosity > 0) {
+            *outstream << i + 1 << " x " << j + 1 << " done!" << std::endl;
+        }
+    }
+    if (_journal) {
+        // Only queued here; the journal's thread writes them
+        _journal->append(kernels);
+    }
+}
+
+double
+Kernel::
+_table_kernel(const khmer::Byte *A, const khmer::Byte *B, size_t tab,
+              size_t start, size_t end)
+{
+    (void)A;
+    (void)B;
+    (void)tab;
+    (void)start;
+    (void)end;
+    throw std::logic_error(name + " doesn't implement _table_kernel");
+}
+
+double
+Kernel::
+_table_kernel_sparse_dense(const SparseTable &A, const khmer::Byte *B,
+                           size_t tab, size_t start, size_t end)
+{
+    (void)A;
+    (void)B;
+    (void)tab;
+    (void)start;
+    (void)end;
+    throw std::logic_error(name + " doesn't implement _table_kernel_sparse_dense");
+}
+
+double
+Kernel::
+_table_kernel_sparse(const SparseTable &A, const SparseTable &B, size_t tab,
+                     size_t start, size_t end)
+{
+    (void)A;
+    (void)B;
+    (void)tab;
+    (void)start;
+    (void)end;
+    throw std::logic_error(name + " doesn't implement _table_kernel_sparse");
+}
+
+double
+Kernel::
+_sample_table_kernel(const Sample &a, const Sample &b, size_t tab,
+                     size_t start, size_t end)
+{
+    const khmer::Byte *A = a.dense_table(tab);
+    const khmer::Byte *B = b.dense_table(tab);
+    // Kernels are symmetric, so a sparse table is always on the left
+    const SparseTable *A_sparse = a.sparse_table(tab);
+    const SparseTable *B_sparse = b.sparse_table(tab);
+    if (A != NULL && B != NULL) {
+        // Lead with the sparser indexed side, if sparse enough to pay off
+        if (A_sparse == NULL ||
+                (B_sparse != NULL && B_sparse->nnz() < A_sparse->nnz())) {
+            std::swap(A_sparse, B_sparse);
+            std::swap(A, B);
+        }
+        if (A_sparse != NULL &&
+                A_sparse->nnz() < _sparse_below * A_sparse->tablesize()) {
+            return _table_kernel_sparse_dense(*A_sparse, B, tab, start, end);
+        }
+        return _table_kernel(A, B, tab, start, end);
+    }
+    if (A == NULL && B == NULL) {
+        return _table_kernel_sparse(*A_sparse, *B_sparse, tab, start, end);
     }
+    if (A == NULL) {
+        return _table_kernel_sparse_dense(*A_sparse, B, tab, start, end);
+    }
+    return _table_kernel_sparse_dense(*B_sparse, A, tab, start, end);
+}
+
+size_t
+Kernel::
+_bin_block_size(size_t n_samples)
+{
+    // One byte per sample per bin, plus some room for per-bin weights
+    size_t block = kernel_block_bytes / (n_samples + sizeof(float));
+    block = std::max(block, (size_t)4096);
+    // Keep blocks aligned to cache lines
+    return block & ~(size_t)63;
 }
 
 void
 Kernel::
 print_kernel_mat(std::ostream &outstream)
 {
-    if (_kernel_m.size() == 1) {
+    if (!_cross_m.empty()) {
+        std::vector<std::string> queries(sample_names.begin(),
+                                         sample_names.begin() + _n_queries);
+        std::vector<std::string> references(sample_names.begin() + _n_queries,
+                                            sample_names.end());
+        _cross_m.print(outstream, queries, references, KernelMatrix::KERNEL,
+                       _num_threads);
+        return;
+    }
+    if (_kernel_m.empty()) {
         // No kernel has been calculated
         throw std::runtime_error("No kernel matrix exists");
     }
-    print_lsmat(_kernel_m, outstream, sample_names);
+    _kernel_m.print(outstream, sample_names, KernelMatrix::KERNEL,
+                    _num_threads);
 }
 
 void
 Kernel::
 get_kernel_matrix(MatrixXd &mat)
 {
-    if (_kernel_m.size() == 1) {
+    if (!_cross_m.empty()) {
+        _cross_m.to_dense(mat, KernelMatrix::KERNEL, _num_threads);
+        return;
+    }
+    if (_kernel_m.empty()) {
         // No kernel has been calculated
         throw std::runtime_error("No kernel matrix exists");
     }
-    mat = _kernel_m;
+    _kernel_m.to_dense(mat, KernelMatrix::KERNEL, _num_threads);
 }
 
 void
 Kernel::
 get_norm_kernel_matrix(MatrixXd &mat)
 {
-    if (_kernel_m.size() == 1) {
+    if (!_cross_m.empty()) {
+        _cross_m.to_dense(mat, KernelMatrix::NORMALISED, _num_threads);
+        return;
+    }
+    if (_kernel_m.empty()) {
         // No kernel has been calculated
         throw std::runtime_error("No kernel matrix exists");
     }
-    normalise_matrix(mat, _kernel_m);
+    _kernel_m.to_dense(mat, KernelMatrix::NORMALISED, _num_threads);
 }
 
 void
 Kernel::
 get_distance_matrix(MatrixXd &mat)
 {
-    if (_kernel_m.size() == 1) {
+    if (!_cross_m.empty()) {
+        _cross_m.to_dense(mat, KernelMatrix::DISTANCE, _num_threads);
+        return;
+    }
+    if (_kernel_m.empty()) {
         // No kernel has been calculated
         throw std::runtime_error("No kernel matrix exists");
     }
-    MatrixXd dist(num_samples, num_samples);
-    kernel_to_distance(mat, _kernel_m);
+    _kernel_m.to_dense(mat, KernelMatrix::DISTANCE, _num_threads);
 }
 
 void
 Kernel::
 print_distance_mat(std::ostream &outstream)
 {
-    if (_kernel_m.size() == 1) {
+    if (!_cross_m.empty()) {
+        std::vector<std::string> queries(sample_names.begin(),
+                                         sample_names.begin() + _n_queries);
+        std::vector<std::string> references(sample_names.begin() + _n_queries,
+                                            sample_names.end());
+        _cross_m.print(outstream, queries, references, KernelMatrix::DISTANCE,
+                       _num_threads);
+        return;
+    }
+    if (_kernel_m.empty()) {
+        // No kernel has been calculated
+        throw std::runtime_error("No kernel matrix exists");
+    }
+    // Normalised and converted to distances a block of rows at a time
+    _kernel_m.print(outstream, sample_names, KernelMatrix::DISTANCE,
+                    _num_threads);
+}
+
+void
+Kernel::
+save_kernel_npy(std::ostream &out)
+{
+    if (!_cross_m.empty()) {
+        _cross_m.save_npy(out, KernelMatrix::KERNEL, _num_threads);
+        return;
+    }
+    if (_kernel_m.empty()) {
+        // No kernel has been calculated
+        throw std::runtime_error("No kernel matrix exists");
+    }
+    _kernel_m.save_npy(out, KernelMatrix::KERNEL, _num_threads);
+}
+
+void
+Kernel::
+save_distance_npy(std::ostream &out)
+{
+    if (!_cross_m.empty()) {
+        _cross_m.save_npy(out, KernelMatrix::DISTANCE, _num_threads);
+        return;
+    }
+    if (_kernel_m.empty()) {
         // No kernel has been calculated
         throw std::runtime_error("No kernel matrix exists");
     }
-    MatrixXd dist;
-    get_distance_matrix(dist);
-    print_lsmat(dist, outstream, sample_names);
+    _kernel_m.save_npy(out, KernelMatrix::DISTANCE, _num_threads);
 }
 
 
@@ -201,29 +823,648 @@ Kernel::
 set_num_threads(int num_threads)
 {
     _num_threads = num_threads;
+    _resize_hash_cache();
+}
 
-    // Update the hash cache size
-    _hash_cache = CountingHashCache(_num_threads + 1);
+void
+Kernel::
+set_tile_size(size_t tile_size)
+{
+    _tile_size = std::max(tile_size, (size_t)1);
+    _tile_size_auto = false;
+    _resize_hash_cache();
 }
 
-CountingHashShrPtr
+void
+Kernel::
+set_cache_mem(size_t bytes)
+{
+    _cache_mem = bytes;
+    _resize_hash_cache();
+}
+
+void
+Kernel::
+set_io_threads(size_t io_threads)
+{
+    _io_threads = io_threads;
+    _resize_hash_cache();
+}
+
+void
+Kernel::
+set_prefetch_depth(size_t depth)
+{
+    _prefetch_depth = depth;
+    _resize_hash_cache();
+}
+
+void
+Kernel::
+set_sparse_below(double fraction)
+{
+    _sparse_below = fraction;
+}
+
+void
 Kernel::
-_get_hash(std::string &filename)
-{
-    CountingHashShrPtr ret;
-    omp_set_lock(&_hash_cache_lock);
-    while (1) {
-        try {
-            ret = _hash_cache.get(filename);
-            omp_unset_lock(&_hash_cache_lock);
-            return ret;
-        } catch (std::range_error &err) {
-            CountingHashShrPtr ht = \
-                    std::make_shared<khmer::CountingHash>(1, 1);
-            khmer::CountingHashFile::load(filename, *ht);
-            _hash_cache.put(filename, ht);
+set_scratch_dir(const std::string &dir)
+{
+    _scratch_dir = dir;
+}
+
+void
+Kernel::
+set_shard(size_t shard, size_t n_shards)
+{
+    if (n_shards == 0 || shard >= n_shards) {
+        throw std::invalid_argument("Invalid shard " + std::to_string(shard) +
+                                    " of " + std::to_string(n_shards));
+    }
+    _shard = shard;
+    _n_shards = n_shards;
+}
+
+// Shard files hold the kernels of one shard's pairs, 8-byte aligned:
+//
+//   signature[4] u8:version u8:0 u8:0 u8:0
+//   u64:n_samples u64:shard u64:n_shards u64:n_pairs u64:label_bytes
+//   labels[label_bytes] (sample names, each ending in a newline; padded)
+//   for each pair: u32:i u32:j f32:kernel u32:0
+void
+Kernel::
+save_shard(const std::string &filename)
+{
+    if (_n_shards == 1 || sample_names.size() != num_samples) {
+        throw std::runtime_error("No shard has been calculated");
+    }
+    std::ofstream out(filename, std::ios::binary);
+    if (!out) {
+        throw std::runtime_error("Cannot open shard for writing: " + filename);
+    }
+    std::string labels;
+    for (const auto &name: sample_names) {
+        labels += name + "\n";
+    }
+
+    out.write(SHARD_SIGNATURE.data(), 4);
+    write_val<uint8_t>(out, SHARD_VERSION);
+    write_val<uint8_t>(out, 0);
+    write_val<uint8_t>(out, 0);
+    write_val<uint8_t>(out, 0);
+    write_val<uint64_t>(out, num_samples);
+    write_val<uint64_t>(out, _shard);
+    write_val<uint64_t>(out, _n_shards);
+    write_val<uint64_t>(out, _shard_kernels.size());
+    write_val<uint64_t>(out, labels.size());
+    out.write(labels.data(), labels.size());
+    write_padding(out, labels.size());
+    for (const auto &pair_kernel: _shard_kernels) {
+        write_val<uint32_t>(out, pair_kernel.first.first);
+        write_val<uint32_t>(out, pair_kernel.first.second);
+        write_val<float>(out, pair_kernel.second);
+        write_val<uint32_t>(out, 0);
+    }
+    if (!out) {
+        throw std::runtime_error("Failed to write shard: " + filename);
+    }
+}
+
+void
+Kernel::
+merge_shards(const std::vector<std::string> &filenames)
+{
+    std::vector<bool> seen_shards;
+    std::vector<bool> seen_pairs;
+    std::string all_labels;
+    size_t n_pairs_seen = 0;
+
+    if (filenames.empty()) {
+        throw std::runtime_error("No shards to merge");
+    }
+
+    for (const auto &filename: filenames) {
+        std::ifstream in(filename, std::ios::binary);
+        if (!in) {
+            throw std::runtime_error("Cannot open shard: " + filename);
+        }
+        const std::string what = "shard: " + filename;
+        char sig[4];
+        if (!in.read(sig, 4) || std::string(sig, 4) != SHARD_SIGNATURE) {
+            throw std::runtime_error("Not a kWIP shard: " + filename);
+        }
+        if (read_val<uint8_t>(in, what) != SHARD_VERSION) {
+            throw std::runtime_error("Incorrect kWIP shard version: " +
+                                     filename);
+        }
+        for (int i = 0; i < 3; i++) {
+            read_val<uint8_t>(in, what);
+        }
+        const uint64_t n_samples = read_val<uint64_t>(in, what);
+        const uint64_t shard = read_val<uint64_t>(in, what);
+        const uint64_t n_shards = read_val<uint64_t>(in, what);
+        const uint64_t n_pairs = read_val<uint64_t>(in, what);
+        const uint64_t label_bytes = read_val<uint64_t>(in, what);
+        std::string labels(label_bytes, '\0');
+        if (!in.read(&labels[0], label_bytes)) {
+            throw std::runtime_error("Unexpected end of " + what);
+        }
+        in.ignore((8 - label_bytes % 8) % 8);
+
+        if (seen_shards.empty()) {
+            // The first shard sets the samples, and the number of shards
+            num_samples = n_samples;
+            all_labels = labels;
+            seen_shards.assign(n_shards, false);
+            seen_pairs.assign(n_samples * (n_samples + 1) / 2, false);
+            _kernel_m.resize(n_samples);
+            sample_names.clear();
+            std::istringstream names(labels);
+            std::string name;
+            while (std::getline(names, name)) {
+                sample_names.push_back(name);
+            }
+        } else if (n_samples != num_samples || labels != all_labels ||
+                   n_shards != seen_shards.size()) {
+            throw std::runtime_error("Shard is of another calculation: " +
+                                     filename);
+        }
+        if (shard >= n_shards || seen_shards[shard]) {
+            throw std::runtime_error("Shard " + std::to_string(shard + 1) +
+                                     " given more than once: " + filename);
+        }
+        seen_shards[shard] = true;
+
+        for (uint64_t p = 0; p < n_pairs; p++) {
+            const size_t i = read_val<uint32_t>(in, what);
+            const size_t j = read_val<uint32_t>(in, what);
+            const float kernel = read_val<float>(in, what);
+            read_val<uint32_t>(in, what);
+            if (i > j || j >= num_samples) {
+                throw std::runtime_error("Invalid pair in shard: " + filename);
+            }
+            const size_t idx = i * (2 * num_samples - i - 1) / 2 + j;
+            if (seen_pairs[idx]) {
+                throw std::runtime_error("Pair " + sample_names[i] + " x " +
+                                         sample_names[j] + " computed more "
+                                         "than once: " + filename);
+            }
+            seen_pairs[idx] = true;
+            _kernel_m(i, j) = kernel;
+        }
+        n_pairs_seen += n_pairs;
+    }
+
+    for (size_t shard = 0; shard < seen_shards.size(); shard++) {
+        if (!seen_shards[shard]) {
+            throw std::runtime_error("Shard " + std::to_string(shard + 1) +
+                                     " of " +
+                                     std::to_string(seen_shards.size()) +
+                                     " is missing");
+        }
+    }
+    if (n_pairs_seen != seen_pairs.size()) {
+        throw std::runtime_error("Shards are missing " +
+                                 std::to_string(seen_pairs.size() -
+                                                n_pairs_seen) + " pairs");
+    }
+    if (verbosity > 0) {
+        *outstream << "Merged " << seen_shards.size() << " shards of "
+                   << num_samples << " samples" << std::endl;
+    }
+    _check_psd();
+}
+
+void
+Kernel::
+load_previous(std::istream &instream)
+{
+    std::vector<std::string> labels;
+    std::string line, label;
+
+    if (!std::getline(instream, line)) {
+        throw std::runtime_error("Kernel matrix is empty");
+    }
+    std::istringstream header(line);
+    while (header >> label) {
+        labels.push_back(label);
+    }
+    const size_t n = labels.size();
+    _previous.resize(n);
+    for (size_t i = 0; i < n; i++) {
+        if (!std::getline(instream, line)) {
+            throw std::runtime_error("Kernel matrix ends before row " +
+                                     std::to_string(i + 1));
+        }
+        std::istringstream row(line);
+        if (!(row >> label) || label != labels[i]) {
+            throw std::runtime_error("Row " + std::to_string(i + 1) +
+                                     " of the kernel matrix isn't " +
+                                     labels[i]);
+        }
+        for (size_t j = 0; j < n; j++) {
+            double val;
+            if (!(row >> val)) {
+                throw std::runtime_error("Row " + std::to_string(i + 1) +
+                                         " of the kernel matrix is short");
+            }
+            if (j >= i) {
+                _previous(i, j) = val;
+            }
+        }
+    }
+    _previous_names = labels;
+}
+
+void
+Kernel::
+load_previous_npy(std::istream &instream,
+                  const std::vector<std::string> &labels)
+{
+    size_t rows, cols;
+    read_npy_header(instream, rows, cols);
+    if (rows != cols || rows != labels.size()) {
+        throw std::runtime_error("Kernel matrix is " + std::to_string(rows) +
+                                 " x " + std::to_string(cols) + ", for " +
+                                 std::to_string(labels.size()) + " samples");
+    }
+    _previous.resize(rows);
+    std::vector<float> row(cols);
+    for (size_t i = 0; i < rows; i++) {
+        if (!instream.read((char *)row.data(), cols * sizeof(float))) {
+            throw std::runtime_error("Unexpected end of .npy array");
+        }
+        for (size_t j = i; j < cols; j++) {
+            _previous(i, j) = row[j];
+        }
+    }
+    _previous_names = labels;
+}
+
+void
+Kernel::
+set_knn(size_t k)
+{
+    _knn = k;
+}
+
+void
+Kernel::
+print_neighbours(std::ostream &outstream)
+{
+    if (_knn == 0 || _neighbours.size() != num_samples) {
+        throw std::runtime_error("No neighbours have been kept");
+    }
+    for (size_t i = 0; i < num_samples; i++) {
+        std::vector<std::pair<float, uint32_t>> nearest(_neighbours[i]);
+        std::sort_heap(nearest.begin(), nearest.end());
+        for (const auto &neighbour: nearest) {
+            outstream << sample_names[i] << "\t"
+                      << sample_names[neighbour.second] << "\t"
+                      << neighbour.first << "\n";
+        }
+    }
+}
+
+void
+Kernel::
+set_bin_fraction(double fraction)
+{
+    if (!(fraction > 0 && fraction <= 1)) {
+        throw std::invalid_argument("The fraction of bins kept must be in "
+                                    "(0, 1]");
+    }
+    _bin_fraction = fraction;
+    _bin_subset.reset();
+}
+
+void
+Kernel::
+print_stderr_mat(std::ostream &outstream)
+{
+    if (_stderr_m.empty()) {
+        throw std::runtime_error("No kernel matrix has been estimated from a "
+                                 "subset of bins, other than by extending a "
+                                 "previous matrix");
+    }
+    _stderr_m.print(outstream, sample_names, KernelMatrix::KERNEL,
+                    _num_threads);
+}
+
+void
+Kernel::
+set_checkpoint(const std::string &filename, bool resume)
+{
+    _checkpoint = filename;
+    _resume = resume;
+}
+
+SampleCacheStats
+Kernel::
+cache_stats()
+{
+    return _hash_cache.stats();
+}
+
+void
+Kernel::
+_resize_hash_cache()
+{
+    if (_cache_mem > 0) {
+        _hash_cache.set_limits(_cache_mem, 0);
+    } else {
+        _hash_cache.set_limits(0, _cache_entries());
+    }
+}
+
+size_t
+Kernel::
+_cache_entries()
+{
+    // Hold the fewest tiles the schedule walks with, and those loading ahead
+    return std::max((size_t)_num_threads + 1,
+                    (schedule_min_cache_tiles + _prefetch_tiles()) *
+                    _tile_size);
+}
+
+size_t
+Kernel::
+_prefetch_tiles()
+{
+    return _io_threads > 0 ? _prefetch_depth : 0;
+}
+
+int
+Kernel::
+_prefetch_load_threads()
+{
+    return std::max(_num_threads / (int)std::max(_io_threads, (size_t)1), 1);
+}
+
+size_t
+Kernel::
+_plan_tiles(std::vector<std::string> &hash_fnames)
+{
+    if (_cache_mem == 0 || hash_fnames.empty()) {
+        // The cache holds a fixed number of samples
+        size_t cache_tiles = _cache_entries() / _tile_size;
+        return std::max(cache_tiles,
+                        _prefetch_tiles() + schedule_min_cache_tiles) -
+               _prefetch_tiles();
+    }
+    size_t sample_bytes = std::max(_get_sample(hash_fnames[0],
+                                               _num_threads)->bytes(),
+                                   (size_t)1);
+    if (_tile_size_auto) {
+        _tile_size = std::min(_cache_mem /
+                              ((schedule_min_cache_tiles + _prefetch_tiles()) *
+                               sample_bytes),
+                              kernel_max_auto_tile);
+        _tile_size = std::max(_tile_size, (size_t)1);
+        if (verbosity > 0) {
+            *outstream << "Using tiles of " << _tile_size << " samples"
+                       << std::endl;
+        }
+    }
+    size_t cache_tiles = _cache_mem / (_tile_size * sample_bytes);
+    return std::max(cache_tiles,
+                    _prefetch_tiles() + schedule_min_cache_tiles) -
+           _prefetch_tiles();
+}
+
+void
+Kernel::
+_prefetch_tile_pair(Prefetcher &prefetcher,
+                    std::vector<std::string> &hash_fnames,
+                    const TilePair &tile_pair)
+{
+    if (_n_shards > 1 || _n_queries > 0 || !_done_pairs.empty()) {
+        // Only the samples of pairs left to compute
+        std::vector<size_t> samples;
+        for (const auto &pair: _tile_pairs(tile_pair.first,
+                                           tile_pair.second)) {
+            samples.push_back(pair.first);
+            samples.push_back(pair.second);
+        }
+        std::sort(samples.begin(), samples.end());
+        samples.erase(std::unique(samples.begin(), samples.end()),
+                      samples.end());
+        for (size_t i: samples) {
+            prefetcher.enqueue(hash_fnames[i]);
+        }
+        return;
+    }
+    for (size_t tile: {tile_pair.first, tile_pair.second}) {
+        size_t end = std::min((tile + 1) * _tile_size, num_samples);
+        for (size_t i = tile * _tile_size; i < end; i++) {
+            prefetcher.enqueue(hash_fnames[i]);
+        }
+        if (tile_pair.first == tile_pair.second) {
+            break;
+        }
+    }
+}
+
+std::vector<SamplePair>
+Kernel::
+_tile_pairs(size_t ti, size_t tj)
+{
+    std::vector<SamplePair> pairs;
+    size_t i_end = std::min((ti + 1) * _tile_size, num_samples);
+    size_t j_end = std::min((tj + 1) * _tile_size, num_samples);
+    for (size_t i = ti * _tile_size; i < i_end; i++) {
+        for (size_t j = std::max(i, tj * _tile_size); j < j_end; j++) {
+            if (!_owns_pair(i, j) || !_wanted_pair(i, j)) {
+                continue;
+            }
+            // Self kernels were computed before the other pairs
+            if (_knn > 0 && i == j) {
+                continue;
+            }
+            if (_pair_done(i, j)) {
+                continue;
+            }
+            pairs.emplace_back(i, j);
+        }
+    }
+    return pairs;
+}
+
+// Blocks of pairs per shard. More blocks balance the shards better, but
+// split tiles so that more samples are loaded by more than one shard.
+static const size_t shard_blocks_per_shard = 4;
+
+void
+Kernel::
+_plan_shards()
+{
+    // Split the samples into n blocks, for at least shard_blocks_per_shard
+    // blocks of pairs per shard
+    size_t n = 1;
+    while (n < num_samples &&
+            n * (n + 1) / 2 < shard_blocks_per_shard * _n_shards) {
+        n++;
+    }
+    _shard_block = std::max((num_samples + n - 1) / n, (size_t)1);
+    _n_shard_blocks = std::max((num_samples + _shard_block - 1) /
+                               _shard_block, (size_t)1);
+
+    // Give each block of pairs, largest first, to the shard with the fewest
+    // pairs so far. Ties go to the earlier block and the lower shard.
+    std::vector<std::pair<size_t, size_t>> blocks; // (pairs, bi * n + bj)
+    for (size_t bi = 0; bi < _n_shard_blocks; bi++) {
+        const size_t size_i = std::min(_shard_block,
+                                       num_samples - bi * _shard_block);
+        for (size_t bj = bi; bj < _n_shard_blocks; bj++) {
+            const size_t size_j = std::min(_shard_block,
+                                           num_samples - bj * _shard_block);
+            const size_t n_pairs = bi == bj ? size_i * (size_i + 1) / 2 :
+                                              size_i * size_j;
+            blocks.emplace_back(n_pairs, bi * _n_shard_blocks + bj);
         }
     }
+    std::stable_sort(blocks.begin(), blocks.end(),
+                     [](const std::pair<size_t, size_t> &a,
+                        const std::pair<size_t, size_t> &b) {
+                         return a.first > b.first;
+                     });
+    std::vector<size_t> shard_pairs(_n_shards, 0);
+    _shard_owners.assign(_n_shard_blocks * _n_shard_blocks, 0);
+    for (const auto &block: blocks) {
+        size_t shard = std::min_element(shard_pairs.begin(),
+                                        shard_pairs.end()) -
+                       shard_pairs.begin();
+        _shard_owners[block.second] = shard;
+        shard_pairs[shard] += block.first;
+    }
+    if (verbosity > 0) {
+        *outstream << "Computing shard " << _shard + 1 << " of " << _n_shards
+                   << ": " << shard_pairs[_shard] << " of "
+                   << num_samples * (num_samples + 1) / 2 << " pairs"
+                   << std::endl;
+    }
+}
+
+bool
+Kernel::
+_owns_pair(size_t i, size_t j) const
+{
+    if (_n_shards == 1) {
+        return true;
+    }
+    const size_t bi = i / _shard_block;
+    const size_t bj = j / _shard_block;
+    return _shard_owners[bi * _n_shard_blocks + bj] == _shard;
+}
+
+SampleShrPtr
+Kernel::
+_get_sample(const std::string &filename, int num_threads)
+{
+    return _hash_cache.get(filename, [&](const std::string &fname) {
+        auto scratch = _scratch_paths.find(fname);
+        SampleShrPtr sample = load_sample(scratch == _scratch_paths.end() ?
+                                          fname : scratch->second, use_mmap,
+                                          num_threads);
+        if (_bin_fraction < 1) {
+            sample = _subsample_bins(sample, num_threads);
+        }
+        if (sample->occupancy() < _sparse_below) {
+            sample->index_occupied();
+        }
+        return sample;
+    });
+}
+
+SampleShrPtr
+Kernel::
+_subsample_bins(SampleShrPtr sample, int num_threads)
+{
+    std::shared_ptr<BinSubset> subset;
+    {
+        // Samples load on many threads, but the subset is chosen once
+        std::lock_guard<std::mutex> lock(_bin_subset_mutex);
+        if (!_bin_subset) {
+            _bin_subset = std::make_shared<BinSubset>(sample->tablesizes(),
+                                                      _bin_fraction,
+                                                      num_threads);
+        }
+        subset = _bin_subset;
+    }
+    // Scratch copies hold the subset already, and samples of other
+    // dimensions are left to fail the usual checks
+    if (sample->tablesizes() != subset->tablesizes()) {
+        return sample;
+    }
+    return subset->apply(*sample, num_threads);
+}
+
+bool
+Kernel::
+_cache_holds(const std::vector<std::string> &hash_fnames)
+{
+    if (hash_fnames.empty()) {
+        return true;
+    }
+    if (_cache_mem == 0) {
+        return hash_fnames.size() <= _cache_entries();
+    }
+    // Samples are all much the same size, as their tables must match
+    return _get_sample(hash_fnames[0], _num_threads)->bytes() *
+           hash_fnames.size() <=
+           _cache_mem;
+}
+
+std::string
+Kernel::
+_write_scratch_copy(const Sample &sample, size_t idx)
+{
+    const CountingHashShrPtr &ht = sample.countgraph();
+    if (!ht) {
+        return "";
+    }
+    std::string path = _scratch_dir + "/kwip-" + std::to_string(getpid()) +
+                       "-" + std::to_string(idx);
+    // A sketch takes three bytes per occupied bin, a countgraph one per bin
+    if (sample.occupancy() < 1.0 / 3) {
+        path += ".ks";
+        sample.save_sketch(path);
+    } else {
+        path += ".ct";
+        khmer::CountingHashFile::save(path, *ht);
+    }
+    return path;
+}
+
+void
+Kernel::
+_remove_scratch_copies()
+{
+    for (const auto &scratch: _scratch_paths) {
+        std::remove(scratch.second.c_str());
+    }
+    _scratch_paths.clear();
+}
+
+CountingHashShrPtr
+Kernel::
+_get_hash(const std::string &filename)
+{
+    CountingHashShrPtr ht = _get_sample(filename)->countgraph();
+    if (!ht) {
+        throw std::runtime_error("A countgraph is required, not a sketch: " +
+                                 filename);
+    }
+    return ht;
+}
+
+void
+Kernel::
+_check_sample_dimensions(const Sample &a, const Sample &b)
+{
+    if (a.ksize() != b.ksize() || a.tablesizes() != b.tablesizes()) {
+        throw std::runtime_error("Hash dimensions and k-size not equal");
+    }
 }
 
 void
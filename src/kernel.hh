@@ -21,10 +21,15 @@
 
 #include <cmath>
 #include <cassert>
+#include <chrono>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <limits>
 #include <iostream>
 #include <string>
+#include <utility>
+#include <vector>
 
 
 #ifdef _OPENMP
@@ -37,35 +42,286 @@
     #define omp_unset_lock (void)
     #define omp_destroy_lock (void)
     #define omp_get_max_threads(x) (1)
+    #define omp_get_max_active_levels(x) (1)
+    #define omp_set_max_active_levels (void)
 #endif
 
 #include <oxli/counting.hh> // liboxli countgraphs
 
+#include "countgraph.hh"
+#include "journal.hh"
+#include "kernelmatrix.hh"
 #include "kwip-utils.hh"
-#include "lrucache.hpp"
+#include "prefetcher.hh"
+#include "sample.hh"
+#include "samplecache.hh"
+#include "scheduler.hh"
 
 
 namespace kwip
 {
 
-typedef std::shared_ptr<khmer::CountingHash> CountingHashShrPtr;
-typedef cache::lru_cache<std::string, CountingHashShrPtr> CountingHashCache;
+typedef SampleCache<std::string, SampleShrPtr> LoadedSampleCache;
+typedef std::pair<size_t, size_t> SamplePair;
+
+// Shard files hold the kernels of the pairs computed by one shard of a
+// pairwise calculation, to be merged with those of the other shards.
+extern const std::string SHARD_SIGNATURE;
+const uint8_t SHARD_VERSION = 1;
 
 class Kernel
 {
 protected:
-    MatrixXd                    _kernel_m;
+    KernelMatrix                _kernel_m;
+    // Kernels of queries against references, in place of _kernel_m, when
+    // _n_queries > 0. The first _n_queries samples are the queries.
+    CrossKernelMatrix           _cross_m;
+    size_t                      _n_queries;
+    // Neighbours kept per sample, in place of any matrix, or 0. Each
+    // sample's are a max-heap of (distance, neighbour), so the furthest is
+    // replaced first.
+    size_t                      _knn;
+    std::vector<float>          _self_kernels;
+    std::vector<std::vector<std::pair<float, uint32_t>>> _neighbours;
+    // Fraction of bins kernels are estimated from, and the subset of bins
+    // chosen for the tables of the first sample loaded
+    double                      _bin_fraction;
+    std::shared_ptr<BinSubset>  _bin_subset;
+    std::mutex                  _bin_subset_mutex;
+    // Standard errors of the estimated kernels, when estimated
+    KernelMatrix                _stderr_m;
     int                         _num_threads;
-    CountingHashCache           _hash_cache;
-    omp_lock_t                  _hash_cache_lock;
+    size_t                      _tile_size;
+    bool                        _tile_size_auto;
+    size_t                      _cache_mem;
+    size_t                      _io_threads;
+    size_t                      _prefetch_depth;
+    double                      _sparse_below;
+    LoadedSampleCache           _hash_cache;
+    std::string                 _scratch_dir;
+    // Scratch copies of samples, by the filename they were given as
+    std::map<std::string, std::string> _scratch_paths;
+    // This process's shard of the pairwise calculation, of _n_shards. Pairs
+    // are grouped in square blocks of _shard_block samples, and each block
+    // is owned by one shard.
+    size_t                      _shard;
+    size_t                      _n_shards;
+    size_t                      _shard_block;
+    size_t                      _n_shard_blocks;
+    std::vector<size_t>         _shard_owners;
+    // Kernels of the pairs computed by this shard, if sharded
+    std::vector<std::pair<SamplePair, float>> _shard_kernels;
+    // Journal of completed pairs, and whether to resume from it
+    std::string                 _checkpoint;
+    bool                        _resume;
+    std::unique_ptr<PairJournal> _journal;
+    // Pairs not to compute, as they were read back from the journal or the
+    // previous matrix, by their packed index
+    std::vector<bool>           _done_pairs;
+    // A previous kernel matrix of the first samples, being extended
+    KernelMatrix                _previous;
+    std::vector<std::string>    _previous_names;
 
     // Ensure `a` and `b` have the same counting hash dimensions. Throws an
     // exception if they are not.
     virtual void
     _check_hash_dimensions     (const khmer::CountingHash        &a,
                                 const khmer::CountingHash        &b);
+    // Ensure `a` and `b` have the same table dimensions and k-size. Throws
+    // an exception if they are not.
+    void
+    _check_sample_dimensions   (const Sample               &a,
+                                const Sample               &b);
+
+    // A sample, from the cache or loaded into it. Samples with a scratch
+    // copy are loaded from that. Block-compressed countgraphs are inflated,
+    // and when estimating kernels from a subset of bins only those bins are
+    // picked out, on `num_threads` threads. Callers loading several samples
+    // at once share _num_threads out between them.
+    SampleShrPtr
+    _get_sample                (const std::string          &filename,
+                                int                         num_threads=1);
+
+    // The subset of `sample`'s bins that kernels are estimated from,
+    // choosing the subset from its tables if none is yet
+    SampleShrPtr
+    _subsample_bins            (SampleShrPtr                sample,
+                                int                         num_threads);
+
+    // True if the sample cache can hold all of `hash_fnames` at once
+    bool
+    _cache_holds               (const std::vector<std::string> &hash_fnames);
+
+    // Write a compact copy of `sample` to the scratch directory, as a sketch
+    // if that is smaller, otherwise as an uncompressed, mappable countgraph.
+    // Returns its path, or "" if `sample` is already a sketch.
+    std::string
+    _write_scratch_copy        (const Sample               &sample,
+                                size_t                      idx);
+
+    void
+    _remove_scratch_copies     ();
+
+    // The countgraph of a sample. Throws if it was loaded from a sketch.
     CountingHashShrPtr
-    _get_hash                  (std::string                &filename);
+    _get_hash                  (const std::string          &filename);
+
+    // Calculate the partial kernel over bins [start, end) of table `tab`.
+    // Kernels are the minimum over tables of the sum of these partials.
+    // calculate_pairwise() computes kernels through these alone, so every
+    // kernel implements all three; the base class's throw
+    // std::logic_error.
+    virtual double
+    _table_kernel              (const khmer::Byte          *A,
+                                const khmer::Byte          *B,
+                                size_t                      tab,
+                                size_t                      start,
+                                size_t                      end);
+
+    // As _table_kernel, with `A` as a sparse table and `B` dense
+    virtual double
+    _table_kernel_sparse_dense (const SparseTable          &A,
+                                const khmer::Byte          *B,
+                                size_t                      tab,
+                                size_t                      start,
+                                size_t                      end);
+
+    // As _table_kernel, with both `A` and `B` as sparse tables
+    virtual double
+    _table_kernel_sparse       (const SparseTable          &A,
+                                const SparseTable          &B,
+                                size_t                      tab,
+                                size_t                      start,
+                                size_t                      end);
+
+    // The partial kernel between `a` and `b` over bins [start, end) of
+    // table `tab`, through whichever of the above suits their tables. Dense
+    // tables are used unless one side is indexed and sparse enough that
+    // iterating over its occupied bins is cheaper.
+    double
+    _sample_table_kernel       (const Sample               &a,
+                                const Sample               &b,
+                                size_t                      tab,
+                                size_t                      start,
+                                size_t                      end);
+
+    // Calculate the kernels of all pairs of `hash_fnames` or, if `n_queries`
+    // > 0, those of each of the first `n_queries` against each of the rest,
+    // and the self kernels of all
+    void
+    _calculate_pairs           (std::vector<std::string>   &hash_fnames,
+                                size_t                      n_queries);
+
+    // True if the kernel of the pair (i, j), i <= j, is needed
+    bool
+    _wanted_pair               (size_t                      i,
+                                size_t                      j) const
+    {
+        return _n_queries == 0 || i == j ||
+               (i < _n_queries && j >= _n_queries);
+    }
+
+    // Calculate the kernel between every pair in `pairs`. Each table is
+    // streamed in cache-sized blocks of bins, and each block is used for all
+    // pairs before moving on to the next.
+    virtual void
+    _calculate_tile            (std::vector<std::string>   &hash_fnames,
+                                const std::vector<SamplePair> &pairs);
+
+    // Number of bins per block, such that `n_samples` samples' blocks fit in
+    // cache together.
+    virtual size_t
+    _bin_block_size            (size_t                      n_samples);
+
+    void
+    _resize_hash_cache         ();
+
+    // Number of samples the cache holds, when not limited by memory
+    size_t
+    _cache_entries             ();
+
+    // Number of tiles of cache reserved for samples loaded ahead of use
+    size_t
+    _prefetch_tiles            ();
+
+    // Threads each I/O thread loads a sample ahead of use with, a share of
+    // _num_threads
+    int
+    _prefetch_load_threads     ();
+
+    // Choose the tile size from the cache budget and the size of a sample,
+    // unless it was set explicitly. Returns the number of tiles the sample
+    // cache can hold, for scheduling.
+    size_t
+    _plan_tiles                (std::vector<std::string>   &hash_fnames);
+
+    // Assign blocks of pairs to shards for `num_samples` samples. The
+    // assignment depends only on the number of samples and shards, so every
+    // shard makes the same one.
+    void
+    _plan_shards               ();
+
+    // True if this shard computes the pair (i, j), i <= j
+    bool
+    _owns_pair                 (size_t                      i,
+                                size_t                      j) const;
+
+    // Keep the kernel of the pair (i, j), i <= j, that is wanted
+    void
+    _store_kernel              (size_t                      i,
+                                size_t                      j,
+                                float                       kernel);
+
+    // Offer `j` at `distance` as a neighbour of `i`
+    void
+    _add_neighbour             (size_t                      i,
+                                size_t                      j,
+                                float                       distance);
+
+    // Compute the self kernels of every sample, which the distances of the
+    // other pairs need as they complete when keeping neighbours
+    void
+    _calculate_self_kernels    (std::vector<std::string>   &hash_fnames);
+
+    // Keep the kernel of a pair (i, j), i <= j, that isn't to be computed
+    void
+    _mark_done                 (size_t                      i,
+                                size_t                      j,
+                                float                       kernel);
+
+    bool
+    _pair_done                 (size_t                      i,
+                                size_t                      j) const
+    {
+        return !_done_pairs.empty() &&
+               _done_pairs[i * (2 * num_samples - i - 1) / 2 + j];
+    }
+
+    // Keep the kernels of the previous matrix, if any. Throws unless its
+    // samples are the first of those being calculated.
+    void
+    _use_previous              ();
+
+    // Open the checkpoint journal, if any, and keep the kernels of pairs
+    // completed by an earlier run
+    void
+    _open_checkpoint           ();
+
+    // Check the kernel matrix is positive semidefinite, if check_psd is set
+    void
+    _check_psd                 ();
+
+    // Pairs of samples i <= j from row tile `ti` and column tile `tj` that
+    // are wanted, computed by this shard, and not done already
+    std::vector<SamplePair>
+    _tile_pairs                (size_t                      ti,
+                                size_t                      tj);
+
+    // Queue the samples of both tiles of `tile_pair` for loading
+    void
+    _prefetch_tile_pair        (Prefetcher                 &prefetcher,
+                                std::vector<std::string>   &hash_fnames,
+                                const TilePair             &tile_pair);
 
 
 public:
@@ -75,11 +331,17 @@ public:
     const std::string           name = "Base Class";
     const std::string           blurb = "A generic base class for kernels.";
     std::ostream               *outstream = &std::cerr;
+    // Map uncompressed countgraphs rather than reading them into memory
+    bool                        use_mmap = true;
+    // Check that the kernel matrix is positive semidefinite once calculated
+    bool                        check_psd = true;
 
     Kernel                      ();
     ~Kernel                     ();
 
-    // Calculate the kernel between two counting hashes
+    // Calculate the kernel between two counting hashes. calculate_pairwise()
+    // doesn't use this, but the _table_kernel hooks, so overriding it alone
+    // changes no kernel matrix.
     virtual float
     kernel                      (const khmer::CountingHash   &a,
                                  const khmer::CountingHash   &b);
@@ -88,12 +350,58 @@ public:
     virtual void
     calculate_pairwise          (std::vector<std::string> &hash_fnames);
 
+    // Calculate the kernel of each of `queries` against each of
+    // `references`, but not those between references or between queries.
+    // The matrices are then of queries (rows) by references (columns), with
+    // distances normalised by self kernels. Samples are cached and scheduled
+    // as by calculate_pairwise(). Throws if sharded or extending a matrix.
+    virtual void
+    calculate_cross             (std::vector<std::string> &queries,
+                                 std::vector<std::string> &references);
+
+    // Keep only the `k` nearest neighbours of each sample by distance, rather
+    // than the kernel matrix, so memory is O(Nk) rather than O(N^2). Can't
+    // be sharded, extend a matrix or compare queries to references.
+    void
+    set_knn                     (size_t                 k);
+
+    // Write the neighbours kept by set_knn() as tab-separated lines of a
+    // sample, a neighbour and their distance, nearest first
+    void
+    print_neighbours            (std::ostream          &outstream=std::cout);
+
+    // Estimate kernels from the `fraction` of bins whose index hashes lowest,
+    // scaled up to whole tables, with a standard error for each from the
+    // spread of the kernel over batches of those bins. Samples hold only
+    // these bins once loaded. 1 computes exact kernels.
+    void
+    set_bin_fraction            (double                 fraction);
+
+    // Write the standard errors of the estimated kernels, as
+    // print_kernel_mat(). Those of resumed pairs are taken from the journal.
+    // Throws if no kernel matrix was estimated, or if it extends a previous
+    // matrix, whose kernels' errors are unknown.
+    void
+    print_stderr_mat            (std::ostream          &outstream=std::cout);
+
+    // Number of query samples of a calculate_cross(), or 0
+    size_t
+    num_queries                 () const { return _n_queries; }
+
     virtual void
     print_kernel_mat            (std::ostream          &outstream=std::cout);
 
     virtual void
     print_distance_mat          (std::ostream          &outstream=std::cout);
 
+    // Write the kernel or distance matrix as a .npy array of float32. Samples
+    // are in the order of sample_names.
+    void
+    save_kernel_npy             (std::ostream          &out);
+
+    void
+    save_distance_npy           (std::ostream          &out);
+
     virtual void
     get_kernel_matrix           (MatrixXd &mat);
 
@@ -112,6 +420,80 @@ public:
     void
     set_num_threads             (int                    num_threads);
 
+    // Set the number of samples per tile of the pairwise calculation. All
+    // samples of three tiles are held in memory at once.
+    void
+    set_tile_size               (size_t                 tile_size);
+
+    // Limit the sample cache to `bytes` bytes of countgraph tables, rather
+    // than to the samples of three tiles. The tile size is then chosen from the
+    // budget, unless set explicitly, and any room left over for more tiles is
+    // used to avoid reloading samples.
+    void
+    set_cache_mem               (size_t                 bytes);
+
+    // Load samples on `io_threads` background threads, so that loading
+    // overlaps with computing kernels. 0 disables prefetching.
+    void
+    set_io_threads              (size_t                 io_threads);
+
+    // Number of tile pairs to load ahead of the one being computed. Cache
+    // room for this many extra tiles is set aside.
+    void
+    set_prefetch_depth          (size_t                 depth);
+
+    // Index the occupied bins of countgraphs with less than `fraction` of
+    // bins occupied as they load, and compute their kernels over only those
+    // bins. 0 disables indexing.
+    void
+    set_sparse_below            (double                 fraction);
+
+    // Directory for compact copies of samples, written as the population is
+    // counted when the cache can't hold every sample until the pairwise
+    // pass. "" disables copies.
+    void
+    set_scratch_dir             (const std::string     &dir);
+
+    // Compute only shard `shard` (from 0) of `n_shards` of the pairwise
+    // calculation. Each shard computes a balanced subset of the pairs, and
+    // saves their kernels with save_shard() rather than a kernel matrix.
+    void
+    set_shard                   (size_t                 shard,
+                                 size_t                 n_shards);
+
+    // Save the kernels computed by this shard, with the sample names
+    void
+    save_shard                  (const std::string     &filename);
+
+    // Assemble the kernel matrix from the files saved by every shard of a
+    // calculation. Throws unless the shards are of the same samples and
+    // every pair was computed by exactly one of them.
+    void
+    merge_shards                (const std::vector<std::string> &filenames);
+
+    // Journal the kernel of each pair to `filename` as it completes. If
+    // `resume` is set, pairs already in the journal are not computed again.
+    // Kernels are written on a background thread.
+    void
+    set_checkpoint              (const std::string     &filename,
+                                 bool                   resume);
+
+    // Load a kernel matrix, as written by print_kernel_mat(), to extend.
+    // The next calculate_pairwise() must be given its samples first, in the
+    // same order, then the new samples; only pairs with a new sample are
+    // computed. Throws if the matrix is malformed.
+    void
+    load_previous               (std::istream          &instream);
+
+    // As load_previous(), from a kernel matrix saved by save_kernel_npy()
+    // and its sample names
+    void
+    load_previous_npy           (std::istream          &instream,
+                                 const std::vector<std::string> &labels);
+
+    SampleCacheStats
+    cache_stats                 ();
+
 };
 
 } // end namespace kwip
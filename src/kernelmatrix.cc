@@ -0,0 +1,337 @@
+/*
+ * Copyright 2015 Kevin Murray <spam@kdmurray.id.au>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "kernelmatrix.hh"
+
+#include <cmath>
+#include <limits>
+
+#include <Eigen/Cholesky>
+
+namespace kwip
+{
+
+// Rows per thread derived before a block is written
+static const size_t print_block_rows = 16;
+
+void
+KernelMatrix::
+resize(size_t n)
+{
+    _n = n;
+    _packed.assign(n * (n + 1) / 2, 0.0);
+}
+
+void
+KernelMatrix::
+row(size_t i, Values values, double *row) const
+{
+    const double diag_i = (*this)(i, i);
+    for (size_t j = 0; j < _n; j++) {
+        row[j] = derive_kernel((*this)(i, j), diag_i, (*this)(j, j), values);
+    }
+}
+
+void
+KernelMatrix::
+to_dense(MatrixXd &mat, Values values, int num_threads) const
+{
+    mat.resize(_n, _n);
+    #pragma omp parallel num_threads(num_threads)
+    {
+        std::vector<double> buf(_n);
+        #pragma omp for schedule(dynamic)
+        for (size_t i = 0; i < _n; i++) {
+            row(i, values, buf.data());
+            for (size_t j = 0; j < _n; j++) {
+                mat(i, j) = buf[j];
+            }
+        }
+    }
+}
+
+// Rows and columns per tile of the blocked Cholesky factorisation. Tiles of
+// doubles fit in L2 cache, and the GEMM updates between them dominate.
+static const size_t psd_tile = 128;
+
+bool
+KernelMatrix::
+is_pos_semidef(double tolerance, int num_threads) const
+{
+    if (_n == 0) {
+        return true;
+    }
+    // Kernels and the factor are held as floats, and their rounding grows
+    // with the size and scale of the matrix, so allow for it on top of the
+    // tolerance
+    double max_diag = 0;
+    for (size_t i = 0; i < _n; i++) {
+        max_diag = std::max(max_diag, std::fabs((double)(*this)(i, i)));
+    }
+    const double shift = tolerance + _n * max_diag *
+                         std::numeric_limits<float>::epsilon();
+
+    // Copy the upper triangle into the tiles of the upper block triangle,
+    // each held as a square of floats. Tiles past the edge are padded with an
+    // identity, which factors trivially and leaves the rest unchanged.
+    const size_t B = psd_tile;
+    const size_t T = (_n + B - 1) / B;
+    auto tile_index = [T](size_t I, size_t J) {
+        return I * (2 * T - I - 1) / 2 + J;
+    };
+    std::vector<float> tiles(T * (T + 1) / 2 * B * B, 0.0f);
+    auto tile = [&](size_t I, size_t J) {
+        return tiles.data() + tile_index(I, J) * B * B;
+    };
+    typedef Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic,
+                          Eigen::RowMajor> TileF;
+    typedef Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic,
+                          Eigen::RowMajor> TileD;
+    #pragma omp parallel for num_threads(num_threads) schedule(dynamic)
+    for (size_t I = 0; I < T; I++) {
+        for (size_t J = I; J < T; J++) {
+            float *t = tile(I, J);
+            for (size_t r = 0; r < B; r++) {
+                const size_t i = I * B + r;
+                for (size_t c = 0; c < B; c++) {
+                    const size_t j = J * B + c;
+                    if (i < _n && j < _n) {
+                        t[r * B + c] = i <= j ? (*this)(i, j) : (*this)(j, i);
+                    } else if (i == j) {
+                        t[r * B + c] = 1;
+                    }
+                }
+            }
+            if (I == J) {
+                for (size_t r = 0; r < B && I * B + r < _n; r++) {
+                    t[r * B + r] += shift;
+                }
+            }
+        }
+    }
+
+    // Right-looking blocked upper Cholesky, A = U'U. At step K the diagonal
+    // tile is factored, the rest of tile row K solved against it, and every
+    // later tile updated by a GEMM of two tiles of row K. Products are formed
+    // in double, and each tile is rounded to float once per step.
+    bool failed = false;
+    TileD u_kk(B, B);
+    #pragma omp parallel num_threads(num_threads)
+    {
+        TileD a(B, B), b(B, B), c(B, B);
+        for (size_t K = 0; K < T; K++) {
+            #pragma omp single
+            {
+                Eigen::Map<TileF> t_kk(tile(K, K), B, B);
+                // Only the upper triangle of the tile is read
+                Eigen::LLT<TileD, Eigen::Upper> llt(t_kk.cast<double>());
+                if (llt.info() != Eigen::Success) {
+                    failed = true;
+                } else {
+                    u_kk = llt.matrixU();
+                    t_kk = u_kk.cast<float>();
+                }
+            }
+            // The single's implicit barrier makes `failed` visible to all
+            if (failed) {
+                break;
+            }
+
+            #pragma omp for schedule(dynamic)
+            for (size_t J = K + 1; J < T; J++) {
+                Eigen::Map<TileF> t_kj(tile(K, J), B, B);
+                a = t_kj.cast<double>();
+                u_kk.triangularView<Eigen::Upper>().transpose()
+                        .solveInPlace(a);
+                t_kj = a.cast<float>();
+            }
+
+            // Every tile (I, J) with K < I <= J
+            const size_t n_rest = T - K - 1;
+            #pragma omp for schedule(dynamic)
+            for (size_t p = 0; p < n_rest * (n_rest + 1) / 2; p++) {
+                size_t I = 0, rem = p;
+                while (rem >= n_rest - I) {
+                    rem -= n_rest - I;
+                    I++;
+                }
+                const size_t J = K + 1 + I + rem;
+                I += K + 1;
+                a = Eigen::Map<TileF>(tile(K, I), B, B).cast<double>();
+                b = Eigen::Map<TileF>(tile(K, J), B, B).cast<double>();
+                Eigen::Map<TileF> t_ij(tile(I, J), B, B);
+                c = t_ij.cast<double>();
+                c.noalias() -= a.transpose() * b;
+                t_ij = c.cast<float>();
+            }
+        }
+    }
+    return !failed;
+}
+
+void
+KernelMatrix::
+print(std::ostream &outstream, const std::vector<std::string> &labels,
+      Values values, int num_threads) const
+{
+    for (size_t i = 0; i < _n; i++) {
+        outstream << "\t" << labels[i];
+    }
+    outstream << "\n";
+
+    const size_t block = std::max(num_threads, 1) * print_block_rows;
+    std::vector<std::string> lines(block);
+    for (size_t first = 0; first < _n; first += block) {
+        const size_t n = std::min(block, _n - first);
+
+        #pragma omp parallel num_threads(num_threads)
+        {
+            std::vector<double> buf(_n);
+            #pragma omp for schedule(dynamic)
+            for (size_t k = 0; k < n; k++) {
+                row(first + k, values, buf.data());
+                format_lsmat_row(lines[k], labels[first + k], buf.data(), _n,
+                                 outstream.precision());
+            }
+        }
+        for (size_t k = 0; k < n; k++) {
+            outstream << lines[k];
+        }
+    }
+}
+
+void
+KernelMatrix::
+save_npy(std::ostream &out, Values values, int num_threads) const
+{
+    write_npy_header(out, _n, _n);
+
+    const size_t block = std::max(num_threads, 1) * print_block_rows;
+    std::vector<float> rows(block * _n);
+    for (size_t first = 0; first < _n; first += block) {
+        const size_t n = std::min(block, _n - first);
+
+        #pragma omp parallel num_threads(num_threads)
+        {
+            std::vector<double> buf(_n);
+            #pragma omp for schedule(dynamic)
+            for (size_t k = 0; k < n; k++) {
+                row(first + k, values, buf.data());
+                std::copy(buf.begin(), buf.end(), &rows[k * _n]);
+            }
+        }
+        out.write((const char *)rows.data(), n * _n * sizeof(float));
+    }
+}
+
+void
+CrossKernelMatrix::
+resize(size_t rows, size_t cols)
+{
+    _rows = rows;
+    _cols = cols;
+    _kernels.assign(rows * cols, 0.0);
+    _query_self.assign(rows, 0.0);
+    _ref_self.assign(cols, 0.0);
+}
+
+void
+CrossKernelMatrix::
+row(size_t i, KernelMatrix::Values values, double *row) const
+{
+    const float *kernels = &_kernels[i * _cols];
+    for (size_t j = 0; j < _cols; j++) {
+        row[j] = derive_kernel(kernels[j], _query_self[i], _ref_self[j],
+                               values);
+    }
+}
+
+void
+CrossKernelMatrix::
+to_dense(MatrixXd &mat, KernelMatrix::Values values, int num_threads) const
+{
+    mat.resize(_rows, _cols);
+    #pragma omp parallel num_threads(num_threads)
+    {
+        std::vector<double> buf(_cols);
+        #pragma omp for schedule(dynamic)
+        for (size_t i = 0; i < _rows; i++) {
+            row(i, values, buf.data());
+            for (size_t j = 0; j < _cols; j++) {
+                mat(i, j) = buf[j];
+            }
+        }
+    }
+}
+
+void
+CrossKernelMatrix::
+print(std::ostream &outstream, const std::vector<std::string> &row_labels,
+      const std::vector<std::string> &col_labels, KernelMatrix::Values values,
+      int num_threads) const
+{
+    for (size_t j = 0; j < _cols; j++) {
+        outstream << "\t" << col_labels[j];
+    }
+    outstream << "\n";
+
+    const size_t block = std::max(num_threads, 1) * print_block_rows;
+    std::vector<std::string> lines(block);
+    for (size_t first = 0; first < _rows; first += block) {
+        const size_t n = std::min(block, _rows - first);
+
+        #pragma omp parallel num_threads(num_threads)
+        {
+            std::vector<double> buf(_cols);
+            #pragma omp for schedule(dynamic)
+            for (size_t k = 0; k < n; k++) {
+                row(first + k, values, buf.data());
+                format_lsmat_row(lines[k], row_labels[first + k], buf.data(),
+                                 _cols, outstream.precision());
+            }
+        }
+        for (size_t k = 0; k < n; k++) {
+            outstream << lines[k];
+        }
+    }
+}
+
+void
+CrossKernelMatrix::
+save_npy(std::ostream &out, KernelMatrix::Values values, int num_threads) const
+{
+    write_npy_header(out, _rows, _cols);
+
+    const size_t block = std::max(num_threads, 1) * print_block_rows;
+    std::vector<float> rows(block * _cols);
+    for (size_t first = 0; first < _rows; first += block) {
+        const size_t n = std::min(block, _rows - first);
+
+        #pragma omp parallel num_threads(num_threads)
+        {
+            std::vector<double> buf(_cols);
+            #pragma omp for schedule(dynamic)
+            for (size_t k = 0; k < n; k++) {
+                row(first + k, values, buf.data());
+                std::copy(buf.begin(), buf.end(), &rows[k * _cols]);
+            }
+        }
+        out.write((const char *)rows.data(), n * _cols * sizeof(float));
+    }
+}
+
+} // end namespace kwip
@@ -0,0 +1,229 @@
+/*
+ * Copyright 2015 Kevin Murray <spam@kdmurray.id.au>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef KERNELMATRIX_HH
+#define KERNELMATRIX_HH
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "kwip-utils.hh"
+
+namespace kwip
+{
+
+// The symmetric matrix of kernels between samples. Only the upper triangle
+// is held, packed row by row, as floats (the precision kernels are calculated
+// at). Normalised kernels and distances are derived a row at a time, so no
+// full matrix of them is ever held.
+class KernelMatrix
+{
+public:
+    enum Values {
+        KERNEL,
+        NORMALISED,
+        DISTANCE,
+    };
+
+    KernelMatrix                () : _n(0) {}
+
+    // Resize to `n` samples, with every kernel 0
+    void
+    resize                      (size_t                 n);
+
+    size_t
+    size                        () const { return _n; }
+
+    bool
+    empty                       () const { return _n == 0; }
+
+    // Bytes of packed kernels
+    size_t
+    bytes                       () const { return _packed.size() * sizeof(float); }
+
+    float
+    operator()                  (size_t                 i,
+                                 size_t                 j) const
+    {
+        return _packed[_index(i, j)];
+    }
+
+    float &
+    operator()                  (size_t                 i,
+                                 size_t                 j)
+    {
+        return _packed[_index(i, j)];
+    }
+
+    // Fill `row` with row `i` of the matrix of `values`. The distance is
+    // that between the normalised kernels.
+    void
+    row                         (size_t                 i,
+                                 Values                 values,
+                                 double                *row) const;
+
+    // The full matrix of `values`
+    void
+    to_dense                    (MatrixXd              &mat,
+                                 Values                 values,
+                                 int                    num_threads=1) const;
+
+    // True if no eigenvalue of the kernel matrix is below -`tolerance`. This
+    // attempts a Cholesky factorisation of the matrix shifted by `tolerance`
+    // (plus an allowance for rounding), which succeeds only if the shifted
+    // matrix is positive definite. The factorisation is blocked into tiles,
+    // updated in parallel. Needs a float copy of the upper triangle, the size
+    // of the matrix.
+    bool
+    is_pos_semidef              (double                 tolerance=1e-5,
+                                 int                    num_threads=1) const;
+
+    // Write the matrix of `values` as a labelled, tab-separated matrix. Rows
+    // are derived in parallel a block at a time and written as each block
+    // completes.
+    void
+    print                       (std::ostream          &outstream,
+                                 const std::vector<std::string> &labels,
+                                 Values                 values,
+                                 int                    num_threads=1) const;
+
+    // Write the matrix of `values` as a .npy array of float32, which numpy
+    // and others load, or map, without parsing. Rows are derived as in
+    // print().
+    void
+    save_npy                    (std::ostream          &out,
+                                 Values                 values,
+                                 int                    num_threads=1) const;
+
+protected:
+    size_t                      _n;
+    std::vector<float>          _packed;
+
+    // Offset of (i, j) in the packed upper triangle
+    size_t
+    _index                      (size_t                 i,
+                                 size_t                 j) const
+    {
+        if (i > j) {
+            std::swap(i, j);
+        }
+        return i * (2 * _n - i - 1) / 2 + j;
+    }
+};
+
+// The normalised kernel or distance between samples i and j, from their
+// kernel `k_ij` and their self kernels `k_ii` and `k_jj`
+inline double
+derive_kernel(double k_ij, double k_ii, double k_jj,
+              KernelMatrix::Values values)
+{
+    if (values == KernelMatrix::KERNEL) {
+        return k_ij;
+    }
+    // Normalise the diagonal of the matrix to 1 with an L2 norm
+    const double norm_ij = k_ij / sqrt(k_ii * k_jj);
+    if (values == KernelMatrix::NORMALISED) {
+        return norm_ij;
+    }
+    const double norm_ii = k_ii / sqrt(k_ii * k_ii);
+    const double norm_jj = k_jj / sqrt(k_jj * k_jj);
+    float d = norm_ii + norm_jj - 2 * norm_ij;
+    return d > 0.0 ? sqrt(d) : 0.;
+}
+
+// The kernels between each of a set of query samples and each of a set of
+// reference samples, with the self kernels of both for normalisation. Rows
+// are queries and columns references.
+class CrossKernelMatrix
+{
+public:
+    CrossKernelMatrix           () : _rows(0), _cols(0) {}
+
+    // Resize to `rows` queries and `cols` references, with every kernel 0
+    void
+    resize                      (size_t                 rows,
+                                 size_t                 cols);
+
+    size_t
+    rows                        () const { return _rows; }
+
+    size_t
+    cols                        () const { return _cols; }
+
+    bool
+    empty                       () const { return _rows == 0; }
+
+    float &
+    operator()                  (size_t                 i,
+                                 size_t                 j)
+    {
+        return _kernels[i * _cols + j];
+    }
+
+    // Self kernel of query `i` or reference `j`
+    float &
+    query_self                  (size_t                 i)
+    {
+        return _query_self[i];
+    }
+
+    float &
+    ref_self                    (size_t                 j)
+    {
+        return _ref_self[j];
+    }
+
+    // Fill `row` with row `i` of the matrix of `values`, as
+    // KernelMatrix::row()
+    void
+    row                         (size_t                 i,
+                                 KernelMatrix::Values   values,
+                                 double                *row) const;
+
+    void
+    to_dense                    (MatrixXd              &mat,
+                                 KernelMatrix::Values   values,
+                                 int                    num_threads=1) const;
+
+    // Write the matrix of `values` as a labelled, tab-separated matrix, as
+    // KernelMatrix::print(), with the references' names as the header
+    void
+    print                       (std::ostream          &outstream,
+                                 const std::vector<std::string> &row_labels,
+                                 const std::vector<std::string> &col_labels,
+                                 KernelMatrix::Values   values,
+                                 int                    num_threads=1) const;
+
+    void
+    save_npy                    (std::ostream          &out,
+                                 KernelMatrix::Values   values,
+                                 int                    num_threads=1) const;
+
+protected:
+    size_t                      _rows;
+    size_t                      _cols;
+    std::vector<float>          _kernels;
+    std::vector<float>          _query_self;
+    std::vector<float>          _ref_self;
+};
+
+} // end namespace kwip
+
+#endif /* KERNELMATRIX_HH */
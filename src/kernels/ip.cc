@@ -16,6 +16,7 @@
  */
 
 #include "ip.hh"
+#include "simd.hh"
 
 namespace kwip
 {
@@ -33,16 +34,34 @@ IPKernel::kernel(const khmer::CountingHash &a, const khmer::CountingHash &b)
     _check_hash_dimensions(a, b);
 
     for (size_t tab = 0; tab < tablesizes.size(); tab++) {
-        uint64_t tab_kernel = 0;
-        uint64_t tabsz = tablesizes[tab];
-        khmer::Byte *A = a_counts[tab];
-        khmer::Byte *B = b_counts[tab];
-        for (size_t bin = 0; bin < tabsz; bin++) {
-            tab_kernel += (uint32_t)A[bin] * (uint32_t)B[bin];
-        }
-        tab_scores.push_back(tab_kernel);
+        tab_scores.push_back(_table_kernel(a_counts[tab], b_counts[tab], tab,
+                                           0, tablesizes[tab]));
     }
     return vec_min(tab_scores);
 }
 
+double
+IPKernel::_table_kernel(const khmer::Byte *A, const khmer::Byte *B, size_t tab,
+                        size_t start, size_t end)
+{
+    (void)tab;
+    return simd::dot_u8(A + start, B + start, end - start);
+}
+
+double
+IPKernel::_table_kernel_sparse_dense(const SparseTable &A, const khmer::Byte *B,
+                                     size_t tab, size_t start, size_t end)
+{
+    (void)tab;
+    return sparse_dense_dot(A, B, start, end, [](size_t) { return 1.0; });
+}
+
+double
+IPKernel::_table_kernel_sparse(const SparseTable &A, const SparseTable &B,
+                               size_t tab, size_t start, size_t end)
+{
+    (void)tab;
+    return sparse_sparse_dot(A, B, start, end, [](size_t) { return 1.0; });
+}
+
 }} // end namespace kwip::metrics
@@ -28,6 +28,27 @@ namespace metrics
 
 class IPKernel : public Kernel
 {
+protected:
+    double _table_kernel       (const khmer::Byte                *A,
+                                const khmer::Byte                *B,
+                                size_t                            tab,
+                                size_t                            start,
+                                size_t                            end);
+
+    double _table_kernel_sparse_dense
+                               (const SparseTable                &A,
+                                const khmer::Byte                *B,
+                                size_t                            tab,
+                                size_t                            start,
+                                size_t                            end);
+
+    double _table_kernel_sparse
+                               (const SparseTable                &A,
+                                const SparseTable                &B,
+                                size_t                            tab,
+                                size_t                            start,
+                                size_t                            end);
+
 public:
     float kernel               (const khmer::CountingHash        &a,
                                 const khmer::CountingHash        &b);
@@ -16,37 +16,137 @@
  */
 
 #include "wip.hh"
+#include "simd.hh"
+
+#include <fstream>
+
+#include <sys/mman.h>
+#include <unistd.h>
 
 namespace kwip
 {
 namespace metrics
 {
 
-void
-WIPKernel::
-add_hashtable(const std::string &hash_fname)
+const std::string WEIGHTS_SIGNATURE = "KWWT";
+
+// Weights are in [0, 1], and quantise to round(weight * max code)
+template<typename weight_tp>
+static inline weight_tp
+quantise_weight(float weight)
 {
-    khmer::CountingHash ht(1, 1);
-    khmer::Byte **counts;
+    const float max_code = std::numeric_limits<weight_tp>::max();
+    return (weight_tp)std::lround(std::min(std::max(weight, 0.0f), 1.0f) *
+                                  max_code);
+}
 
-    khmer::CountingHashFile::load(hash_fname, ht);
-    _check_pop_counts(ht);
+template<typename weight_tp>
+static void
+quantise_weights(std::vector<WeightTable<weight_tp>> &quantised,
+                 const std::vector<WeightTable<float>> &weights)
+{
+    quantised.clear();
+    for (const auto &tab_weights: weights) {
+        std::vector<weight_tp> tab_quantised(tab_weights.size());
+        for (size_t bin = 0; bin < tab_weights.size(); bin++) {
+            tab_quantised[bin] = quantise_weight<weight_tp>(tab_weights[bin]);
+        }
+        quantised.emplace_back(std::move(tab_quantised));
+    }
+}
 
-    counts = ht.get_raw_tables();
+template<typename weight_tp>
+static void
+dequantise_weights(std::vector<WeightTable<float>> &weights,
+                   const std::vector<WeightTable<weight_tp>> &quantised)
+{
+    const float max_code = std::numeric_limits<weight_tp>::max();
+    weights.clear();
+    for (const auto &tab_quantised: quantised) {
+        std::vector<float> tab_weights(tab_quantised.size());
+        for (size_t bin = 0; bin < tab_quantised.size(); bin++) {
+            tab_weights[bin] = tab_quantised[bin] / max_code;
+        }
+        weights.emplace_back(std::move(tab_weights));
+    }
+}
 
-    for (size_t tab = 0; tab < _n_tables; tab++) {
-        uint64_t tab_count = 0;
-        // Save these here to avoid dereferencing twice below.
-        uint16_t *this_popcount = _pop_counts[tab];
-        const khmer::Byte *this_count = counts[tab];
-        for (size_t j = 0; j < _tablesizes[tab]; j++) {
-            if (this_count[j] > 0) {
-                __sync_fetch_and_add(&(this_popcount[j]), 1);
+// Keep only the weights of `subset`'s bins
+template<typename weight_tp>
+static void
+subsample_weights(std::vector<WeightTable<weight_tp>> &weights,
+                  const BinSubset &subset, int num_threads)
+{
+    for (size_t tab = 0; tab < weights.size(); tab++) {
+        weights[tab] = WeightTable<weight_tp>(subset.apply(weights[tab].data(),
+                                                           tab, num_threads));
+    }
+}
+
+// Fill weights from the population counts through a table of the (at most
+// num_samples + 1) distinct weights, indexed by population count. Threads
+// take ranges of bins. Returns the number of occupied bins of each table.
+template<typename weight_tp>
+static std::vector<uint64_t>
+weigh_pop_counts(std::vector<WeightTable<weight_tp>> &weights,
+                 const std::vector<weight_tp> &lut,
+                 const std::vector<PopCounts> &pop_counts, int num_threads)
+{
+    const size_t range = 1 << 16;
+    const uint32_t max_count = lut.size() - 1;
+    std::vector<uint64_t> occupied;
+    weights.clear();
+    for (const auto &tab_pop: pop_counts) {
+        std::vector<weight_tp> tab_weights(tab_pop.size());
+        const size_t n_ranges = (tab_pop.size() + range - 1) / range;
+        uint64_t tab_occupied = 0;
+
+        #pragma omp parallel num_threads(num_threads) reduction(+:tab_occupied)
+        {
+            std::vector<uint32_t> counts(range);
+            #pragma omp for schedule(dynamic)
+            for (size_t r = 0; r < n_ranges; r++) {
+                const size_t start = r * range;
+                const size_t n = std::min(range, tab_pop.size() - start);
+                tab_pop.decode(start, n, counts.data());
+                for (size_t i = 0; i < n; i++) {
+                    const uint32_t count = std::min(counts[i], max_count);
+                    tab_weights[start + i] = lut[count];
+                    tab_occupied += count > 0;
+                }
             }
-            tab_count += this_count[j];
         }
-        __sync_fetch_and_add(&_table_sums[tab], tab_count);
+        weights.emplace_back(std::move(tab_weights));
+        occupied.push_back(tab_occupied);
     }
+    return occupied;
+}
+
+uint64_t
+WIPKernel::
+_max_pop_count(uint64_t n_samples)
+{
+    // Counts are of samples with a bin occupied
+    return n_samples;
+}
+
+uint64_t
+WIPKernel::
+_add_table_range(const Sample &sample, size_t tab, size_t start, size_t end)
+{
+    PopCounts &this_popcount = _pop_counts[tab];
+    const khmer::Byte *this_count = sample.dense_table(tab);
+    if (this_count == NULL) {
+        // Sketches hold only occupied bins
+        uint64_t tab_count = 0;
+        sample.sparse_table(tab)->for_each(start, end,
+                [&](size_t bin, uint8_t count) {
+            this_popcount.add(bin, 1);
+            tab_count += count;
+        });
+        return tab_count;
+    }
+    return this_popcount.add_presence(this_count, start, end);
 }
 
 
@@ -54,47 +154,74 @@ void
 WIPKernel::
 calculate_entropy_vector(std::vector<std::string> &hash_fnames)
 {
-    num_samples = hash_fnames.size();
     if (verbosity > 0) {
         *outstream << "Calculating entropy weighting vector:" << std::endl;
         *outstream << "  - Loading hashes into a population frequency vector:"
                    << std::endl;
     }
 
-    #pragma omp parallel for num_threads(_num_threads) schedule(dynamic)
-    for (size_t i = 0; i < num_samples; i++) {
-        add_hashtable(hash_fnames[i]);
-        if (verbosity > 0) {
-            #pragma omp critical
-            {
-                *outstream << "    - Loaded '" << hash_fnames[i]  << "' ("
-                           << i + 1 << ")" << std::endl;
-            }
-        }
-    }
+    add_hashtables(hash_fnames);
 
     if (verbosity > 0) {
         *outstream << " - Finished loading hashes!" << std::endl;
-        *outstream << " - Occupancy rate of population hash: "
-                   << this->fpr() << std::endl;
+    }
+    calculate_weights();
+}
+
+
+void
+WIPKernel::
+calculate_weights()
+{
+    if (_pop_counts.empty()) {
+        throw std::runtime_error("There are no population counts to weight "
+                                 "bins by");
+    }
+    // The population may include samples merged from saved counts
+    const size_t pop_samples = _pop_n_samples;
+
+    // Bin entropy depends only on the number of samples with the bin
+    // occupied, so there are only pop_samples + 1 distinct entropies.
+    // Shannon entropy is sum for all states p_state * -log_2(p_state); we
+    // have two states, present & absent.
+    std::vector<float> entropies(pop_samples + 1, 0.0);
+    for (size_t pop_count = 1; pop_count < pop_samples; pop_count++) {
+        const float pop_freq = (float)pop_count / (float)pop_samples;
+        entropies[pop_count] = (pop_freq * -log2(pop_freq)) +
+                               ((1 - pop_freq) * -log2(1 - pop_freq));
     }
 
     _bin_entropies.clear();
-    for (size_t tab = 0; tab < _n_tables; tab++) {
-        _bin_entropies.emplace_back(_tablesizes[tab], 0.0);
-        for (size_t bin = 0; bin < _tablesizes[tab]; bin++) {
-            // Number of samples in popn with non-zero for this bin
-            unsigned int pop_count = _pop_counts[tab][bin];
-            if (0 < pop_count && pop_count < num_samples) {
-                const float pop_freq = (float)pop_count / (float)num_samples;
-                // Shannon entropy is
-                // sum for all states p_state * -log_2(p_state)
-                // We have two states, present & absent
-                float entropy = (pop_freq * -log2(pop_freq)) +
-                                ((1 - pop_freq) * -log2(1 - pop_freq));
-                _bin_entropies[tab][bin] = entropy;
-            }
+    _weights_n_samples = pop_samples;
+    std::vector<uint64_t> occupied;
+    if (_weight_bits == 32) {
+        occupied = weigh_pop_counts(_bin_entropies, entropies, _pop_counts,
+                                    _num_threads);
+    } else if (_weight_bits == 16) {
+        // Quantise the distinct entropies, and never hold the float vector
+        std::vector<uint16_t> lut;
+        for (const float entropy: entropies) {
+            lut.push_back(quantise_weight<uint16_t>(entropy));
+        }
+        occupied = weigh_pop_counts(_bin_weights_u16, lut, _pop_counts,
+                                    _num_threads);
+    } else {
+        std::vector<uint8_t> lut;
+        for (const float entropy: entropies) {
+            lut.push_back(quantise_weight<uint8_t>(entropy));
+        }
+        occupied = weigh_pop_counts(_bin_weights_u8, lut, _pop_counts,
+                                    _num_threads);
+    }
+
+    if (verbosity > 0) {
+        // The occupancy of the population hash, as fpr(), from the same sweep
+        double fpr = 1;
+        for (size_t tab = 0; tab < _n_tables; tab++) {
+            fpr *= (double)occupied[tab] / (double)_tablesizes[tab];
         }
+        *outstream << " - Occupancy rate of population hash: " << fpr
+                   << std::endl;
     }
 }
 
@@ -103,16 +230,54 @@ void
 WIPKernel::
 calculate_pairwise(std::vector<std::string> &hash_fnames)
 {
+    _prepare_weights(hash_fnames, hash_fnames);
+
+    // Do the kernel calculation per Kernel's implementation
+    Kernel::calculate_pairwise(hash_fnames);
+}
+
+void
+WIPKernel::
+calculate_cross(std::vector<std::string> &queries,
+                std::vector<std::string> &references)
+{
+    // Queries are weighted as references are, by the references' population
+    _prepare_weights(references, queries);
+    Kernel::calculate_cross(queries, references);
+}
+
+void
+WIPKernel::
+_prepare_weights(std::vector<std::string> &population,
+                 std::vector<std::string> &others)
+{
+    // Reuse the weights of the run being resumed, which its kernels were
+    // calculated with
+    const std::string weights_file = _checkpoint + ".weights";
+    if (!_have_weights() && _resume && !_checkpoint.empty() &&
+            access(weights_file.c_str(), F_OK) == 0) {
+        load_weights(weights_file);
+    }
+
+    // Kernels of a previous matrix are only comparable under its weights
+    if (!_have_weights() && !_previous.empty()) {
+        throw std::runtime_error("Extending a kernel matrix needs the bin "
+                                 "weights it was calculated with");
+    }
+
     // Only load samples and calculate the bin entropy vector if we don't have
     // it already
-    if (_bin_entropies.size() == 0) {
-        calculate_entropy_vector(hash_fnames);
+    if (!_have_weights()) {
+        calculate_entropy_vector(population);
+        if (!_checkpoint.empty()) {
+            save_weights(weights_file);
+        }
     } else {
-        num_samples = hash_fnames.size();
+        _check_weights(population);
+    }
+    if (&others != &population) {
+        _check_weights(others);
     }
-
-    // Do the kernel calculation per Kernel's implementation
-    Kernel::calculate_pairwise(hash_fnames);
 }
 
 float
@@ -126,18 +291,172 @@ kernel(const khmer::CountingHash &a, const khmer::CountingHash &b)
     _check_hash_dimensions(a, b);
 
     for (size_t tab = 0; tab < _n_tables; tab++) {
-        double tab_kernel = 0.0;
-        const khmer::Byte *A = a_counts[tab];
-        const khmer::Byte *B = b_counts[tab];
-        for (size_t bin = 0; bin < _tablesizes[tab]; bin++) {
-            float bin_entropy = _bin_entropies[tab][bin];
-            tab_kernel += A[bin] * B[bin] * bin_entropy;
-        }
-        tab_kernels.push_back(tab_kernel);
+        tab_kernels.push_back(_table_kernel(a_counts[tab], b_counts[tab], tab,
+                                            0, _tablesizes[tab]));
     }
     return vec_min(tab_kernels);
 }
 
+double
+WIPKernel::
+_table_kernel(const khmer::Byte *A, const khmer::Byte *B, size_t tab,
+              size_t start, size_t end)
+{
+    const size_t n = end - start;
+    switch (_weight_bits) {
+        case 8:
+            return simd::dot_u8_u8w(A + start, B + start,
+                                    _bin_weights_u8[tab].data() + start, n) /
+                   (double)std::numeric_limits<uint8_t>::max();
+        case 16:
+            return simd::dot_u8_u16w(A + start, B + start,
+                                     _bin_weights_u16[tab].data() + start, n) /
+                   (double)std::numeric_limits<uint16_t>::max();
+        default:
+            return simd::dot_u8_f32(A + start, B + start,
+                                    _bin_entropies[tab].data() + start, n);
+    }
+}
+
+double
+WIPKernel::
+_table_kernel_sparse_dense(const SparseTable &A, const khmer::Byte *B,
+                           size_t tab, size_t start, size_t end)
+{
+    switch (_weight_bits) {
+        case 8: {
+            const uint8_t *w = _bin_weights_u8[tab].data();
+            return sparse_dense_dot(A, B, start, end,
+                                    [w](size_t bin) { return w[bin]; }) /
+                   (double)std::numeric_limits<uint8_t>::max();
+        }
+        case 16: {
+            const uint16_t *w = _bin_weights_u16[tab].data();
+            return sparse_dense_dot(A, B, start, end,
+                                    [w](size_t bin) { return w[bin]; }) /
+                   (double)std::numeric_limits<uint16_t>::max();
+        }
+        default: {
+            const float *w = _bin_entropies[tab].data();
+            return sparse_dense_dot(A, B, start, end,
+                                    [w](size_t bin) { return w[bin]; });
+        }
+    }
+}
+
+double
+WIPKernel::
+_table_kernel_sparse(const SparseTable &A, const SparseTable &B, size_t tab,
+                     size_t start, size_t end)
+{
+    switch (_weight_bits) {
+        case 8: {
+            const uint8_t *w = _bin_weights_u8[tab].data();
+            return sparse_sparse_dot(A, B, start, end,
+                                     [w](size_t bin) { return w[bin]; }) /
+                   (double)std::numeric_limits<uint8_t>::max();
+        }
+        case 16: {
+            const uint16_t *w = _bin_weights_u16[tab].data();
+            return sparse_sparse_dot(A, B, start, end,
+                                     [w](size_t bin) { return w[bin]; }) /
+                   (double)std::numeric_limits<uint16_t>::max();
+        }
+        default: {
+            const float *w = _bin_entropies[tab].data();
+            return sparse_sparse_dot(A, B, start, end,
+                                     [w](size_t bin) { return w[bin]; });
+        }
+    }
+}
+
+void
+WIPKernel::
+set_weight_bits(int bits)
+{
+    if (bits != 8 && bits != 16 && bits != 32) {
+        std::ostringstream msg;
+        msg << "Invalid number of weight bits: " << bits
+            << " (must be 8, 16 or 32)";
+        throw std::invalid_argument(msg.str());
+    }
+    _weight_bits = bits;
+}
+
+bool
+WIPKernel::
+_have_weights()
+{
+    return !(_bin_entropies.empty() && _bin_weights_u8.empty() &&
+             _bin_weights_u16.empty());
+}
+
+void
+WIPKernel::
+_set_weight_tables(const std::vector<khmer::HashIntoType> &sizes)
+{
+    // Population counts, if any, are already sized
+    if (_pop_counts.empty()) {
+        _tablesizes = sizes;
+        _n_tables = sizes.size();
+    }
+}
+
+void
+WIPKernel::
+_check_weights(std::vector<std::string> &hash_fnames)
+{
+    if (hash_fnames.empty()) {
+        return;
+    }
+    const std::vector<khmer::HashIntoType> &sizes =
+            _get_sample(hash_fnames[0], _num_threads)->tablesizes();
+    // Weights loaded for whole tables are cut to the bins samples now hold
+    if (_bin_subset && sizes == _bin_subset->subset_sizes() &&
+            _tablesizes == _bin_subset->tablesizes()) {
+        subsample_weights(_bin_entropies, *_bin_subset, _num_threads);
+        subsample_weights(_bin_weights_u8, *_bin_subset, _num_threads);
+        subsample_weights(_bin_weights_u16, *_bin_subset, _num_threads);
+        _tablesizes = sizes;
+    }
+    if (sizes != _tablesizes) {
+        throw std::runtime_error("Bin weights were calculated for different "
+                                 "table sizes than those of " +
+                                 hash_fnames[0]);
+    }
+}
+
+void
+WIPKernel::
+_quantise_weights()
+{
+    if (_weight_bits == 8) {
+        quantise_weights(_bin_weights_u8, _bin_entropies);
+    } else if (_weight_bits == 16) {
+        quantise_weights(_bin_weights_u16, _bin_entropies);
+    } else {
+        return;
+    }
+    _bin_entropies.clear();
+    _bin_entropies.shrink_to_fit();
+}
+
+float
+WIPKernel::
+_bin_weight(size_t tab, size_t bin)
+{
+    switch (_weight_bits) {
+        case 8:
+            return _bin_weights_u8[tab][bin] /
+                   (float)std::numeric_limits<uint8_t>::max();
+        case 16:
+            return _bin_weights_u16[tab][bin] /
+                   (float)std::numeric_limits<uint16_t>::max();
+        default:
+            return _bin_entropies[tab][bin];
+    }
+}
+
 void
 WIPKernel::
 load(std::istream &instream)
@@ -149,20 +468,182 @@ load(std::istream &instream)
     instream >> hashsize;
 
     if (filesig != _file_sig) {
-        std::runtime_error("Input is not a kWIP WIP bin entropy vector");
+        throw std::runtime_error("Input is not a kWIP WIP bin entropy vector");
     }
     if (hashsize <= 0) {
         std::ostringstream msg;
         msg << "Invalid number of bins: " <<  hashsize;
-        std::runtime_error(msg.str());
+        throw std::runtime_error(msg.str());
     }
 
-    _bin_entropies.clear();
-    _bin_entropies.emplace_back(hashsize, 0.0);
+    std::vector<float> entropies(hashsize, 0.0);
     for (ssize_t i = 0; i < hashsize; i++) {
         size_t idx;
         instream >> idx;
-        instream >> _bin_entropies[0][i];
+        instream >> entropies[i];
+    }
+    _bin_entropies.clear();
+    _bin_entropies.emplace_back(std::move(entropies));
+    _set_weight_tables({(khmer::HashIntoType)hashsize});
+    _quantise_weights();
+}
+
+template<typename weight_tp>
+static void
+view_weight_tables(std::vector<WeightTable<weight_tp>> &tables,
+                   MapCursor &cur,
+                   const std::vector<khmer::HashIntoType> &tablesizes,
+                   const std::shared_ptr<void> &storage)
+{
+    tables.clear();
+    for (const auto tablesize: tablesizes) {
+        const weight_tp *data =
+            (const weight_tp *)cur.skip(tablesize * sizeof(weight_tp));
+        cur.align(8);
+        tables.emplace_back(data, tablesize, storage);
+    }
+}
+
+// Binary weight files are laid out so that every table is 8-byte aligned:
+//
+//   signature[4] u8:version u8:weight_bits u8:n_tables u8:0
+//   u64:n_samples u64:tablesizes[n_tables]
+//   for each table: weights[tablesize] (padded)
+void
+WIPKernel::
+load_weights(const std::string &filename)
+{
+    if (file_signature(filename) != WEIGHTS_SIGNATURE) {
+        std::ifstream in(filename);
+        if (!in) {
+            throw std::runtime_error("Cannot open weights file: " + filename);
+        }
+        load(in);
+        return;
+    }
+
+    std::shared_ptr<void> storage;
+    const char *data = NULL;
+    size_t len = 0;
+    if (use_mmap) {
+        void *map = map_file(filename, len);
+        storage = std::shared_ptr<void>(map, [len](void *ptr) {
+            munmap(ptr, len);
+        });
+        data = (const char *)map;
+    } else {
+        std::ifstream in(filename, std::ios::binary | std::ios::ate);
+        if (!in) {
+            throw std::runtime_error("Cannot open weights file: " + filename);
+        }
+        len = in.tellg();
+        in.seekg(0);
+        // Hold the file as uint64_t to keep the tables aligned
+        auto buf = std::make_shared<std::vector<uint64_t>>(
+                (len + sizeof(uint64_t) - 1) / sizeof(uint64_t));
+        if (!in.read((char *)buf->data(), len)) {
+            throw std::runtime_error("Cannot read weights file: " + filename);
+        }
+        storage = buf;
+        data = (const char *)buf->data();
+    }
+
+    MapCursor cur(data, len, filename);
+    cur.skip(4);
+    if (cur.read<uint8_t>() != WEIGHTS_VERSION) {
+        throw std::runtime_error("Incorrect kWIP weights version: " + filename);
+    }
+    const int bits = cur.read<uint8_t>();
+    const size_t n_tables = cur.read<uint8_t>();
+    cur.read<uint8_t>();
+    const uint64_t n_samples = cur.read<uint64_t>();
+    std::vector<khmer::HashIntoType> tablesizes;
+    for (size_t tab = 0; tab < n_tables; tab++) {
+        tablesizes.push_back(cur.read<uint64_t>());
+    }
+
+    _bin_entropies.clear();
+    _bin_weights_u8.clear();
+    _bin_weights_u16.clear();
+    switch (bits) {
+        case 8:
+            view_weight_tables(_bin_weights_u8, cur, tablesizes, storage);
+            if (_weight_bits != 8) {
+                dequantise_weights(_bin_entropies, _bin_weights_u8);
+                _bin_weights_u8.clear();
+            }
+            break;
+        case 16:
+            view_weight_tables(_bin_weights_u16, cur, tablesizes, storage);
+            if (_weight_bits != 16) {
+                dequantise_weights(_bin_entropies, _bin_weights_u16);
+                _bin_weights_u16.clear();
+            }
+            break;
+        case 32:
+            view_weight_tables(_bin_entropies, cur, tablesizes, storage);
+            break;
+        default:
+            throw std::runtime_error("Invalid kWIP weight width: " + filename);
+    }
+    if (!_bin_entropies.empty()) {
+        // Converts weights held at another width to those in use
+        _quantise_weights();
+    }
+    _set_weight_tables(tablesizes);
+    _weights_n_samples = n_samples;
+    if (verbosity > 1) {
+        *outstream << "Loaded " << bits << "-bit weights of " << n_tables
+                   << " tables, from " << n_samples << " samples" << std::endl;
+    }
+}
+
+template<typename weight_tp>
+static void
+write_weight_tables(std::ostream &out,
+                    const std::vector<WeightTable<weight_tp>> &tables)
+{
+    for (const auto &table: tables) {
+        const size_t len = table.size() * sizeof(weight_tp);
+        out.write((const char *)table.data(), len);
+        write_padding(out, len);
+    }
+}
+
+void
+WIPKernel::
+save_weights(const std::string &filename)
+{
+    if (!_have_weights()) {
+        throw std::runtime_error("There are no bin weights to save");
+    }
+    std::ofstream out(filename, std::ios::binary);
+    if (!out) {
+        throw std::runtime_error("Cannot open weights file for writing: " +
+                                 filename);
+    }
+
+    out.write(WEIGHTS_SIGNATURE.data(), 4);
+    write_val<uint8_t>(out, WEIGHTS_VERSION);
+    write_val<uint8_t>(out, _weight_bits);
+    write_val<uint8_t>(out, _n_tables);
+    write_val<uint8_t>(out, 0);
+    write_val<uint64_t>(out, _weights_n_samples);
+    for (size_t tab = 0; tab < _n_tables; tab++) {
+        write_val<uint64_t>(out, _tablesizes[tab]);
+    }
+    switch (_weight_bits) {
+        case 8:
+            write_weight_tables(out, _bin_weights_u8);
+            break;
+        case 16:
+            write_weight_tables(out, _bin_weights_u16);
+            break;
+        default:
+            write_weight_tables(out, _bin_entropies);
+    }
+    if (!out) {
+        throw std::runtime_error("Failed to write weights file: " + filename);
     }
 }
 
@@ -170,14 +651,17 @@ void
 WIPKernel::
 save(std::ostream &outstream)
 {
-    if (_bin_entropies.size() < 1) {
-        std::runtime_error("There is no bin entropy vector to save");
+    if (!_have_weights()) {
+        throw std::runtime_error("There is no bin entropy vector to save");
     }
 
+    size_t n_bins = _weight_bits == 8 ? _bin_weights_u8[0].size() :
+                    _weight_bits == 16 ? _bin_weights_u16[0].size() :
+                    _bin_entropies[0].size();
     outstream.precision(std::numeric_limits<float>::digits10);
-    outstream << _file_sig << "\t" << _bin_entropies[0].size() << "\n";
-    for (size_t i = 0; i < _bin_entropies[0].size(); i++) {
-        outstream << i << "\t" << _bin_entropies[0][i] << "\n";
+    outstream << _file_sig << "\t" << n_bins << "\n";
+    for (size_t i = 0; i < n_bins; i++) {
+        outstream << i << "\t" << _bin_weight(0, i) << "\n";
     }
 }
 
@@ -24,19 +24,70 @@
 #include <sstream>
 #include <iostream>
 #include <limits>
+#include <memory>
+#include <string>
+#include <vector>
 
 namespace kwip
 {
 namespace metrics
 {
 
-class WIPKernel : public KernelPopulation<uint16_t>
-{
+// Binary bin weight files hold the weights of every table, at the width they
+// were calculated at, and can be mapped and used in place.
+extern const std::string WEIGHTS_SIGNATURE;
+const uint8_t WEIGHTS_VERSION = 1;
 
+// One table's bin weights, either held in memory or viewing a mapped weight
+// file.
+template<typename weight_tp>
+class WeightTable
+{
 public:
-    void
-    add_hashtable               (const std::string     &hash_fname);
+    explicit WeightTable        (std::vector<weight_tp> &&weights) :
+        _own(std::move(weights)),
+        _data(_own.data()),
+        _size(_own.size())
+    {}
+
+    // A view of `size` weights at `data`, kept valid by `storage`
+    WeightTable                 (const weight_tp       *data,
+                                 size_t                 size,
+                                 std::shared_ptr<void>  storage) :
+        _data(data),
+        _size(size),
+        _storage(storage)
+    {}
+
+    // Views point into their own storage, which survives moves but not copies
+    WeightTable                 (const WeightTable     &other) = delete;
+    WeightTable                 (WeightTable           &&other) = default;
+    WeightTable &
+    operator=                   (WeightTable           &&other) = default;
+
+    const weight_tp *
+    data                        () const { return _data; }
+
+    size_t
+    size                        () const { return _size; }
+
+    weight_tp
+    operator[]                  (size_t                 bin) const
+    {
+        return _data[bin];
+    }
+
+protected:
+    std::vector<weight_tp>      _own;
+    const weight_tp            *_data;
+    size_t                      _size;
+    std::shared_ptr<void>       _storage;
+};
+
+class WIPKernel : public KernelPopulation
+{
 
+public:
     float
     kernel                      (const khmer::CountingHash   &a,
                                  const khmer::CountingHash   &b);
@@ -44,9 +95,21 @@ public:
     void
     calculate_pairwise          (std::vector<std::string> &hash_fnames);
 
+    // As Kernel::calculate_cross(), with bins weighted by the population of
+    // references unless weights are loaded
+    void
+    calculate_cross             (std::vector<std::string> &queries,
+                                 std::vector<std::string> &references);
+
+    // Add samples to the population counts and calculate the bin weights
     void
     calculate_entropy_vector    (std::vector<std::string> &hash_fnames);
 
+    // Calculate the bin weights from the population counts as they stand,
+    // e.g. after merging saved counts.
+    void
+    calculate_weights           ();
+
     const std::string       blurb =
             "WIP Kernel\n"
             "\n"
@@ -56,14 +119,96 @@ public:
             "absence over all samples (i.e. the proportion of all samples with\n"
             "a non-zero count of a bin).\n";
 
+    // Load a text bin entropy vector. These hold only the first table.
     void
     load                        (std::istream       &instream);
 
+    // Save the first table's weights as a text bin entropy vector
     void
     save                        (std::ostream       &outstream);
 
+    // Load bin weights from a binary weight file, mapping it if `use_mmap` is
+    // set, or from a text bin entropy vector. Weights are converted to the
+    // weight bits in use if needed.
+    void
+    load_weights                (const std::string  &filename);
+
+    // Save the bin weights of every table as a binary weight file
+    void
+    save_weights                (const std::string  &filename);
+
+    // Hold the bin weights quantised to 8 or 16 bits rather than as floats
+    // (32), which cuts the memory traffic of the kernel calculation at a
+    // small cost in precision. Must be set before the weights are calculated
+    // or loaded.
+    void
+    set_weight_bits             (int                 bits);
+
 protected:
-    std::vector<std::vector<float>>  _bin_entropies;
+    std::vector<WeightTable<float>>     _bin_entropies;
+    int                                 _weight_bits = 32;
+    std::vector<WeightTable<uint8_t>>   _bin_weights_u8;
+    std::vector<WeightTable<uint16_t>>  _bin_weights_u16;
+    // Number of samples the weights were calculated from
+    uint64_t                            _weights_n_samples = 0;
+
+    bool
+    _have_weights               ();
+
+    // Size the population to the tables of loaded weights
+    void
+    _set_weight_tables          (const std::vector<khmer::HashIntoType> &sizes);
+
+    // Load, or calculate from the samples of `population`, the weights for
+    // a pairwise calculation, and check they suit `others` too
+    void
+    _prepare_weights            (std::vector<std::string> &population,
+                                 std::vector<std::string> &others);
+
+    // Throw if the weights don't match the tables of `hash_fnames`
+    void
+    _check_weights              (std::vector<std::string> &hash_fnames);
+
+    // Population counts are the number of samples with each bin occupied
+    uint64_t
+    _max_pop_count              (uint64_t               n_samples);
+
+    uint64_t
+    _add_table_range            (const Sample          &sample,
+                                 size_t                 tab,
+                                 size_t                 start,
+                                 size_t                 end);
+
+    // Replace the float weights with their quantised equivalents, if
+    // quantisation has been requested.
+    void
+    _quantise_weights           ();
+
+    // Bin weight, whichever way the weights are stored
+    float
+    _bin_weight                 (size_t              tab,
+                                 size_t              bin);
+
+    double
+    _table_kernel               (const khmer::Byte     *A,
+                                 const khmer::Byte     *B,
+                                 size_t                 tab,
+                                 size_t                 start,
+                                 size_t                 end);
+
+    double
+    _table_kernel_sparse_dense  (const SparseTable     &A,
+                                 const khmer::Byte     *B,
+                                 size_t                 tab,
+                                 size_t                 start,
+                                 size_t                 end);
+
+    double
+    _table_kernel_sparse        (const SparseTable     &A,
+                                 const SparseTable     &B,
+                                 size_t                 tab,
+                                 size_t                 start,
+                                 size_t                 end);
     const std::string       _file_sig="kWIP_BinEntVector";
 };
 
@@ -25,6 +25,29 @@ using namespace kwip::metrics;  // Imports the KernelXXX classes
 static std::string prog_name = "kwip";
 static std::string cli_opts = "t:k:d:w:hCUVvq";
 
+// Long-only options
+enum {
+    OPT_TILE_SIZE = 256,
+    OPT_WEIGHT_BITS,
+    OPT_NO_MMAP,
+    OPT_CACHE_MEM,
+    OPT_IO_THREADS,
+    OPT_PREFETCH,
+    OPT_SPARSE_BELOW,
+    OPT_SCRATCH,
+    OPT_LOAD_POP,
+    OPT_SAVE_POP,
+    OPT_NO_PSD_CHECK,
+    OPT_SHARD,
+    OPT_CHECKPOINT,
+    OPT_RESUME,
+    OPT_APPEND,
+    OPT_REFS,
+    OPT_KNN,
+    OPT_APPROX,
+    OPT_STDERR,
+};
+
 static const struct option cli_long_opts[] = {
     { "threads",    required_argument,  NULL,   't' },
     { "kernel",     required_argument,  NULL,   'k' },
@@ -36,6 +59,26 @@ static const struct option cli_long_opts[] = {
     { "version",    no_argument,        NULL,   'V' },
     { "verbose",    no_argument,        NULL,   'v' },
     { "quiet",      no_argument,        NULL,   'q' },
+    { "tile-size",  required_argument,  NULL,   OPT_TILE_SIZE },
+    { "weight-bits", required_argument, NULL,   OPT_WEIGHT_BITS },
+    { "no-mmap",    no_argument,        NULL,   OPT_NO_MMAP },
+    { "cache-mem",  required_argument,  NULL,   OPT_CACHE_MEM },
+    { "io-threads", required_argument,  NULL,   OPT_IO_THREADS },
+    { "prefetch",   required_argument,  NULL,   OPT_PREFETCH },
+    { "sparse-below", required_argument, NULL,  OPT_SPARSE_BELOW },
+    { "scratch",    required_argument,  NULL,   OPT_SCRATCH },
+    { "load-pop",   required_argument,  NULL,   OPT_LOAD_POP },
+    { "save-pop",   required_argument,  NULL,   OPT_SAVE_POP },
+    { "no-psd-check", no_argument,      NULL,   OPT_NO_PSD_CHECK },
+    { "shard",      required_argument,  NULL,   OPT_SHARD },
+    { "checkpoint", required_argument,  NULL,   OPT_CHECKPOINT },
+    { "resume",     no_argument,        NULL,   OPT_RESUME },
+    { "append",     required_argument,  NULL,   OPT_APPEND },
+    { "refs",       required_argument,  NULL,   OPT_REFS },
+    { "knn",        required_argument,  NULL,   OPT_KNN },
+    { "approx",     required_argument,  NULL,   OPT_APPROX },
+    { "stderr",     required_argument,  NULL,   OPT_STDERR },
+    { NULL,         0,                  NULL,   0 },
 };
 
 static std::vector<std::string>
@@ -43,6 +86,8 @@ cli_help {
 "-t, --threads       Number of threads to utilise. [default N_CPUS]",
 "-k, --kernel        Output file for the kernel matrix. [default None]",
 "-d, --distance      Output file for the distance matrix. [default stdout]",
+"                    Matrices are written as float32 .npy arrays if the file",
+"                    name ends in .npy, with sample names in a .labels file.",
 "-U, --unweighted    Use the unweighted inner proudct kernel. [default off]",
 "-w, --weights       Bin weight vector file (input, or output w/ -C).",
 "-C, --calc-weights  Calculate only the bin weight vector, not kernel matrix.",
@@ -50,6 +95,56 @@ cli_help {
 "-V, --version       Print the version string.",
 "-v, --verbose       Increase verbosity. May or may not acutally do anything.",
 "-q, --quiet         Execute silently but for errors.",
+"    --tile-size     Samples per tile of the pairwise calculation. Three tiles",
+"                    are held in memory at once. [default N_CPUS/2]",
+"    --weight-bits   Bits per bin weight: 8 or 16 quantise the weights to",
+"                    save memory and bandwidth, 32 is exact. [default 32]",
+"    --no-mmap       Read uncompressed countgraphs into private memory rather",
+"                    than mapping them.",
+"    --cache-mem     Memory budget for cached samples, e.g. 64G. Tiles are",
+"                    sized to fit, and spare room avoids reloading samples.",
+"                    [default three tiles of samples]",
+"    --io-threads    Threads loading samples in the background while kernels",
+"                    are computed. 0 loads samples only when needed. [default 2]",
+"    --prefetch      Tile pairs to load ahead of the one being computed.",
+"                    [default 1]",
+"    --sparse-below  Index the occupied bins of countgraphs with less than this",
+"                    fraction of bins occupied, and compute kernels over only",
+"                    those bins. 0 disables this. [default 0.05]",
+"    --scratch       Local directory for compact copies of samples, written",
+"                    while calculating weights so the kernel pass reads those",
+"                    rather than the originals. Only used when the sample",
+"                    cache can't hold every sample. [default None]",
+"    --load-pop      With -C, population counts saved by --save-pop to add the",
+"                    given samples to. May be given more than once, to merge",
+"                    populations counted separately.",
+"    --save-pop      With -C, save the population counts, so more samples or",
+"                    populations can be added later.",
+"    --no-psd-check  Skip checking that the kernel matrix is positive",
+"                    semidefinite, which takes O(N^3) time for N samples.",
+"    --shard         Compute only shard i/n of the pairs, e.g. 2/8, saving",
+"                    their kernels to the -k file. 'kwip merge' assembles",
+"                    the matrices from every shard's file.",
+"    --checkpoint    Journal each pair's kernel to this file as it completes,",
+"                    and the bin weights to FILE.weights.",
+"    --resume        With --checkpoint, skip the pairs already journalled and",
+"                    reuse the journalled weights.",
+"    --append        A kernel matrix (text or .npy) to extend. Give its samples",
+"                    first, in order, then the new ones; only pairs with a new",
+"                    sample are computed. Needs the matrix's weights with -w.",
+"    --refs          A file listing reference countgraphs, one per line. Only",
+"                    the kernels of the given (query) samples against these",
+"                    are computed, with weights from the references unless",
+"                    given with -w. Matrices are then queries x references.",
+"    --knn           Keep only each sample's k nearest neighbours, and write",
+"                    them to the -d file as lines of sample, neighbour and",
+"                    distance rather than a matrix. Needs O(Nk) memory.",
+"    --approx        Estimate kernels from this fraction of bins, e.g. 0.05,",
+"                    chosen by hashing bin indexes. Samples hold only these",
+"                    bins once loaded. [default 1, exact]",
+"    --stderr        With --approx, write the estimated standard error of",
+"                    each kernel to this file, as a matrix. Not with --append,",
+"                    as the previous matrix's errors are unknown.",
 };
 
 void
@@ -68,7 +163,189 @@ print_cli_help()
          << "Each sample's oxli Countgraph should be specified after arguments:"
          << endl
          << prog_name << " [options] sample1.ct sample2.ct ... sampleN.ct"
-         << endl;
+         << endl << endl
+         << "Shards computed with --shard are merged with:" << endl
+         << prog_name << " merge [-t N] [-k kernel] [-d distance] "
+         << "shard1 ... shardN" << endl;
+}
+
+// Only the WIP kernel has weights to quantise
+template<typename KernelImpl>
+bool
+set_weight_bits(KernelImpl &kernel, int bits)
+{
+    (void)kernel;
+    (void)bits;
+    std::cerr << "--weight-bits only applies to the weighted kernel"
+              << std::endl;
+    return false;
+}
+
+template<>
+bool
+set_weight_bits(WIPKernel &kernel, int bits)
+{
+    try {
+        kernel.set_weight_bits(bits);
+    } catch (std::invalid_argument &err) {
+        std::cerr << err.what() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Only the WIP kernel has bin weights to load
+template<typename KernelImpl>
+bool
+load_weights(KernelImpl &kernel, const std::string &filename)
+{
+    (void)kernel;
+    (void)filename;
+    return true;
+}
+
+template<>
+bool
+load_weights(WIPKernel &kernel, const std::string &filename)
+{
+    try {
+        kernel.load_weights(filename);
+    } catch (std::runtime_error &err) {
+        std::cerr << err.what() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Matrices are written as .npy arrays if their file name ends in .npy
+static bool
+is_npy_name(const std::string &name)
+{
+    const std::string ext = ".npy";
+    return name.size() > ext.size() &&
+           name.compare(name.size() - ext.size(), ext.size(), ext) == 0;
+}
+
+// Write `labels`, one per line, to the file `name`
+static bool
+save_labels(std::vector<std::string>::const_iterator begin,
+            std::vector<std::string>::const_iterator end,
+            const std::string &name)
+{
+    std::ofstream out(name);
+    for (auto label = begin; label != end; label++) {
+        out << *label << "\n";
+    }
+    if (!out) {
+        std::cerr << "Error writing sample labels to '" << name << "'"
+                  << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// .npy arrays have no labels, so sample names go in a .labels file alongside,
+// one per line in matrix order. Matrices of queries against references have
+// the queries' names there, and the references' in a .ref_labels file.
+static bool
+save_npy_labels(const Kernel &kernel, const std::string &npy_name)
+{
+    const std::string base = npy_name.substr(0, npy_name.size() - 4);
+    const std::vector<std::string> &labels = kernel.sample_names;
+    if (kernel.num_queries() == 0) {
+        return save_labels(labels.begin(), labels.end(), base + ".labels");
+    }
+    auto first_ref = labels.begin() + kernel.num_queries();
+    return save_labels(labels.begin(), first_ref, base + ".labels") &&
+           save_labels(first_ref, labels.end(), base + ".ref_labels");
+}
+
+// Write the kernel matrix to `kern_out_name`, if given, and the distance
+// matrix to `dist_out_name`, or stdout. "-" is stdout.
+static bool
+write_matrices(Kernel &kernel, const std::string &kern_out_name,
+               const std::string &dist_out_name)
+{
+    std::ofstream               dist_out;
+    std::ofstream               kern_out;
+
+    if (dist_out_name.size() > 0 && dist_out_name != "-") {
+        dist_out.open(dist_out_name, std::ios::binary);
+    }
+    if (kern_out_name.size() > 0 && kern_out_name != "-") {
+        kern_out.open(kern_out_name, std::ios::binary);
+    }
+
+    // Only save the kernel distance if we have been given a file, or -
+    if (kern_out_name == "-") {
+        kernel.print_kernel_mat();
+    } else if (is_npy_name(kern_out_name)) {
+        kernel.save_kernel_npy(kern_out);
+        if (!save_npy_labels(kernel, kern_out_name)) {
+            return false;
+        }
+    } else if (kern_out_name.size() > 0) {
+        kernel.print_kernel_mat(kern_out);
+    }
+    // Always save the distance matrix, to stdout if we don't have a file
+    if (is_npy_name(dist_out_name)) {
+        kernel.save_distance_npy(dist_out);
+        if (!save_npy_labels(kernel, dist_out_name)) {
+            return false;
+        }
+    } else if (dist_out_name.size() > 0 && dist_out_name != "-") {
+        kernel.print_distance_mat(dist_out);
+    } else {
+        kernel.print_distance_mat();
+    }
+    return true;
+}
+
+// Load the kernel matrix `name` for `kernel` to extend, from a .npy array and
+// its labels or from text
+static bool
+load_previous_matrix(Kernel &kernel, const std::string &name)
+{
+    std::ifstream in(name, std::ios::binary);
+    if (!in) {
+        std::cerr << "Cannot open kernel matrix '" << name << "'" << std::endl;
+        return false;
+    }
+    try {
+        if (is_npy_name(name)) {
+            std::string labels_name = name.substr(0, name.size() - 4) +
+                                      ".labels";
+            std::ifstream labels_in(labels_name);
+            std::vector<std::string> labels;
+            std::string label;
+            while (std::getline(labels_in, label)) {
+                labels.push_back(label);
+            }
+            kernel.load_previous_npy(in, labels);
+        } else {
+            kernel.load_previous(in);
+        }
+    } catch (std::runtime_error &err) {
+        std::cerr << err.what() << ": " << name << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Parse a shard "i/n", numbered from 1
+static bool
+set_shard(Kernel &kernel, const std::string &arg, size_t &n_shards)
+{
+    size_t shard = 0;
+    char end = 0;
+    if (sscanf(arg.c_str(), "%zu/%zu%c", &shard, &n_shards, &end) != 2 ||
+            shard < 1 || shard > n_shards) {
+        std::cerr << "Invalid shard '" << arg << "', expected i/n with "
+                  << "1 <= i <= n" << std::endl;
+        return false;
+    }
+    kernel.set_shard(shard - 1, n_shards);
+    return true;
 }
 
 template<typename KernelImpl>
@@ -80,9 +357,16 @@ run_pwcalc(int argc, char *argv[])
     int                         c               = 0;
     std::string                 dist_out_name   = "";
     std::string                 kern_out_name   = "";
-    std::ofstream               dist_out;
-    std::ofstream               kern_out;
-    std::ifstream               weights_file;
+    std::string                 weights_file_name;
+    size_t                      n_shards        = 0;
+    std::string                 checkpoint_name;
+    bool                        resume          = false;
+    bool                        appending       = false;
+    std::string                 refs_name;
+    std::vector<std::string>    references;
+    size_t                      knn             = 0;
+    double                      bin_fraction    = 1.0;
+    std::string                 stderr_out_name;
     std::vector<std::string>    filenames;
 
     while ((c = getopt_long(argc, argv, cli_opts.c_str(), cli_long_opts,
@@ -104,8 +388,94 @@ run_pwcalc(int argc, char *argv[])
                 kernel.verbosity = 0;
                 break;
             case 'w':
-                weights_file.open(optarg);
+                weights_file_name = optarg;
+                break;
+            case OPT_TILE_SIZE:
+                kernel.set_tile_size(atol(optarg));
+                break;
+            case OPT_WEIGHT_BITS:
+                if (!set_weight_bits(kernel, atoi(optarg))) {
+                    print_cli_help();
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_NO_MMAP:
+                kernel.use_mmap = false;
+                break;
+            case OPT_CACHE_MEM:
+                try {
+                    kernel.set_cache_mem(parse_size(optarg));
+                } catch (std::invalid_argument &err) {
+                    std::cerr << err.what() << std::endl;
+                    print_cli_help();
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_IO_THREADS:
+                kernel.set_io_threads(atol(optarg));
+                break;
+            case OPT_PREFETCH:
+                kernel.set_prefetch_depth(atol(optarg));
+                break;
+            case OPT_SPARSE_BELOW:
+                kernel.set_sparse_below(atof(optarg));
+                break;
+            case OPT_SCRATCH:
+                kernel.set_scratch_dir(optarg);
+                break;
+            case OPT_NO_PSD_CHECK:
+                kernel.check_psd = false;
+                break;
+            case OPT_SHARD:
+                if (!set_shard(kernel, optarg, n_shards)) {
+                    print_cli_help();
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_CHECKPOINT:
+                checkpoint_name = optarg;
+                break;
+            case OPT_RESUME:
+                resume = true;
+                break;
+            case OPT_APPEND:
+                if (!load_previous_matrix(kernel, optarg)) {
+                    return EXIT_FAILURE;
+                }
+                appending = true;
+                break;
+            case OPT_REFS:
+                refs_name = optarg;
+                break;
+            case OPT_KNN:
+                knn = atol(optarg);
+                if (knn < 1) {
+                    std::cerr << "--knn needs at least 1 neighbour"
+                              << std::endl;
+                    print_cli_help();
+                    return EXIT_FAILURE;
+                }
+                kernel.set_knn(knn);
+                break;
+            case OPT_APPROX:
+                bin_fraction = atof(optarg);
+                try {
+                    kernel.set_bin_fraction(bin_fraction);
+                } catch (std::invalid_argument &err) {
+                    std::cerr << err.what() << std::endl;
+                    print_cli_help();
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_STDERR:
+                stderr_out_name = optarg;
                 break;
+            case OPT_LOAD_POP:
+            case OPT_SAVE_POP:
+                std::cerr << "--load-pop and --save-pop only apply with -C"
+                          << std::endl;
+                print_cli_help();
+                return EXIT_FAILURE;
             // This section is for the global options
             case 'h':
             case 'V':
@@ -118,8 +488,47 @@ run_pwcalc(int argc, char *argv[])
         }
     }
 
-    // Ensure we have at least two counting hashes to work with
-    if (optind + 1 >= argc) {
+    if (!refs_name.empty()) {
+        std::ifstream refs(refs_name);
+        std::string ref;
+        while (std::getline(refs, ref)) {
+            if (!ref.empty()) {
+                references.push_back(ref);
+            }
+        }
+        if (references.empty()) {
+            std::cerr << "No reference countgraphs listed in '" << refs_name
+                      << "'" << std::endl;
+            return EXIT_FAILURE;
+        }
+        if (n_shards > 0 || appending) {
+            std::cerr << "--refs can't be used with --shard or --append"
+                      << std::endl;
+            print_cli_help();
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (knn > 0 && (n_shards > 0 || appending || !references.empty() ||
+                    !kern_out_name.empty() || is_npy_name(dist_out_name))) {
+        std::cerr << "--knn writes a text neighbour list to -d, and can't be "
+                  << "used with -k, --shard, --append or --refs" << std::endl;
+        print_cli_help();
+        return EXIT_FAILURE;
+    }
+
+    if (!stderr_out_name.empty() && (bin_fraction >= 1 || knn > 0 ||
+                                     n_shards > 0 || !references.empty() ||
+                                     appending)) {
+        std::cerr << "--stderr needs --approx, and a kernel matrix rather "
+                  << "than --knn, --shard, --refs or --append" << std::endl;
+        print_cli_help();
+        return EXIT_FAILURE;
+    }
+
+    // Ensure we have at least two counting hashes to work with, or a query
+    // to compare to the references
+    if (optind + (references.empty() ? 1 : 0) >= argc) {
         print_cli_help();
         return EXIT_FAILURE;
     }
@@ -128,36 +537,79 @@ run_pwcalc(int argc, char *argv[])
         filenames.push_back(std::string(argv[i]));
     }
 
-    // Save matrices to files if we've been asked to
-    if (dist_out_name.size() > 0) {
-        dist_out.open(dist_out_name);
+    // Shards save their kernels to the -k file, to be merged later
+    if (n_shards > 0 && (kern_out_name.empty() || kern_out_name == "-" ||
+                         !dist_out_name.empty())) {
+        std::cerr << "--shard needs -k for the shard's kernels, and no -d"
+                  << std::endl;
+        print_cli_help();
+        return EXIT_FAILURE;
     }
-    if (kern_out_name.size() > 0) {
-        kern_out.open(kern_out_name);
+
+    if (resume && checkpoint_name.empty()) {
+        std::cerr << "--resume needs the --checkpoint to resume from"
+                  << std::endl;
+        print_cli_help();
+        return EXIT_FAILURE;
+    }
+    if (!checkpoint_name.empty()) {
+        kernel.set_checkpoint(checkpoint_name, resume);
     }
 
-    if (weights_file.is_open()) {
-        kernel.load(weights_file);
+    if (weights_file_name.size() > 0 &&
+            !load_weights(kernel, weights_file_name)) {
+        return EXIT_FAILURE;
     }
 
     // Do the pairwise distance calculation
-    kernel.calculate_pairwise(filenames);
+    try {
+        if (references.empty()) {
+            kernel.calculate_pairwise(filenames);
+        } else {
+            kernel.calculate_cross(filenames, references);
+        }
+    } catch (std::runtime_error &err) {
+        std::cerr << err.what() << std::endl;
+        return EXIT_FAILURE;
+    }
 
-    // Only save the kernel distance if we have been given a file, or -
-    if (kern_out_name == "-") {
-        kernel.print_kernel_mat();
-    } else if (kern_out_name.size() > 0) {
-        kernel.print_kernel_mat(kern_out);
+    if (n_shards > 0) {
+        try {
+            kernel.save_shard(kern_out_name);
+        } catch (std::runtime_error &err) {
+            std::cerr << err.what() << std::endl;
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
     }
-    // Always save the distance matrix, to stdout if we don't have a file
-    if (dist_out_name.size() > 0 && dist_out_name != "-") {
-        kernel.print_distance_mat(dist_out);
-    } else {
-        kernel.print_distance_mat();
+
+    if (knn > 0) {
+        if (dist_out_name.size() > 0 && dist_out_name != "-") {
+            std::ofstream dist_out(dist_out_name);
+            kernel.print_neighbours(dist_out);
+            if (!dist_out) {
+                std::cerr << "Error writing neighbours to '" << dist_out_name
+                          << "'" << std::endl;
+                return EXIT_FAILURE;
+            }
+        } else {
+            kernel.print_neighbours();
+        }
+        return EXIT_SUCCESS;
     }
 
-    kern_out.close();
-    dist_out.close();
+    if (!write_matrices(kernel, kern_out_name, dist_out_name)) {
+        return EXIT_FAILURE;
+    }
+    if (!stderr_out_name.empty()) {
+        std::ofstream stderr_out(stderr_out_name);
+        kernel.print_stderr_mat(stderr_out);
+        if (!stderr_out) {
+            std::cerr << "Error writing standard errors to '"
+                      << stderr_out_name << "'" << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
     return EXIT_SUCCESS;
 }
 
@@ -169,6 +621,8 @@ run_precalc(int argc, char *argv[])
     int                         c               = 0;
     std::ofstream               weights_file;
     std::string                 weights_file_name;
+    std::vector<std::string>    pop_file_names;
+    std::string                 save_pop_name;
     std::vector<std::string>    filenames;
 
     while ((c = getopt_long(argc, argv, cli_opts.c_str(), cli_long_opts,
@@ -183,6 +637,9 @@ run_precalc(int argc, char *argv[])
             case 'q':
                 kernel.verbosity = 0;
                 break;
+            case OPT_NO_MMAP:
+                kernel.use_mmap = false;
+                break;
             case 'w':
                 weights_file_name = optarg;
                 weights_file.open(optarg);
@@ -193,9 +650,31 @@ run_precalc(int argc, char *argv[])
                     return EXIT_FAILURE;
                 }
                 break;
+            case OPT_LOAD_POP:
+                pop_file_names.push_back(optarg);
+                break;
+            case OPT_SAVE_POP:
+                save_pop_name = optarg;
+                break;
             // This section is for the pairwise calculation main options
             case 'k':
             case 'd':
+            case OPT_TILE_SIZE:
+            case OPT_WEIGHT_BITS:
+            case OPT_CACHE_MEM:
+            case OPT_IO_THREADS:
+            case OPT_PREFETCH:
+            case OPT_SPARSE_BELOW:
+            case OPT_SCRATCH:
+            case OPT_NO_PSD_CHECK:
+            case OPT_SHARD:
+            case OPT_CHECKPOINT:
+            case OPT_RESUME:
+            case OPT_APPEND:
+            case OPT_REFS:
+            case OPT_KNN:
+            case OPT_APPROX:
+            case OPT_STDERR:
             // This section is for the global options
             case 'h':
             case 'V':
@@ -208,13 +687,13 @@ run_precalc(int argc, char *argv[])
         }
     }
 
-    // Ensure we have at least two counting hashes to work with
-    if (optind + 1 >= argc) {
+    // Ensure we have some counting hashes or saved populations to work with
+    if (optind >= argc && pop_file_names.empty()) {
         print_cli_help();
         return EXIT_FAILURE;
     }
 
-    if (weights_file_name.size() < 1) {
+    if (weights_file_name.size() < 1 && save_pop_name.size() < 1) {
         std::cerr << "Weight vector file must be supplied with '-C'"
                   << std::endl;
         print_cli_help();
@@ -224,9 +703,88 @@ run_precalc(int argc, char *argv[])
     for (int i = optind; i < argc; i++) {
         filenames.push_back(std::string(argv[i]));
     }
-    kernel.calculate_entropy_vector(filenames);
+    try {
+        for (const auto &pop_file_name: pop_file_names) {
+            kernel.merge_population(pop_file_name);
+        }
+        kernel.add_hashtables(filenames);
+        if (save_pop_name.size() > 0) {
+            kernel.save_population(save_pop_name);
+        }
+        if (weights_file_name.size() > 0) {
+            if (kernel.population_samples() < 2) {
+                std::cerr << "At least two samples are needed to weight bins"
+                          << std::endl;
+                return EXIT_FAILURE;
+            }
+            kernel.calculate_weights();
+            weights_file.close();
+            kernel.save_weights(weights_file_name);
+        }
+    } catch (std::runtime_error &err) {
+        std::cerr << err.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
 
-    kernel.save(weights_file);
+int
+run_merge(int argc, char *argv[])
+{
+    Kernel                      kernel;
+    int                         option_idx      = 0;
+    int                         c               = 0;
+    std::string                 dist_out_name   = "";
+    std::string                 kern_out_name   = "";
+    std::vector<std::string>    filenames;
+
+    while ((c = getopt_long(argc, argv, "t:k:d:hvq", cli_long_opts,
+                            &option_idx)) > 0) {
+        switch (c) {
+            case 't':
+                kernel.set_num_threads(atol(optarg));
+                break;
+            case 'k':
+                kern_out_name = optarg;
+                break;
+            case 'd':
+                dist_out_name = optarg;
+                break;
+            case 'v':
+                kernel.verbosity = 2;
+                break;
+            case 'q':
+                kernel.verbosity = 0;
+                break;
+            case OPT_NO_PSD_CHECK:
+                kernel.check_psd = false;
+                break;
+            case 'h':
+                print_cli_help();
+                return EXIT_SUCCESS;
+            default:
+                print_cli_help();
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (optind >= argc) {
+        print_cli_help();
+        return EXIT_FAILURE;
+    }
+    for (int i = optind; i < argc; i++) {
+        filenames.push_back(std::string(argv[i]));
+    }
+
+    try {
+        kernel.merge_shards(filenames);
+    } catch (std::runtime_error &err) {
+        std::cerr << err.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (!write_matrices(kernel, kern_out_name, dist_out_name)) {
+        return EXIT_FAILURE;
+    }
     return EXIT_SUCCESS;
 }
 
@@ -246,6 +804,10 @@ main (int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
+    if (std::string(argv[1]) == "merge") {
+        return run_merge(argc - 1, argv + 1);
+    }
+
     int c;
     while ((c = getopt_long(argc, argv, cli_opts.c_str(), cli_long_opts,
                             &opt)) > 0) {
@@ -269,6 +831,25 @@ main (int argc, char *argv[])
             case 'q':
             case 'v':
             case 'w':
+            case OPT_TILE_SIZE:
+            case OPT_WEIGHT_BITS:
+            case OPT_NO_MMAP:
+            case OPT_CACHE_MEM:
+            case OPT_IO_THREADS:
+            case OPT_PREFETCH:
+            case OPT_SPARSE_BELOW:
+            case OPT_SCRATCH:
+            case OPT_LOAD_POP:
+            case OPT_SAVE_POP:
+            case OPT_NO_PSD_CHECK:
+            case OPT_SHARD:
+            case OPT_CHECKPOINT:
+            case OPT_RESUME:
+            case OPT_APPEND:
+            case OPT_REFS:
+            case OPT_KNN:
+            case OPT_APPROX:
+            case OPT_STDERR:
                 break;
             case '?':
                 print_cli_help();
@@ -11,7 +11,11 @@
 
 
 #include "kwip-utils.hh"
-#include <Eigen/Eigenvalues>
+#include <Eigen/Cholesky>
+
+#include <cstdio>
+#include <iomanip>
+#include <sstream>
 
 
 namespace kwip
@@ -28,22 +32,114 @@ print_version()
 
 void
 print_lsmat(MatrixXd &mat, std::ostream &outstream,
-            std::vector<std::string> &labels)
+            std::vector<std::string> &labels, int num_threads)
 {
     for (const auto &label: labels) {
         outstream << "\t" << label;
     }
     outstream << "\n";
 
-    for (size_t i = 0; i < labels.size(); i++) {
-        outstream << labels[i];
-        for (size_t j = 0; j < labels.size(); j++) {
-            outstream << "\t" << mat(i, j);
+    // Rows are formatted in parallel, a block at a time, and written in order
+    const size_t n = labels.size();
+    const size_t block = std::max(num_threads, 1) * 16;
+    std::vector<std::string> lines(block);
+    for (size_t first = 0; first < n; first += block) {
+        const size_t n_rows = std::min(block, n - first);
+        #pragma omp parallel num_threads(num_threads)
+        {
+            std::vector<double> row(n);
+            #pragma omp for schedule(dynamic)
+            for (size_t k = 0; k < n_rows; k++) {
+                for (size_t j = 0; j < n; j++) {
+                    row[j] = mat(first + k, j);
+                }
+                format_lsmat_row(lines[k], labels[first + k], row.data(), n,
+                                 outstream.precision());
+            }
+        }
+        for (size_t k = 0; k < n_rows; k++) {
+            outstream << lines[k];
         }
-        outstream << "\n";
     }
 }
 
+void
+format_lsmat_row(std::string &line, const std::string &label,
+                 const double *row, size_t n, int precision)
+{
+    // %g is the default float format of std::ostream
+    char cell[64];
+    line = label;
+    for (size_t j = 0; j < n; j++) {
+        int len = snprintf(cell, sizeof(cell), "\t%.*g", precision, row[j]);
+        line.append(cell, len);
+    }
+    line += "\n";
+}
+
+void
+write_npy_header(std::ostream &out, size_t rows, size_t cols)
+{
+    const uint16_t one = 1;
+    const bool little_endian = *(const uint8_t *)&one == 1;
+    std::ostringstream dict;
+    dict << "{'descr': '" << (little_endian ? '<' : '>') << "f4', "
+         << "'fortran_order': False, 'shape': (" << rows << ", " << cols
+         << "), }";
+    std::string header = dict.str();
+    // Pad with spaces and a newline so the data is 64-byte aligned
+    const size_t preamble = 10;
+    const size_t len = preamble + header.size() + 1;
+    header.append((64 - len % 64) % 64, ' ');
+    header += "\n";
+
+    out.write("\x93NUMPY", 6);
+    write_val<uint8_t>(out, 1);
+    write_val<uint8_t>(out, 0);
+    write_val<uint16_t>(out, header.size());
+    out.write(header.data(), header.size());
+}
+
+void
+read_npy_header(std::istream &in, size_t &rows, size_t &cols)
+{
+    const std::string what = ".npy array";
+    char magic[6];
+    if (!in.read(magic, 6) || std::string(magic, 6) != "\x93NUMPY") {
+        throw std::runtime_error("Not a .npy array");
+    }
+    const uint8_t major = read_val<uint8_t>(in, what);
+    read_val<uint8_t>(in, what);
+    size_t len = 0;
+    if (major == 1) {
+        len = read_val<uint16_t>(in, what);
+    } else {
+        len = read_val<uint32_t>(in, what);
+    }
+    std::string header(len, '\0');
+    if (!in.read(&header[0], len)) {
+        throw std::runtime_error("Unexpected end of " + what);
+    }
+
+    const uint16_t one = 1;
+    const bool little_endian = *(const uint8_t *)&one == 1;
+    const std::string descr = std::string("'descr': '") +
+                              (little_endian ? '<' : '>') + "f4'";
+    const std::string shape = "'shape': (";
+    const size_t shape_at = header.find(shape);
+    unsigned long long r = 0, c = 0;
+    if (header.find(descr) == std::string::npos ||
+            header.find("'fortran_order': False") == std::string::npos ||
+            shape_at == std::string::npos ||
+            sscanf(header.c_str() + shape_at + shape.size(), "%llu, %llu",
+                   &r, &c) != 2) {
+        throw std::runtime_error("Only 2D .npy arrays of float32 in C order "
+                                 "can be read");
+    }
+    rows = r;
+    cols = c;
+}
+
 void
 load_lsmat(MatrixXd &mat, const std::string &filename)
 {
@@ -122,13 +218,66 @@ kernel_to_distance(MatrixXd &dist, MatrixXd &kernel, bool normalise)
     }
 }
 
+size_t
+parse_size(const std::string &str)
+{
+    size_t end = 0;
+    double size = 0;
+    try {
+        size = std::stod(str, &end);
+    } catch (std::logic_error &err) {
+        throw std::invalid_argument("Invalid size: '" + str + "'");
+    }
+    std::string suffix = str.substr(end);
+    if (suffix.size() > 1 && (suffix.back() == 'B' || suffix.back() == 'b')) {
+        suffix.pop_back();
+    }
+    const std::string units = "KMGT";
+    if (suffix.size() == 1) {
+        size_t unit = units.find(toupper(suffix[0]));
+        if (unit == std::string::npos) {
+            throw std::invalid_argument("Invalid size: '" + str + "'");
+        }
+        size *= (double)(1ull << (10 * (unit + 1)));
+    } else if (suffix.size() > 1) {
+        throw std::invalid_argument("Invalid size: '" + str + "'");
+    }
+    if (size < 0) {
+        throw std::invalid_argument("Invalid size: '" + str + "'");
+    }
+    return (size_t)size;
+}
+
+std::string
+format_size(size_t bytes)
+{
+    const std::string units = "KMGT";
+    double size = bytes;
+    size_t unit = 0;
+    while (size >= 1024 && unit < units.size()) {
+        size /= 1024;
+        unit++;
+    }
+    std::ostringstream out;
+    out << std::setprecision(3) << size;
+    if (unit > 0) {
+        out << units[unit - 1];
+    }
+    out << "B";
+    return out.str();
+}
+
 bool
 matrix_is_pos_semidef(MatrixXd &mat)
 {
-    VectorXd eigenvalues = mat.eigenvalues().real();
-    // To be PSD, all eigenvalues must be greater than negative 1e-5. So check
-    // that the smallest is (as (eigenvalues > -1e-5).all() doesn't work).
-    return eigenvalues.minCoeff() > -1e-5;
+    // To be PSD, all eigenvalues must be greater than negative 1e-5, so the
+    // matrix shifted up by 1e-5 has a Cholesky factorisation. This needs only
+    // the (symmetric) lower triangle, in O(N^3 / 3), rather than a full
+    // general eigendecomposition.
+    MatrixXd shifted = mat;
+    shifted.diagonal().array() += 1e-5;
+    return shifted.selfadjointView<Eigen::Lower>().llt().info() ==
+           Eigen::Success;
 }
 
 } // end namespace kwip
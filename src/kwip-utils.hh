@@ -16,6 +16,7 @@
 #include <algorithm>
 #include <iostream>
 #include <fstream>
+#include <stdexcept>
 #include <string>
 #include <vector>
 
@@ -33,15 +34,64 @@ void print_version();
 
 void load_lsmat(MatrixXd &mat, const std::string &filename);
 void print_lsmat(MatrixXd &mat, std::ostream &outstream,
-                 std::vector<std::string> &labels);
+                 std::vector<std::string> &labels, int num_threads=1);
+
+// Format a row of a labelled, tab-separated matrix into `line`, as
+// std::ostream would with `precision` significant digits.
+void format_lsmat_row(std::string &line, const std::string &label,
+                      const double *row, size_t n, int precision=6);
+
+// Write the header of a .npy file of an `rows` x `cols` array of float32,
+// in C order.
+void write_npy_header(std::ostream &out, size_t rows, size_t cols);
+
+// Read the header of a .npy file written by write_npy_header, leaving `in` at
+// the first value. Throws unless it is a 2D array of float32 in C order.
+void read_npy_header(std::istream &in, size_t &rows, size_t &cols);
 
 void normalise_matrix(MatrixXd &norm, MatrixXd &input);
 void kernel_to_distance(MatrixXd &dist, MatrixXd &kernel, bool normalise=true);
 
-// Checks if a matrix is postitive semi-definite. Specifically, that all
-// eigenvalues are > -1e-5.
+// Parse a size in bytes with an optional K, M, G or T (binary) suffix, e.g.
+// "64G". Throws std::invalid_argument if `str` isn't a valid size.
+size_t parse_size(const std::string &str);
+
+// Format a size in bytes with a binary suffix, e.g. "1.5G".
+std::string format_size(size_t bytes);
+
+// Checks if a symmetric matrix is postitive semi-definite. Specifically, that
+// all eigenvalues are > -1e-5.
 bool matrix_is_pos_semidef(MatrixXd &mat);
 
+// Write the bytes of `val` to a binary file
+template<typename val_tp>
+void
+write_val(std::ostream &out, val_tp val)
+{
+    out.write((const char *)&val, sizeof(val));
+}
+
+// Read a value written by write_val. Throws if the file ends first, naming
+// it as `what`, e.g. "population counts: pop.bin".
+template<typename val_tp>
+val_tp
+read_val(std::istream &in, const std::string &what)
+{
+    val_tp val;
+    if (!in.read((char *)&val, sizeof(val))) {
+        throw std::runtime_error("Unexpected end of " + what);
+    }
+    return val;
+}
+
+// Pad a binary file to a multiple of 8 bytes, after writing `len` bytes
+inline void
+write_padding(std::ostream &out, size_t len)
+{
+    static const char zeros[8] = {0};
+    out.write(zeros, (8 - len % 8) % 8);
+}
+
 template <typename eltype>
 eltype
 vec_min(std::vector<eltype> &vec)
@@ -21,8 +21,11 @@
 #include <kwip-config.hh>
 #include <kwip-utils.hh>
 #include <countmin.hh>
+#include <countgraph.hh>
+#include <sample.hh>
 #include <kernel.hh>
 #include <population.hh>
+#include <simd.hh>
 #include <kernels/ip.hh>
 #include <kernels/wip.hh>
 
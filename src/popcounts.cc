@@ -0,0 +1,263 @@
+/*
+ * Copyright 2015 Kevin Murray <spam@kdmurray.id.au>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "popcounts.hh"
+#include "simd.hh"
+
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+#include <string>
+
+namespace kwip
+{
+
+PopCounts::
+PopCounts(size_t n_bins, int bits) :
+    _size(n_bins),
+    _bits(bits)
+{
+    if (bits != 2 && bits != 4 && bits != 8 && bits != 16 && bits != 32) {
+        throw std::invalid_argument("Invalid population count width: " +
+                                    std::to_string(bits));
+    }
+    _data.resize((bytes() + sizeof(uint64_t) - 1) / sizeof(uint64_t), 0);
+}
+
+int
+PopCounts::
+bits_for(uint64_t max_count)
+{
+    for (int bits: {2, 4, 8, 16}) {
+        if (max_count < (1ull << bits)) {
+            return bits;
+        }
+    }
+    return 32;
+}
+
+uint32_t
+PopCounts::
+max_count() const
+{
+    return _bits == 32 ? std::numeric_limits<uint32_t>::max() :
+                         (1u << _bits) - 1;
+}
+
+// Counts narrower than a byte sit at bit (bin * bits) % 8 of their byte
+static inline uint32_t
+get_packed(const uint8_t *raw, int bits, size_t bin)
+{
+    const size_t bit = bin * bits;
+    return (raw[bit / 8] >> (bit % 8)) & ((1u << bits) - 1);
+}
+
+uint32_t
+PopCounts::
+get(size_t bin) const
+{
+    switch (_bits) {
+        case 8:
+            return data()[bin];
+        case 16:
+            return ((const uint16_t *)data())[bin];
+        case 32:
+            return ((const uint32_t *)data())[bin];
+        default:
+            return get_packed(data(), _bits, bin);
+    }
+}
+
+template<typename count_tp>
+static inline void
+add_saturating(count_tp &count, uint32_t value)
+{
+    const count_tp max = std::numeric_limits<count_tp>::max();
+    count = value > (uint32_t)(max - count) ? max : count + value;
+}
+
+void
+PopCounts::
+add(size_t bin, uint32_t value)
+{
+    switch (_bits) {
+        case 8:
+            add_saturating(data()[bin], value);
+            break;
+        case 16:
+            add_saturating(((uint16_t *)data())[bin], value);
+            break;
+        case 32:
+            add_saturating(((uint32_t *)data())[bin], value);
+            break;
+        default: {
+            const size_t bit = bin * _bits;
+            const uint32_t mask = (1u << _bits) - 1;
+            uint8_t &byte = data()[bit / 8];
+            const uint32_t count = std::min(get_packed(data(), _bits, bin) +
+                                            (uint64_t)value, (uint64_t)mask);
+            byte = (byte & ~(mask << (bit % 8))) | (count << (bit % 8));
+        }
+    }
+}
+
+// Whole-byte counts are added in simple loops that the compiler vectorises
+template<typename count_tp>
+static uint64_t
+add_presence_typed(count_tp *acc, const uint8_t *counts, size_t n)
+{
+    const count_tp max = std::numeric_limits<count_tp>::max();
+    uint64_t sum = 0;
+    for (size_t i = 0; i < n; i++) {
+        acc[i] += counts[i] > 0 && acc[i] < max;
+        sum += counts[i];
+    }
+    return sum;
+}
+
+template<typename count_tp>
+static uint64_t
+add_counts_typed(count_tp *acc, const uint8_t *counts, size_t n)
+{
+    uint64_t sum = 0;
+    for (size_t i = 0; i < n; i++) {
+        add_saturating(acc[i], counts[i]);
+        sum += counts[i];
+    }
+    return sum;
+}
+
+uint64_t
+PopCounts::
+add_presence(const uint8_t *counts, size_t start, size_t end)
+{
+    const size_t n = end - start;
+    switch (_bits) {
+        case 8:
+            return add_presence_typed(data() + start, counts + start, n);
+        case 16:
+            return simd::add_presence_u16((uint16_t *)data() + start,
+                                          counts + start, n);
+        case 32:
+            return add_presence_typed((uint32_t *)data() + start,
+                                      counts + start, n);
+        default: {
+            uint64_t sum = 0;
+            for (size_t bin = start; bin < end; bin++) {
+                if (counts[bin] > 0) {
+                    add(bin, 1);
+                }
+                sum += counts[bin];
+            }
+            return sum;
+        }
+    }
+}
+
+uint64_t
+PopCounts::
+add_counts(const uint8_t *counts, size_t start, size_t end)
+{
+    const size_t n = end - start;
+    switch (_bits) {
+        case 8:
+            return add_counts_typed(data() + start, counts + start, n);
+        case 16:
+            return add_counts_typed((uint16_t *)data() + start,
+                                    counts + start, n);
+        case 32:
+            return add_counts_typed((uint32_t *)data() + start,
+                                    counts + start, n);
+        default: {
+            uint64_t sum = 0;
+            for (size_t bin = start; bin < end; bin++) {
+                add(bin, counts[bin]);
+                sum += counts[bin];
+            }
+            return sum;
+        }
+    }
+}
+
+void
+PopCounts::
+decode(size_t start, size_t n, uint32_t *out) const
+{
+    decode(data(), _bits, start, n, out);
+}
+
+void
+PopCounts::
+decode(const uint8_t *raw, int bits, size_t start, size_t n, uint32_t *out)
+{
+    switch (bits) {
+        case 8:
+            std::copy(raw + start, raw + start + n, out);
+            break;
+        case 16:
+            std::copy((const uint16_t *)raw + start,
+                      (const uint16_t *)raw + start + n, out);
+            break;
+        case 32:
+            std::copy((const uint32_t *)raw + start,
+                      (const uint32_t *)raw + start + n, out);
+            break;
+        default:
+            for (size_t i = 0; i < n; i++) {
+                out[i] = get_packed(raw, bits, start + i);
+            }
+    }
+}
+
+size_t
+PopCounts::
+count_nonzero() const
+{
+    const size_t range = 1 << 16;
+    std::vector<uint32_t> counts(range);
+    size_t nonzero = 0;
+    for (size_t start = 0; start < _size; start += range) {
+        const size_t n = std::min(range, _size - start);
+        decode(start, n, counts.data());
+        for (size_t i = 0; i < n; i++) {
+            nonzero += counts[i] > 0;
+        }
+    }
+    return nonzero;
+}
+
+void
+PopCounts::
+widen(int bits)
+{
+    if (bits <= _bits) {
+        return;
+    }
+    PopCounts wide(_size, bits);
+    const size_t range = 1 << 16;
+    std::vector<uint32_t> counts(range);
+    for (size_t start = 0; start < _size; start += range) {
+        const size_t n = std::min(range, _size - start);
+        decode(start, n, counts.data());
+        for (size_t i = 0; i < n; i++) {
+            wide.add(start + i, counts[i]);
+        }
+    }
+    *this = std::move(wide);
+}
+
+} // end namespace kwip
@@ -0,0 +1,121 @@
+/*
+ * Copyright 2015 Kevin Murray <spam@kdmurray.id.au>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef POPCOUNTS_HH
+#define POPCOUNTS_HH
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace kwip
+{
+
+// The population counts of one table, at 2, 4, 8, 16 or 32 bits per bin.
+// Counts of 2 and 4 bits are packed into bytes, low bits first. Counts
+// saturate at the largest value their width holds; widen() before that
+// happens keeps them exact.
+class PopCounts
+{
+public:
+    PopCounts                   (size_t                 n_bins,
+                                 int                    bits);
+
+    // Narrowest width that holds counts up to `max_count`
+    static int
+    bits_for                    (uint64_t               max_count);
+
+    int
+    bits                        () const { return _bits; }
+
+    // Number of bins
+    size_t
+    size                        () const { return _size; }
+
+    // Largest count held
+    uint32_t
+    max_count                   () const;
+
+    // Bytes of packed counts
+    size_t
+    bytes                       () const { return bytes(_size, _bits); }
+
+    static size_t
+    bytes                       (size_t                 n_bins,
+                                 int                    bits)
+    {
+        return (n_bins * bits + 7) / 8;
+    }
+
+    uint8_t *
+    data                        () { return (uint8_t *)_data.data(); }
+
+    const uint8_t *
+    data                        () const { return (const uint8_t *)_data.data(); }
+
+    uint32_t
+    get                         (size_t                 bin) const;
+
+    void
+    add                         (size_t                 bin,
+                                 uint32_t               value);
+
+    // Count each occupied bin of `counts` in [start, end), returning the sum
+    // of `counts` over those bins.
+    uint64_t
+    add_presence                (const uint8_t         *counts,
+                                 size_t                 start,
+                                 size_t                 end);
+
+    // Add `counts` in [start, end), returning their sum
+    uint64_t
+    add_counts                  (const uint8_t         *counts,
+                                 size_t                 start,
+                                 size_t                 end);
+
+    // Unpack counts of bins [start, start + n) into `out`
+    void
+    decode                      (size_t                 start,
+                                 size_t                 n,
+                                 uint32_t              *out) const;
+
+    // As above, from counts packed at `bits` per bin in `raw`
+    static void
+    decode                      (const uint8_t         *raw,
+                                 int                    bits,
+                                 size_t                 start,
+                                 size_t                 n,
+                                 uint32_t              *out);
+
+    // Number of bins with a count above zero
+    size_t
+    count_nonzero               () const;
+
+    // Repack the counts at `bits` per bin, if that is wider
+    void
+    widen                       (int                    bits);
+
+protected:
+    size_t                      _size;
+    int                         _bits;
+    // Held as uint64_t to keep counts of any width aligned
+    std::vector<uint64_t>       _data;
+};
+
+} // end namespace kwip
+
+#endif /* POPCOUNTS_HH */
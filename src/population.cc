@@ -17,109 +17,230 @@
 
 #include "population.hh"
 
+#include <limits>
+
 namespace kwip
 {
 
-template<typename bin_tp>
-KernelPopulation<bin_tp>::
+const std::string POPULATION_SIGNATURE = "KWPC";
+
+KernelPopulation::
 KernelPopulation():
-    _pop_counts(NULL),
-    _n_tables(0)
+    _n_tables(0),
+    _pop_n_samples(0),
+    _pop_capacity(0)
 {
     omp_init_lock(&_pop_table_lock);
+    omp_init_lock(&_pop_add_lock);
 }
 
-template<typename bin_tp>
-KernelPopulation<bin_tp>::
+KernelPopulation::
 ~KernelPopulation()
 {
     omp_destroy_lock(&_pop_table_lock);
-    if (_pop_counts != NULL) {
-        for (size_t i = 0; i < _n_tables; i++) {
-            delete[] _pop_counts[i];
+    omp_destroy_lock(&_pop_add_lock);
+}
+
+// Bins per range added by one thread. The range's population counts stay in
+// cache while every sample of a batch is added to them.
+static const size_t population_range_bins = 1 << 16;
+
+void
+KernelPopulation::
+add_hashtable(const std::string &hash_fname)
+{
+    _add_samples({_get_sample(hash_fname)});
+}
+
+void
+KernelPopulation::
+add_hashtables(const std::vector<std::string> &hash_fnames)
+{
+    // Samples are loaded through the cache, so those still cached are reused
+    // by the pairwise pass. If they won't all fit, compact copies are kept
+    // on local scratch for that pass instead.
+    const bool resident = _cache_holds(hash_fnames);
+    const bool scratch = !resident && !_scratch_dir.empty();
+    if (verbosity > 1) {
+        if (resident) {
+            *outstream << "Keeping samples cached for the pairwise pass"
+                       << std::endl;
+        } else if (scratch) {
+            *outstream << "Writing compact copies of samples to "
+                       << _scratch_dir << std::endl;
         }
-        delete[] _pop_counts;
+    }
+
+    _reserve_pop_counts(_pop_n_samples + hash_fnames.size());
+
+    const size_t batch_size = std::max(_num_threads, 1);
+    for (size_t first = 0; first < hash_fnames.size(); first += batch_size) {
+        const size_t n = std::min(batch_size, hash_fnames.size() - first);
+        std::vector<SampleShrPtr> batch(n);
+        std::vector<std::string> scratch_paths(n);
+
+        #pragma omp parallel for num_threads(_num_threads) schedule(dynamic)
+        for (size_t i = 0; i < n; i++) {
+            batch[i] = _get_sample(hash_fnames[first + i]);
+            if (scratch) {
+                scratch_paths[i] = _write_scratch_copy(*batch[i], first + i);
+            }
+            if (verbosity > 0) {
+                #pragma omp critical
+                {
+                    *outstream << "Loaded " << hash_fnames[first + i]
+                               << std::endl;
+                }
+            }
+        }
+        for (size_t i = 0; i < n; i++) {
+            if (!scratch_paths[i].empty()) {
+                _scratch_paths[hash_fnames[first + i]] = scratch_paths[i];
+            }
+        }
+        _add_samples(batch);
     }
 }
 
-template<typename bin_tp>
 void
-KernelPopulation<bin_tp>::
-add_hashtable(const std::string &hash_fname)
+KernelPopulation::
+_add_samples(const std::vector<SampleShrPtr> &samples)
 {
-    khmer::CountingHash ht(1, 1);
-    khmer::Byte **counts;
+    omp_set_lock(&_pop_add_lock);
+    try {
+        _reserve_pop_counts(_pop_n_samples + samples.size());
+        for (const auto &sample: samples) {
+            _check_pop_counts(*sample);
+        }
+    } catch (...) {
+        omp_unset_lock(&_pop_add_lock);
+        throw;
+    }
 
-    khmer::CountingHashFile::load(hash_fname, ht);
-    _check_pop_counts(ht);
+    for (size_t tab = 0; tab < _n_tables; tab++) {
+        const size_t tablesize = _tablesizes[tab];
+        const size_t n_ranges = (tablesize + population_range_bins - 1) /
+                                population_range_bins;
+        uint64_t tab_sum = 0;
 
-    counts = ht.get_raw_tables();
+        #pragma omp parallel for num_threads(_num_threads) schedule(dynamic) \
+                reduction(+:tab_sum)
+        for (size_t r = 0; r < n_ranges; r++) {
+            const size_t start = r * population_range_bins;
+            const size_t end = std::min(start + population_range_bins,
+                                        tablesize);
+            for (const auto &sample: samples) {
+                tab_sum += _add_table_range(*sample, tab, start, end);
+            }
+        }
+        _table_sums[tab] += tab_sum;
+    }
+    _pop_n_samples += samples.size();
+    omp_unset_lock(&_pop_add_lock);
+}
 
-    for (size_t i = 0; i < _n_tables; i++) {
+uint64_t
+KernelPopulation::
+_add_table_range(const Sample &sample, size_t tab, size_t start, size_t end)
+{
+    PopCounts &this_popcount = _pop_counts[tab];
+    const khmer::Byte *this_count = sample.dense_table(tab);
+    if (this_count == NULL) {
         uint64_t tab_count = 0;
-        // Save these here to avoid dereferencing twice below.
-        bin_tp *this_popcount = _pop_counts[i];
-        khmer::Byte *this_count = counts[i];
-        for (size_t j = 0; j < _tablesizes[i]; j++) {
-            __sync_fetch_and_add(&(this_popcount[j]), this_count[j]);
-            tab_count += this_count[j];
-        }
-        __sync_fetch_and_add(&_table_sums[i], tab_count);
+        sample.sparse_table(tab)->for_each(start, end,
+                [&](size_t bin, uint8_t count) {
+            this_popcount.add(bin, count);
+            tab_count += count;
+        });
+        return tab_count;
     }
+    return this_popcount.add_counts(this_count, start, end);
 }
 
-template<typename bin_tp>
 void
-KernelPopulation<bin_tp>::
-_check_pop_counts(khmer::CountingHash &ht)
+KernelPopulation::
+_check_pop_counts(const Sample &sample)
+{
+    _check_pop_counts(sample.tablesizes());
+}
+
+void
+KernelPopulation::
+_check_pop_counts(const std::vector<khmer::HashIntoType> &tablesizes)
 {
     omp_set_lock(&_pop_table_lock);
-    if (_pop_counts == NULL) {
-        std::vector<khmer::HashIntoType> tablesizes = ht.get_tablesizes();
+    if (_pop_counts.empty()) {
+        const int bits = PopCounts::bits_for(
+                _max_pop_count(std::max(_pop_capacity, (uint64_t)1)));
         _tablesizes = tablesizes;
         _n_tables = tablesizes.size();
-        _pop_counts = new bin_tp*[_n_tables];
         for (size_t i = 0; i < _n_tables; i++) {
-            _pop_counts[i] = new bin_tp[tablesizes[i]];
-            memset(_pop_counts[i], 0, tablesizes[i] * sizeof(bin_tp));
-        _table_sums.push_back(0);
+            _pop_counts.emplace_back(tablesizes[i], bits);
+            _table_sums.push_back(0);
+        }
+        if (verbosity > 1) {
+            size_t bytes = 0;
+            for (const auto &counts: _pop_counts) {
+                bytes += counts.bytes();
+            }
+            *outstream << "Population counts of " << bits << " bits per bin, "
+                       << bytes << " bytes" << std::endl;
         }
     }
     omp_unset_lock(&_pop_table_lock);
+    if (tablesizes != _tablesizes) {
+        throw std::runtime_error("Sample table sizes differ from those of the "
+                                 "population");
+    }
 }
 
 
-template<typename bin_tp>
 void
-KernelPopulation<bin_tp>::
+KernelPopulation::
 _free_pop_counts()
 {
     omp_set_lock(&_pop_table_lock);
-    if (_pop_counts != NULL) {
-        for (size_t i = 0; i < _n_tables; i++) {
-            delete[] _pop_counts[i];
-        }
-        delete[] _pop_counts;
-    }
+    _pop_counts.clear();
+    _table_sums.clear();
+    _pop_n_samples = 0;
+    _pop_capacity = 0;
     omp_unset_lock(&_pop_table_lock);
 }
 
+uint64_t
+KernelPopulation::
+_max_pop_count(uint64_t n_samples)
+{
+    return n_samples * std::numeric_limits<khmer::Byte>::max();
+}
 
-template<typename bin_tp>
 void
-KernelPopulation<bin_tp>::
-calculate_pairwise(std::vector<std::string> &hash_fnames)
+KernelPopulation::
+_reserve_pop_counts(uint64_t n_samples)
 {
-    #pragma omp parallel for num_threads(_num_threads)
-    for (size_t i = 0; i < hash_fnames.size(); i++) {
-        add_hashtable(hash_fnames[i]);
-        if (verbosity > 0) {
-            #pragma omp critical
-            {
-                *outstream << "Loaded " << hash_fnames[i] << std::endl;
+    omp_set_lock(&_pop_table_lock);
+    if (n_samples > _pop_capacity) {
+        _pop_capacity = n_samples;
+        const int bits = PopCounts::bits_for(_max_pop_count(n_samples));
+        if (!_pop_counts.empty() && bits > _pop_counts[0].bits()) {
+            if (verbosity > 1) {
+                *outstream << "Widening population counts to " << bits
+                           << " bits per bin" << std::endl;
+            }
+            for (auto &counts: _pop_counts) {
+                counts.widen(bits);
             }
         }
     }
+    omp_unset_lock(&_pop_table_lock);
+}
+
+
+void
+KernelPopulation::
+calculate_pairwise(std::vector<std::string> &hash_fnames)
+{
+    add_hashtables(hash_fnames);
 
     if (verbosity > 0) {
         *outstream << "Finished loading!" << std::endl;
@@ -130,19 +251,15 @@ calculate_pairwise(std::vector<std::string> &hash_fnames)
     Kernel::calculate_pairwise(hash_fnames);
 }
 
-template<typename bin_tp>
 double
-KernelPopulation<bin_tp>::
+KernelPopulation::
 fpr()
 {
     double fpr = 1;
     std::vector<double> tab_counts(_n_tables, 0);
 
     for (size_t i = 0; i < _n_tables; i++) {
-        uint64_t tab_count = 0;
-        for (size_t j = 0; j < _tablesizes[i]; j++) {
-            tab_count += _pop_counts[i][j] > 0 ? 1 : 0;
-        }
+        const uint64_t tab_count = _pop_counts[i].count_nonzero();
         tab_counts[i] = (double)tab_count / (double)_tablesizes[i];
     }
 
@@ -152,27 +269,117 @@ fpr()
     return fpr;
 }
 
-#if 0
-template<typename bin_tp>
+// Population count files hold the packed counts of each table, at the width
+// they were held in memory, 8-byte aligned:
+//
+//   signature[4] u8:version u8:count_bits u8:n_tables u8:0
+//   u64:n_samples u64:tablesizes[n_tables] u64:table_sums[n_tables]
+//   for each table: counts[tablesize] (padded)
 void
-KernelPopulation<bin_tp>::
-save(const std::string &filename)
+KernelPopulation::
+save_population(const std::string &filename)
 {
+    if (_pop_counts.empty()) {
+        throw std::runtime_error("There are no population counts to save");
+    }
+    std::ofstream out(filename, std::ios::binary);
+    if (!out) {
+        throw std::runtime_error("Cannot open population counts for writing: "
+                                 + filename);
+    }
+
+    out.write(POPULATION_SIGNATURE.data(), 4);
+    write_val<uint8_t>(out, POPULATION_VERSION);
+    write_val<uint8_t>(out, _pop_counts[0].bits());
+    write_val<uint8_t>(out, _n_tables);
+    write_val<uint8_t>(out, 0);
+    write_val<uint64_t>(out, _pop_n_samples);
+    for (size_t tab = 0; tab < _n_tables; tab++) {
+        write_val<uint64_t>(out, _tablesizes[tab]);
+    }
+    for (size_t tab = 0; tab < _n_tables; tab++) {
+        write_val<uint64_t>(out, _table_sums[tab]);
+    }
+    for (size_t tab = 0; tab < _n_tables; tab++) {
+        const size_t len = _pop_counts[tab].bytes();
+        out.write((const char *)_pop_counts[tab].data(), len);
+        write_padding(out, len);
+    }
+    if (!out) {
+        throw std::runtime_error("Failed to write population counts: " +
+                                 filename);
+    }
 }
 
-template<typename bin_tp>
 void
-KernelPopulation<bin_tp>::
-load(const std::string &filename)
+KernelPopulation::
+load_population(const std::string &filename)
 {
+    _free_pop_counts();
+    merge_population(filename);
 }
-#endif
 
-// Explicit compilation of standard types
-template class KernelPopulation<uint8_t>;
-template class KernelPopulation<uint16_t>;
-template class KernelPopulation<uint32_t>;
-template class KernelPopulation<uint64_t>;
+void
+KernelPopulation::
+merge_population(const std::string &filename)
+{
+    std::ifstream in(filename, std::ios::binary);
+    if (!in) {
+        throw std::runtime_error("Cannot open population counts: " + filename);
+    }
+    const std::string what = "population counts: " + filename;
+    char sig[4];
+    if (!in.read(sig, 4) || std::string(sig, 4) != POPULATION_SIGNATURE) {
+        throw std::runtime_error("Not kWIP population counts: " + filename);
+    }
+    if (read_val<uint8_t>(in, what) != POPULATION_VERSION) {
+        throw std::runtime_error("Incorrect kWIP population counts version: " +
+                                 filename);
+    }
+    const int bits = read_val<uint8_t>(in, what);
+    if (bits != 2 && bits != 4 && bits != 8 && bits != 16 && bits != 32) {
+        throw std::runtime_error("Invalid population count width: " +
+                                 filename);
+    }
+    const size_t n_tables = read_val<uint8_t>(in, what);
+    read_val<uint8_t>(in, what);
+    const uint64_t n_samples = read_val<uint64_t>(in, what);
+    std::vector<khmer::HashIntoType> tablesizes;
+    std::vector<uint64_t> table_sums;
+    for (size_t tab = 0; tab < n_tables; tab++) {
+        tablesizes.push_back(read_val<uint64_t>(in, what));
+    }
+    for (size_t tab = 0; tab < n_tables; tab++) {
+        table_sums.push_back(read_val<uint64_t>(in, what));
+    }
+
+    _reserve_pop_counts(_pop_n_samples + n_samples);
+    _check_pop_counts(tablesizes);
+
+    // Add the counts a range of bins at a time, to bound memory use. Ranges
+    // are whole bytes at any width.
+    std::vector<uint8_t> raw(PopCounts::bytes(population_range_bins, bits));
+    std::vector<uint32_t> counts(population_range_bins);
+    for (size_t tab = 0; tab < _n_tables; tab++) {
+        PopCounts &this_popcount = _pop_counts[tab];
+        for (size_t start = 0; start < _tablesizes[tab];
+                start += population_range_bins) {
+            const size_t n = std::min(population_range_bins,
+                                      (size_t)(_tablesizes[tab] - start));
+            if (!in.read((char *)raw.data(), PopCounts::bytes(n, bits))) {
+                throw std::runtime_error("Unexpected end of population "
+                                         "counts: " + filename);
+            }
+            PopCounts::decode(raw.data(), bits, 0, n, counts.data());
+            for (size_t j = 0; j < n; j++) {
+                this_popcount.add(start + j, counts[j]);
+            }
+        }
+        in.ignore((8 - PopCounts::bytes(_tablesizes[tab], bits) % 8) % 8);
+        _table_sums[tab] += table_sums[tab];
+    }
+    _pop_n_samples += n_samples;
+}
 
 } // end namespace kwip
 
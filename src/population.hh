@@ -20,25 +20,65 @@
 
 
 #include "kernel.hh"
+#include "popcounts.hh"
 
 #include <algorithm>
 
 namespace kwip
 {
 
-template<typename bin_tp>
+// Population count files hold the raw population counts of every table.
+extern const std::string POPULATION_SIGNATURE;
+const uint8_t POPULATION_VERSION = 2;
+
+// Population counts of every table. Their width is chosen from the number of
+// samples expected, and widened as more are added, so counts never saturate
+// unless a single bin's count exceeds 32 bits.
 class KernelPopulation : public Kernel
 {
 
 protected:
-    bin_tp                **_pop_counts;
+    std::vector<PopCounts>  _pop_counts;
     size_t                  _n_tables;
     std::vector<khmer::HashIntoType> _tablesizes;
     std::vector<uint64_t>   _table_sums;
+    uint64_t                _pop_n_samples;
+    // Number of samples the width of the counts is chosen for
+    uint64_t                _pop_capacity;
     omp_lock_t              _pop_table_lock;
+    // Held while samples are added, so one batch is added at a time
+    omp_lock_t              _pop_add_lock;
+
+    // Largest population count `n_samples` samples can give a bin
+    virtual uint64_t
+    _max_pop_count              (uint64_t                    n_samples);
 
+    // Widen the population counts, if needed, to hold `n_samples` samples
     void
-    _check_pop_counts           (khmer::CountingHash        &ht);
+    _reserve_pop_counts         (uint64_t                    n_samples);
+
+    void
+    _check_pop_counts           (const Sample               &sample);
+
+    // Allocate population counts for tables of `tablesizes` if there are
+    // none. Throws if the existing counts' tables differ.
+    void
+    _check_pop_counts           (const std::vector<khmer::HashIntoType> &tablesizes);
+
+    // Add bins [start, end) of table `tab` of `sample` to the population
+    // counts, returning the sum of the sample's counts over those bins.
+    virtual uint64_t
+    _add_table_range            (const Sample               &sample,
+                                 size_t                      tab,
+                                 size_t                      start,
+                                 size_t                      end);
+
+    // Add loaded samples to the population counts. Each thread adds every
+    // sample to its own ranges of bins, so no count is shared between
+    // threads and no atomic operations are needed. Calls are serialised, so
+    // this is safe to call from several threads.
+    void
+    _add_samples                (const std::vector<SampleShrPtr> &samples);
 
     void
     _free_pop_counts            ();
@@ -48,17 +88,36 @@ public:
 
     ~KernelPopulation();
 
-#if 0
-    virtual void
-    save                       (const std::string          &filename);
+    // Save the population counts, with their sample count and per-table
+    // sums, so populations can be extended or merged later.
+    void
+    save_population            (const std::string          &filename);
 
-    virtual void
-    load                       (const std::string          &filename);
-#endif
+    // Replace the population counts with those saved in `filename`
+    void
+    load_population            (const std::string          &filename);
 
-    virtual void
+    // Add the population counts saved in `filename` to these, as if their
+    // samples had been added. Counts saturate rather than overflow.
+    void
+    merge_population           (const std::string          &filename);
+
+    // Number of samples counted in the population
+    uint64_t
+    population_samples         () const { return _pop_n_samples; }
+
+    // Add one sample to the population counts. Safe to call from several
+    // threads at once: samples load in parallel, and are added one at a time.
+    void
     add_hashtable              (const std::string          &hash_fname);
 
+    // Add samples to the population counts, loading a batch of one sample
+    // per thread in parallel and adding the batch in parallel. Samples stay
+    // in the sample cache for the pairwise pass, or if they can't all fit
+    // and a scratch directory is set, are copied there for it.
+    void
+    add_hashtables             (const std::vector<std::string> &hash_fnames);
+
     virtual void
     calculate_pairwise         (std::vector<std::string>   &hash_fnames);
 
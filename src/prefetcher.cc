@@ -0,0 +1,102 @@
+/*
+ * Copyright 2015 Kevin Murray <spam@kdmurray.id.au>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "prefetcher.hh"
+
+namespace kwip
+{
+
+Prefetcher::
+Prefetcher(size_t n_threads, loader_t loader) :
+    _loader(loader),
+    _stop(false),
+    _started(0)
+{
+    for (size_t i = 0; i < n_threads; i++) {
+        _threads.emplace_back(&Prefetcher::_run, this);
+    }
+}
+
+Prefetcher::
+~Prefetcher()
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stop = true;
+        _queue.clear();
+    }
+    _cond.notify_all();
+    for (auto &thread: _threads) {
+        thread.join();
+    }
+}
+
+void
+Prefetcher::
+enqueue(const std::string &filename)
+{
+    if (_threads.empty()) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _queue.push_back(filename);
+    }
+    _cond.notify_one();
+}
+
+void
+Prefetcher::
+clear()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _queue.clear();
+}
+
+size_t
+Prefetcher::
+started()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _started;
+}
+
+void
+Prefetcher::
+_run()
+{
+    while (true) {
+        std::string filename;
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _cond.wait(lock, [this] { return _stop || !_queue.empty(); });
+            if (_stop) {
+                return;
+            }
+            filename = _queue.front();
+            _queue.pop_front();
+            _started++;
+        }
+        try {
+            _loader(filename);
+        } catch (...) {
+            // Reported by the compute thread that needs this file
+        }
+    }
+}
+
+} // end namespace kwip
@@ -0,0 +1,75 @@
+/*
+ * Copyright 2015 Kevin Murray <spam@kdmurray.id.au>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PREFETCHER_HH
+#define PREFETCHER_HH
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace kwip
+{
+
+// A pool of I/O threads that call `loader` on queued filenames in the
+// background, in queue order. The loader is expected to leave its result in a
+// shared cache, where the compute threads will find it (or wait on it, if the
+// load is still in flight). Errors are ignored here: the compute thread that
+// next asks the cache for that file will load it again and see the error.
+class Prefetcher
+{
+public:
+    typedef std::function<void(const std::string &)> loader_t;
+
+    Prefetcher                  (size_t                 n_threads,
+                                 loader_t               loader);
+
+    // Drops queued loads, and waits for those in flight to finish.
+    ~Prefetcher                 ();
+
+    void
+    enqueue                     (const std::string     &filename);
+
+    // Drop queued loads that have not yet started.
+    void
+    clear                       ();
+
+    // Number of queued filenames passed to the loader so far, whether or not
+    // they were already cached
+    size_t
+    started               ();
+
+protected:
+    std::vector<std::thread>    _threads;
+    loader_t                    _loader;
+    std::deque<std::string>     _queue;
+    std::mutex                  _mutex;
+    std::condition_variable     _cond;
+    bool                        _stop;
+    size_t                      _started;
+
+    void
+    _run                        ();
+};
+
+} // end namespace kwip
+
+#endif /* PREFETCHER_HH */
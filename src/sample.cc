@@ -0,0 +1,478 @@
+/*
+ * Copyright 2015 Kevin Murray <spam@kdmurray.id.au>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sample.hh"
+#include "kwip-utils.hh"
+
+#include <fstream>
+#include <stdexcept>
+
+#include <sys/mman.h>
+
+namespace kwip
+{
+
+const std::string SKETCH_SIGNATURE = "KWSK";
+
+SparseTable::
+SparseTable() :
+    _tablesize(0),
+    _nnz(0),
+    _own_chunk_starts(1, 0)
+{
+    _chunk_starts = _own_chunk_starts.data();
+    _offsets = NULL;
+    _counts = NULL;
+}
+
+SparseTable::
+SparseTable(size_t tablesize, size_t nnz, const uint64_t *chunk_starts,
+            const uint16_t *offsets, const uint8_t *counts) :
+    _tablesize(tablesize),
+    _nnz(nnz),
+    _chunk_starts(chunk_starts),
+    _offsets(offsets),
+    _counts(counts)
+{
+}
+
+SparseTable::
+SparseTable(const uint8_t *table, size_t tablesize) :
+    _tablesize(tablesize),
+    _nnz(0)
+{
+    const size_t n_chunk = n_chunks(tablesize);
+
+    _own_chunk_starts.reserve(n_chunk + 1);
+    for (size_t c = 0; c < n_chunk; c++) {
+        const size_t base = c * CHUNK_BINS;
+        const size_t end = std::min(base + CHUNK_BINS, tablesize);
+        _own_chunk_starts.push_back(_own_offsets.size());
+        for (size_t bin = base; bin < end; bin++) {
+            if (table[bin] > 0) {
+                _own_offsets.push_back(bin - base);
+                _own_counts.push_back(table[bin]);
+            }
+        }
+    }
+    _own_chunk_starts.push_back(_own_offsets.size());
+    _own_offsets.shrink_to_fit();
+    _own_counts.shrink_to_fit();
+
+    _nnz = _own_offsets.size();
+    _chunk_starts = _own_chunk_starts.data();
+    _offsets = _own_offsets.data();
+    _counts = _own_counts.data();
+}
+
+size_t
+SparseTable::
+bytes() const
+{
+    return (n_chunks() + 1) * sizeof(uint64_t) +
+           _nnz * (sizeof(uint16_t) + sizeof(uint8_t));
+}
+
+// Hash a bin of a table to choose it for a subset, with the splitmix64
+// finaliser
+static inline uint64_t
+bin_subset_hash(size_t tab, uint64_t bin)
+{
+    uint64_t h = bin + (tab + 1) * 0x9e3779b97f4a7c15ull;
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+    return h ^ (h >> 31);
+}
+
+BinSubset::
+BinSubset(const std::vector<khmer::HashIntoType> &tablesizes,
+          double fraction, int num_threads) :
+    _tablesizes(tablesizes)
+{
+    if (!(fraction > 0 && fraction <= 1)) {
+        throw std::invalid_argument("The fraction of bins kept must be in "
+                                    "(0, 1]");
+    }
+    // Bins hashing below `threshold` are kept
+    const bool keep_all = fraction >= 1;
+    const uint64_t threshold = keep_all ? 0 :
+                               (uint64_t)(fraction * 18446744073709551616.0);
+    auto kept = [&](size_t tab, uint64_t bin) {
+        return keep_all || bin_subset_hash(tab, bin) < threshold;
+    };
+    _chunk_starts.resize(tablesizes.size());
+    _offsets.resize(tablesizes.size());
+    for (size_t tab = 0; tab < tablesizes.size(); tab++) {
+        const uint64_t size = tablesizes[tab];
+        const int64_t n_chunk = SparseTable::n_chunks(size);
+        std::vector<uint64_t> &chunk_starts = _chunk_starts[tab];
+        std::vector<uint16_t> &offsets = _offsets[tab];
+        // Count each chunk's bins, then fill in its offsets from its start
+        chunk_starts.assign(n_chunk + 1, 0);
+        #pragma omp parallel for schedule(static) num_threads(num_threads)
+        for (int64_t c = 0; c < n_chunk; c++) {
+            const uint64_t base = c * SparseTable::CHUNK_BINS;
+            const uint64_t end = std::min(base + SparseTable::CHUNK_BINS, size);
+            uint64_t n_kept = 0;
+            for (uint64_t bin = base; bin < end; bin++) {
+                n_kept += kept(tab, bin);
+            }
+            chunk_starts[c + 1] = n_kept;
+        }
+        for (int64_t c = 0; c < n_chunk; c++) {
+            chunk_starts[c + 1] += chunk_starts[c];
+        }
+        offsets.resize(chunk_starts[n_chunk]);
+        #pragma omp parallel for schedule(static) num_threads(num_threads)
+        for (int64_t c = 0; c < n_chunk; c++) {
+            const uint64_t base = c * SparseTable::CHUNK_BINS;
+            const uint64_t end = std::min(base + SparseTable::CHUNK_BINS, size);
+            uint64_t k = chunk_starts[c];
+            for (uint64_t bin = base; bin < end; bin++) {
+                if (kept(tab, bin)) {
+                    offsets[k++] = bin - base;
+                }
+            }
+        }
+        if (offsets.empty()) {
+            throw std::invalid_argument("No bins of table " +
+                                        std::to_string(tab) + " are kept; "
+                                        "keep a larger fraction of bins");
+        }
+        _subset_sizes.push_back(offsets.size());
+    }
+}
+
+std::vector<uint64_t>
+BinSubset::
+bins(size_t tab) const
+{
+    const std::vector<uint64_t> &chunk_starts = _chunk_starts[tab];
+    std::vector<uint64_t> bins;
+    bins.reserve(_subset_sizes[tab]);
+    for (size_t c = 0; c + 1 < chunk_starts.size(); c++) {
+        for (size_t k = chunk_starts[c]; k < chunk_starts[c + 1]; k++) {
+            bins.push_back(c * SparseTable::CHUNK_BINS + _offsets[tab][k]);
+        }
+    }
+    return bins;
+}
+
+std::shared_ptr<Sample>
+BinSubset::
+apply(const Sample &sample, int num_threads) const
+{
+    if (sample.tablesizes() != _tablesizes) {
+        throw std::runtime_error("The sample's tables aren't those the bin "
+                                 "subset was chosen from");
+    }
+    std::vector<khmer::HashIntoType> sizes(_subset_sizes);
+    auto countgraph = std::make_shared<khmer::CountingHash>(sample.ksize(),
+                                                            sizes);
+    khmer::Byte **tables = countgraph->get_raw_tables();
+    for (size_t tab = 0; tab < _tablesizes.size(); tab++) {
+        const uint64_t *chunk_starts = _chunk_starts[tab].data();
+        const uint16_t *offsets = _offsets[tab].data();
+        const int64_t n_chunk = _chunk_starts[tab].size() - 1;
+        uint8_t *table = tables[tab];
+        const uint8_t *dense = sample.dense_table(tab);
+        if (dense != NULL) {
+            #pragma omp parallel for schedule(static) num_threads(num_threads)
+            for (int64_t c = 0; c < n_chunk; c++) {
+                const uint8_t *chunk = dense + c * SparseTable::CHUNK_BINS;
+                for (size_t k = chunk_starts[c]; k < chunk_starts[c + 1];
+                        k++) {
+                    table[k] = chunk[offsets[k]];
+                }
+            }
+            continue;
+        }
+        // Sketches have only their occupied bins, which are merged chunk by
+        // chunk with the subset's
+        const SparseTable &sparse = *sample.sparse_table(tab);
+        const uint64_t *occ_starts = sparse.chunk_starts();
+        const uint16_t *occ_offsets = sparse.offsets();
+        const uint8_t *occ_counts = sparse.counts();
+        #pragma omp parallel for schedule(static) num_threads(num_threads)
+        for (int64_t c = 0; c < n_chunk; c++) {
+            size_t k = chunk_starts[c];
+            const size_t k_end = chunk_starts[c + 1];
+            size_t e = occ_starts[c];
+            const size_t e_end = occ_starts[c + 1];
+            std::fill(table + k, table + k_end, 0);
+            while (k < k_end && e < e_end) {
+                if (offsets[k] < occ_offsets[e]) {
+                    k++;
+                } else if (occ_offsets[e] < offsets[k]) {
+                    e++;
+                } else {
+                    table[k++] = occ_counts[e++];
+                }
+            }
+        }
+    }
+
+    const uint8_t *first = tables[0];
+    const int64_t first_size = _subset_sizes[0];
+    int64_t occupied = 0;
+    #pragma omp parallel for schedule(static) num_threads(num_threads) \
+            reduction(+:occupied)
+    for (int64_t bin = 0; bin < first_size; bin++) {
+        occupied += first[bin] > 0;
+    }
+
+    std::shared_ptr<Sample> subset(new Sample());
+    subset->_ksize = sample.ksize();
+    subset->_tablesizes = _subset_sizes;
+    subset->_countgraph = countgraph;
+    subset->_occupied = occupied;
+    return subset;
+}
+
+Sample::
+Sample() :
+    _ksize(0),
+    _occupied(0)
+{
+}
+
+Sample::
+Sample(CountingHashShrPtr countgraph) :
+    _ksize(countgraph->ksize()),
+    _tablesizes(countgraph->get_tablesizes()),
+    _occupied(countgraph->n_occupied()),
+    _countgraph(countgraph)
+{
+}
+
+size_t
+Sample::
+bytes() const
+{
+    size_t bytes = 0;
+    if (_countgraph) {
+        bytes += countgraph_bytes(_countgraph);
+    }
+    for (const auto &table: _sparse) {
+        bytes += table.bytes();
+    }
+    return bytes;
+}
+
+const uint8_t *
+Sample::
+dense_table(size_t tab) const
+{
+    if (!_countgraph) {
+        return NULL;
+    }
+    return _countgraph->get_raw_tables()[tab];
+}
+
+const SparseTable *
+Sample::
+sparse_table(size_t tab) const
+{
+    if (_sparse.empty()) {
+        return NULL;
+    }
+    return &_sparse[tab];
+}
+
+double
+Sample::
+occupancy() const
+{
+    if (_tablesizes.empty() || _tablesizes[0] == 0) {
+        return 0.0;
+    }
+    if (!_sparse.empty()) {
+        return (double)_sparse[0].nnz() / _tablesizes[0];
+    }
+    return (double)_occupied / _tablesizes[0];
+}
+
+void
+Sample::
+index_occupied()
+{
+    if (!_sparse.empty() || !_countgraph) {
+        return;
+    }
+    for (size_t tab = 0; tab < n_tables(); tab++) {
+        _sparse.emplace_back(dense_table(tab), _tablesizes[tab]);
+    }
+}
+
+// Sketch files are laid out so that every array is 8-byte aligned, and so can
+// be used in place when mapped:
+//
+//   signature[4] u8:version u8:n_tables u16:0 u32:ksize u32:0
+//   u64:occupied u64:chunk_bins
+//   for each table:
+//     u64:tablesize u64:nnz u64:chunk_starts[n_chunks + 1]
+//     u16:offsets[nnz] (padded) u8:counts[nnz] (padded)
+std::shared_ptr<Sample>
+Sample::
+load_sketch(const std::string &filename, bool use_mmap)
+{
+    std::shared_ptr<Sample> sample(new Sample());
+    const char *data = NULL;
+    size_t len = 0;
+
+    if (use_mmap) {
+        void *map = map_file(filename, len);
+        madvise(map, len, MADV_WILLNEED);
+        sample->_storage = std::shared_ptr<void>(map, [len](void *ptr) {
+            munmap(ptr, len);
+        });
+        data = (const char *)map;
+    } else {
+        std::ifstream in(filename, std::ios::binary | std::ios::ate);
+        if (!in) {
+            throw std::runtime_error("Cannot open sketch file: " + filename);
+        }
+        len = in.tellg();
+        in.seekg(0);
+        // Hold the file as uint64_t to keep the arrays aligned
+        auto buf = std::make_shared<std::vector<uint64_t>>(
+                (len + sizeof(uint64_t) - 1) / sizeof(uint64_t));
+        if (!in.read((char *)buf->data(), len)) {
+            throw std::runtime_error("Cannot read sketch file: " + filename);
+        }
+        sample->_storage = buf;
+        data = (const char *)buf->data();
+    }
+
+    MapCursor cur(data, len, filename);
+    if (std::string(cur.skip(4), 4) != SKETCH_SIGNATURE) {
+        throw std::runtime_error("Not a kWIP sketch: " + filename);
+    }
+    if (cur.read<uint8_t>() != SKETCH_VERSION) {
+        throw std::runtime_error("Incorrect kWIP sketch version: " + filename);
+    }
+    size_t n_tables = cur.read<uint8_t>();
+    cur.read<uint16_t>();
+    sample->_ksize = cur.read<uint32_t>();
+    cur.read<uint32_t>();
+    sample->_occupied = cur.read<uint64_t>();
+    if (cur.read<uint64_t>() != SparseTable::CHUNK_BINS) {
+        throw std::runtime_error("Unsupported sketch chunk size: " + filename);
+    }
+
+    for (size_t tab = 0; tab < n_tables; tab++) {
+        size_t tablesize = cur.read<uint64_t>();
+        size_t nnz = cur.read<uint64_t>();
+        size_t n_chunks = SparseTable::n_chunks(tablesize);
+        if (nnz > tablesize) {
+            throw std::runtime_error("Corrupt kWIP sketch: " + filename);
+        }
+        const uint64_t *chunk_starts =
+            (const uint64_t *)cur.skip((n_chunks + 1) * sizeof(uint64_t));
+        const uint16_t *offsets =
+            (const uint16_t *)cur.skip(nnz * sizeof(uint16_t));
+        cur.align(8);
+        const uint8_t *counts = (const uint8_t *)cur.skip(nnz);
+        cur.align(8);
+
+        // Entries must stay within the table, as bins index dense tables
+        bool ok = chunk_starts[0] == 0 && chunk_starts[n_chunks] == nnz;
+        for (size_t c = 0; ok && c < n_chunks; c++) {
+            ok = chunk_starts[c] <= chunk_starts[c + 1];
+        }
+        if (ok && n_chunks > 0) {
+            const size_t last = tablesize - (n_chunks - 1) *
+                                            SparseTable::CHUNK_BINS;
+            for (size_t e = chunk_starts[n_chunks - 1]; e < nnz; e++) {
+                ok = ok && offsets[e] < last;
+            }
+        }
+        if (!ok) {
+            throw std::runtime_error("Corrupt kWIP sketch index: " + filename);
+        }
+        sample->_tablesizes.push_back(tablesize);
+        sample->_sparse.emplace_back(tablesize, nnz, chunk_starts, offsets,
+                                     counts);
+    }
+    return sample;
+}
+
+void
+Sample::
+save_sketch(const std::string &filename) const
+{
+    std::ofstream out(filename, std::ios::binary);
+    if (!out) {
+        throw std::runtime_error("Cannot open sketch for writing: " +
+                                 filename);
+    }
+
+    out.write(SKETCH_SIGNATURE.data(), 4);
+    write_val<uint8_t>(out, SKETCH_VERSION);
+    write_val<uint8_t>(out, n_tables());
+    write_val<uint16_t>(out, 0);
+    write_val<uint32_t>(out, _ksize);
+    write_val<uint32_t>(out, 0);
+    write_val<uint64_t>(out, _occupied);
+    write_val<uint64_t>(out, SparseTable::CHUNK_BINS);
+
+    for (size_t tab = 0; tab < n_tables(); tab++) {
+        // Index dense tables one at a time, to bound memory use
+        SparseTable indexed;
+        const SparseTable *table = sparse_table(tab);
+        if (table == NULL) {
+            indexed = SparseTable(dense_table(tab), _tablesizes[tab]);
+            table = &indexed;
+        }
+        const size_t nnz = table->nnz();
+        write_val<uint64_t>(out, table->tablesize());
+        write_val<uint64_t>(out, nnz);
+        out.write((const char *)table->chunk_starts(),
+                  (table->n_chunks() + 1) * sizeof(uint64_t));
+        out.write((const char *)table->offsets(), nnz * sizeof(uint16_t));
+        write_padding(out, nnz * sizeof(uint16_t));
+        out.write((const char *)table->counts(), nnz);
+        write_padding(out, nnz);
+    }
+    if (!out) {
+        throw std::runtime_error("Failed to write sketch: " + filename);
+    }
+}
+
+bool
+sample_is_sketch(const std::string &filename)
+{
+    return file_signature(filename) == SKETCH_SIGNATURE;
+}
+
+SampleShrPtr
+load_sample(const std::string &filename, bool use_mmap, int n_threads)
+{
+    if (sample_is_sketch(filename)) {
+        return Sample::load_sketch(filename, use_mmap);
+    }
+    return std::make_shared<Sample>(load_countgraph(filename, use_mmap,
+                                                    n_threads));
+}
+
+size_t
+sample_bytes(const SampleShrPtr &sample)
+{
+    return sample->bytes();
+}
+
+} // end namespace kwip
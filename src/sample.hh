@@ -0,0 +1,361 @@
+/*
+ * Copyright 2015 Kevin Murray <spam@kdmurray.id.au>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SAMPLE_HH
+#define SAMPLE_HH
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "countgraph.hh"
+
+namespace kwip
+{
+
+// kWIP sketch files hold only the occupied bins of each table of a sample.
+extern const std::string SKETCH_SIGNATURE;
+const uint8_t SKETCH_VERSION = 1;
+
+// The occupied bins of one count table, in increasing order. Bins are stored
+// as 16-bit offsets within fixed chunks of bins, with the index of each
+// chunk's first entry, so any range of bins can be found directly. This costs
+// three bytes per occupied bin, plus eight per chunk.
+class SparseTable
+{
+public:
+    static const size_t CHUNK_BINS = 1 << 16;
+
+    SparseTable                 ();
+
+    // A view of arrays held elsewhere, e.g. in a mapped sketch file
+    SparseTable                 (size_t                 tablesize,
+                                 size_t                 nnz,
+                                 const uint64_t        *chunk_starts,
+                                 const uint16_t        *offsets,
+                                 const uint8_t         *counts);
+
+    // Index the occupied bins of a dense table
+    SparseTable                 (const uint8_t         *table,
+                                 size_t                 tablesize);
+
+    // Views point into their own storage, which survives moves but not copies
+    SparseTable                 (const SparseTable     &other) = delete;
+    SparseTable                 (SparseTable           &&other) = default;
+    SparseTable &
+    operator=                   (SparseTable           &&other) = default;
+
+    size_t
+    tablesize                   () const { return _tablesize; }
+
+    // Number of occupied bins
+    size_t
+    nnz                         () const { return _nnz; }
+
+    size_t
+    n_chunks                    () const { return n_chunks(_tablesize); }
+
+    static size_t
+    n_chunks                    (size_t                 tablesize)
+    {
+        return (tablesize + CHUNK_BINS - 1) / CHUNK_BINS;
+    }
+
+    // Memory used by the index
+    size_t
+    bytes                       () const;
+
+    const uint64_t *
+    chunk_starts                () const { return _chunk_starts; }
+
+    const uint16_t *
+    offsets                     () const { return _offsets; }
+
+    const uint8_t *
+    counts                      () const { return _counts; }
+
+    // Entries [lo, hi) of chunk `chunk` whose bins are within [start, end)
+    void
+    entry_range                 (size_t                 chunk,
+                                 size_t                 start,
+                                 size_t                 end,
+                                 size_t                &lo,
+                                 size_t                &hi) const
+    {
+        const size_t base = chunk * CHUNK_BINS;
+        lo = _chunk_starts[chunk];
+        hi = _chunk_starts[chunk + 1];
+        if (start > base) {
+            lo = std::lower_bound(_offsets + lo, _offsets + hi,
+                                  (uint16_t)(start - base)) - _offsets;
+        }
+        if (end < base + CHUNK_BINS) {
+            hi = std::lower_bound(_offsets + lo, _offsets + hi,
+                                  (uint16_t)(end - base)) - _offsets;
+        }
+    }
+
+    // Call `fn(bin, count)` for each occupied bin in [start, end)
+    template<typename fn_t>
+    void
+    for_each                    (size_t                 start,
+                                 size_t                 end,
+                                 fn_t                   fn) const
+    {
+        if (start >= end) {
+            return;
+        }
+        for (size_t c = start / CHUNK_BINS; c <= (end - 1) / CHUNK_BINS; c++) {
+            const size_t base = c * CHUNK_BINS;
+            size_t lo, hi;
+            entry_range(c, start, end, lo, hi);
+            for (size_t e = lo; e < hi; e++) {
+                fn(base + _offsets[e], _counts[e]);
+            }
+        }
+    }
+
+protected:
+    size_t                      _tablesize;
+    size_t                      _nnz;
+    const uint64_t             *_chunk_starts;
+    const uint16_t             *_offsets;
+    const uint8_t              *_counts;
+    std::vector<uint64_t>       _own_chunk_starts;
+    std::vector<uint16_t>       _own_offsets;
+    std::vector<uint8_t>        _own_counts;
+};
+
+// sum(a[i] * b[i] * weight(i)) over the occupied bins of `a` in [start, end)
+template<typename weight_fn_t>
+double
+sparse_dense_dot                (const SparseTable     &a,
+                                 const uint8_t         *b,
+                                 size_t                 start,
+                                 size_t                 end,
+                                 weight_fn_t            weight)
+{
+    double sum = 0;
+    a.for_each(start, end, [&](size_t bin, uint8_t count) {
+        if (b[bin] > 0) {
+            sum += (double)((uint32_t)count * b[bin]) * weight(bin);
+        }
+    });
+    return sum;
+}
+
+// sum(a[i] * b[i] * weight(i)) over the bins occupied in both `a` and `b`
+// within [start, end), merging the two chunk by chunk.
+template<typename weight_fn_t>
+double
+sparse_sparse_dot               (const SparseTable     &a,
+                                 const SparseTable     &b,
+                                 size_t                 start,
+                                 size_t                 end,
+                                 weight_fn_t            weight)
+{
+    double sum = 0;
+    if (start >= end) {
+        return sum;
+    }
+    const uint16_t *a_off = a.offsets(), *b_off = b.offsets();
+    const uint8_t *a_cnt = a.counts(), *b_cnt = b.counts();
+    for (size_t c = start / SparseTable::CHUNK_BINS;
+            c <= (end - 1) / SparseTable::CHUNK_BINS; c++) {
+        const size_t base = c * SparseTable::CHUNK_BINS;
+        size_t i, i_end, j, j_end;
+        a.entry_range(c, start, end, i, i_end);
+        b.entry_range(c, start, end, j, j_end);
+        while (i < i_end && j < j_end) {
+            if (a_off[i] < b_off[j]) {
+                i++;
+            } else if (b_off[j] < a_off[i]) {
+                j++;
+            } else {
+                sum += (double)((uint32_t)a_cnt[i] * b_cnt[j]) *
+                       weight(base + a_off[i]);
+                i++;
+                j++;
+            }
+        }
+    }
+    return sum;
+}
+
+class Sample;
+
+// A deterministic subset of the bins of each table, those whose index hashes
+// below `fraction` of the hash range. Every sample, and the bin weights, keep
+// the same bins, so kernels over the subset estimate those over every bin
+// once scaled up. Bins are held as a SparseTable's are, as 16-bit offsets
+// into chunks of SparseTable::CHUNK_BINS, and threads take whole chunks.
+class BinSubset
+{
+public:
+    // Throws std::invalid_argument unless 0 < `fraction` <= 1, or if a
+    // table would have no bins
+    BinSubset                   (const std::vector<khmer::HashIntoType> &tablesizes,
+                                 double                 fraction,
+                                 int                    num_threads=1);
+
+    // Sizes of the whole tables
+    const std::vector<khmer::HashIntoType> &
+    tablesizes                  () const { return _tablesizes; }
+
+    // Sizes of the tables of the subset
+    const std::vector<khmer::HashIntoType> &
+    subset_sizes                () const { return _subset_sizes; }
+
+    // The bins of table `tab` in the subset, in increasing order
+    std::vector<uint64_t>
+    bins                        (size_t                 tab) const;
+
+    // Ratio of the bins of table `tab` to those of its subset
+    double
+    scale                       (size_t                 tab) const
+    {
+        return (double)_tablesizes[tab] / _subset_sizes[tab];
+    }
+
+    // The subset's bins of a whole table `table`
+    template<typename val_tp>
+    std::vector<val_tp>
+    apply                       (const val_tp          *table,
+                                 size_t                 tab,
+                                 int                    num_threads=1) const
+    {
+        std::vector<val_tp> subset(_subset_sizes[tab]);
+        const uint64_t *chunk_starts = _chunk_starts[tab].data();
+        const uint16_t *offsets = _offsets[tab].data();
+        const int64_t n_chunk = _chunk_starts[tab].size() - 1;
+        #pragma omp parallel for schedule(static) num_threads(num_threads)
+        for (int64_t c = 0; c < n_chunk; c++) {
+            const val_tp *chunk = table + c * SparseTable::CHUNK_BINS;
+            for (size_t k = chunk_starts[c]; k < chunk_starts[c + 1]; k++) {
+                subset[k] = chunk[offsets[k]];
+            }
+        }
+        return subset;
+    }
+
+    // A sample of only the subset's bins, held densely. Throws unless
+    // `sample` has the tables the subset was chosen from.
+    std::shared_ptr<Sample>
+    apply                       (const Sample          &sample,
+                                 int                    num_threads=1) const;
+
+protected:
+    std::vector<khmer::HashIntoType> _tablesizes;
+    std::vector<khmer::HashIntoType> _subset_sizes;
+    // Per table, the first bin of each chunk (and the number of bins), and
+    // the offsets of bins within their chunk
+    std::vector<std::vector<uint64_t>> _chunk_starts;
+    std::vector<std::vector<uint16_t>> _offsets;
+};
+
+// A sample's count tables, held densely (as a countgraph), sparsely (as
+// occupied bin indexes), or both.
+class Sample
+{
+public:
+    // A sample with dense tables only
+    explicit Sample             (CountingHashShrPtr     countgraph);
+
+    // Load a kWIP sketch, mapping it if `use_mmap` is set, otherwise reading
+    // it into memory.
+    static std::shared_ptr<Sample>
+    load_sketch                 (const std::string     &filename,
+                                 bool                   use_mmap=true);
+
+    size_t
+    ksize                       () const { return _ksize; }
+
+    size_t
+    n_tables                    () const { return _tablesizes.size(); }
+
+    const std::vector<khmer::HashIntoType> &
+    tablesizes                  () const { return _tablesizes; }
+
+    uint64_t
+    n_occupied                  () const { return _occupied; }
+
+    // Memory used by the tables and indexes
+    size_t
+    bytes                       () const;
+
+    // The countgraph, or NULL for a sample loaded from a sketch
+    const CountingHashShrPtr &
+    countgraph                  () const { return _countgraph; }
+
+    // Dense table `tab`, or NULL if the sample has none
+    const uint8_t *
+    dense_table                 (size_t                 tab) const;
+
+    // Sparse table `tab`, or NULL if the sample has none
+    const SparseTable *
+    sparse_table                (size_t                 tab) const;
+
+    // Fraction of bins occupied, from the first table
+    double
+    occupancy                   () const;
+
+    // Build sparse indexes of the occupied bins of the dense tables, so
+    // kernels can skip empty bins. Does nothing if already indexed.
+    void
+    index_occupied              ();
+
+    // Save as a kWIP sketch, indexing the dense tables if required
+    void
+    save_sketch                 (const std::string     &filename) const;
+
+protected:
+    friend class BinSubset;
+
+    Sample                      ();
+
+    size_t                      _ksize;
+    std::vector<khmer::HashIntoType> _tablesizes;
+    uint64_t                    _occupied;
+    CountingHashShrPtr          _countgraph;
+    std::vector<SparseTable>    _sparse;
+    // Backing store of sparse tables loaded from a sketch
+    std::shared_ptr<void>       _storage;
+};
+
+typedef std::shared_ptr<Sample> SampleShrPtr;
+
+// True if `filename` is a kWIP sketch
+bool
+sample_is_sketch                (const std::string     &filename);
+
+// Load a sample from a kWIP sketch or any countgraph load_countgraph() reads,
+// inflating block-compressed countgraphs on `n_threads` threads
+SampleShrPtr
+load_sample                     (const std::string     &filename,
+                                 bool                   use_mmap=true,
+                                 int                    n_threads=1);
+
+// Memory used by a sample, for sizing caches
+size_t
+sample_bytes                    (const SampleShrPtr    &sample);
+
+} // end namespace kwip
+
+#endif /* SAMPLE_HH */
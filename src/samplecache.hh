@@ -0,0 +1,280 @@
+/*
+ * Copyright 2015 Kevin Murray <spam@kdmurray.id.au>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SAMPLECACHE_HH
+#define SAMPLECACHE_HH
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace kwip
+{
+
+struct SampleCacheStats
+{
+    uint64_t    hits;
+    uint64_t    misses;
+    uint64_t    evictions;
+    uint64_t    bytes_loaded;
+};
+
+// A thread-safe cache of loaded samples, bounded by the total size of its
+// entries and/or by their number (a limit of 0 is no limit).
+//
+// Keys are spread over independently locked shards, and no lock is held while
+// a value loads. Concurrent misses on one key wait on a single load, and
+// misses on different keys load in parallel. Eviction is least recently used
+// over the whole cache: each use of an entry takes a stamp from a global
+// clock, and eviction drops the entry with the oldest stamp of any shard. Only
+// eviction looks across shards; lookups lock just their own shard. The entry
+// just loaded is never evicted, so a single value larger than the budget can
+// still be used. Values still held by callers after
+// eviction stay alive until released.
+template<typename key_t, typename value_t>
+class SampleCache
+{
+public:
+    typedef std::function<value_t(const key_t &)>  loader_t;
+    typedef std::function<size_t(const value_t &)> sizer_t;
+
+    SampleCache(size_t max_bytes, size_t max_entries, sizer_t sizer,
+                size_t n_shards=16) :
+        _shards(n_shards),
+        _sizer(sizer),
+        _max_bytes(max_bytes),
+        _max_entries(max_entries),
+        _bytes(0),
+        _entries(0),
+        _hits(0),
+        _misses(0),
+        _evictions(0),
+        _bytes_loaded(0),
+        _clock(0)
+    {
+    }
+
+    // Get the value for `key`, calling `loader` to load it if it isn't
+    // cached. Exceptions thrown by `loader` propagate to every caller waiting
+    // on that load, and the key is not cached.
+    value_t
+    get(const key_t &key, const loader_t &loader)
+    {
+        Shard &shard = _shard(key);
+        std::shared_ptr<std::promise<value_t>> promise;
+        std::shared_future<value_t> future;
+        {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            auto it = shard.map.find(key);
+            if (it != shard.map.end()) {
+                _hits++;
+                Entry &entry = it->second;
+                if (entry.ready) {
+                    entry.stamp = _clock++;
+                    shard.lru.splice(shard.lru.begin(), shard.lru, entry.lru);
+                }
+                future = entry.value;
+            } else {
+                _misses++;
+                promise = std::make_shared<std::promise<value_t>>();
+                Entry &entry = shard.map[key];
+                entry.value = promise->get_future().share();
+                entry.ready = false;
+                entry.bytes = 0;
+                future = entry.value;
+            }
+        }
+        if (!promise) {
+            // Hit, or another thread is already loading this key
+            return future.get();
+        }
+
+        value_t value;
+        try {
+            value = loader(key);
+        } catch (...) {
+            promise->set_exception(std::current_exception());
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            shard.map.erase(key);
+            throw;
+        }
+        promise->set_value(value);
+
+        size_t bytes = _sizer(value);
+        {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            Entry &entry = shard.map[key];
+            entry.ready = true;
+            entry.bytes = bytes;
+            entry.stamp = _clock++;
+            shard.lru.push_front(key);
+            entry.lru = shard.lru.begin();
+        }
+        _bytes += bytes;
+        _entries++;
+        _bytes_loaded += bytes;
+        _evict(key);
+        return value;
+    }
+
+    bool
+    exists(const key_t &key)
+    {
+        Shard &shard = _shard(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.map.find(key);
+        return it != shard.map.end() && it->second.ready;
+    }
+
+    // Number of loaded entries
+    size_t
+    size() const
+    {
+        return _entries;
+    }
+
+    // Total size of loaded entries
+    size_t
+    bytes() const
+    {
+        return _bytes;
+    }
+
+    // Change the limits, evicting entries if required. Not safe to call
+    // concurrently with get().
+    void
+    set_limits(size_t max_bytes, size_t max_entries)
+    {
+        _max_bytes = max_bytes;
+        _max_entries = max_entries;
+        _evict(key_t());
+    }
+
+    SampleCacheStats
+    stats() const
+    {
+        return SampleCacheStats {_hits, _misses, _evictions, _bytes_loaded};
+    }
+
+protected:
+    struct Entry
+    {
+        std::shared_future<value_t>         value;
+        bool                                ready;
+        size_t                              bytes;
+        uint64_t                            stamp;
+        typename std::list<key_t>::iterator lru;
+    };
+
+    // Stamps are taken under the shard's lock, so each shard's LRU list is
+    // in stamp order, and its least recently used entry is at the back
+    struct Shard
+    {
+        std::mutex                          mutex;
+        std::unordered_map<key_t, Entry>    map;
+        std::list<key_t>                    lru;
+    };
+
+    std::vector<Shard>          _shards;
+    sizer_t                     _sizer;
+    size_t                      _max_bytes;
+    size_t                      _max_entries;
+    std::atomic<size_t>         _bytes;
+    std::atomic<size_t>         _entries;
+    std::atomic<uint64_t>       _hits;
+    std::atomic<uint64_t>       _misses;
+    std::atomic<uint64_t>       _evictions;
+    std::atomic<uint64_t>       _bytes_loaded;
+    std::atomic<uint64_t>       _clock;
+    std::mutex                  _evict_mutex;
+
+    Shard &
+    _shard(const key_t &key)
+    {
+        return _shards[std::hash<key_t>()(key) % _shards.size()];
+    }
+
+    bool
+    _over_limits()
+    {
+        return (_max_bytes > 0 && _bytes > _max_bytes) ||
+               (_max_entries > 0 && _entries > _max_entries);
+    }
+
+    // The least recently used entry of `shard` other than `keep`, or
+    // shard.map.end(). The shard's lock must be held.
+    typename std::unordered_map<key_t, Entry>::iterator
+    _oldest(Shard &shard, const key_t &keep)
+    {
+        auto victim = shard.lru.rbegin();
+        while (victim != shard.lru.rend() && *victim == keep) {
+            victim++;
+        }
+        if (victim == shard.lru.rend()) {
+            return shard.map.end();
+        }
+        return shard.map.find(*victim);
+    }
+
+    // Evict least recently used entries, other than `keep`, until the cache
+    // is within its limits.
+    void
+    _evict(const key_t &keep)
+    {
+        std::lock_guard<std::mutex> evict_lock(_evict_mutex);
+        while (_over_limits()) {
+            Shard *oldest = nullptr;
+            uint64_t oldest_stamp = 0;
+            for (auto &shard: _shards) {
+                std::lock_guard<std::mutex> lock(shard.mutex);
+                auto it = _oldest(shard, keep);
+                if (it == shard.map.end()) {
+                    continue;
+                }
+                if (oldest == nullptr || it->second.stamp < oldest_stamp) {
+                    oldest = &shard;
+                    oldest_stamp = it->second.stamp;
+                }
+            }
+            if (oldest == nullptr) {
+                return;
+            }
+            std::lock_guard<std::mutex> lock(oldest->mutex);
+            auto it = _oldest(*oldest, keep);
+            if (it == oldest->map.end() || it->second.stamp != oldest_stamp) {
+                // Used since we looked, so look again
+                continue;
+            }
+            _bytes -= it->second.bytes;
+            _entries--;
+            _evictions++;
+            oldest->lru.erase(it->second.lru);
+            oldest->map.erase(it);
+        }
+    }
+};
+
+} // end namespace kwip
+
+#endif /* SAMPLECACHE_HH */
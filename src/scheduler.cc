@@ -0,0 +1,75 @@
+/*
+ * Copyright 2015 Kevin Murray <spam@kdmurray.id.au>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "scheduler.hh"
+
+#include <algorithm>
+#include <list>
+
+namespace kwip
+{
+
+std::vector<TilePair>
+schedule_tile_pairs(size_t n_tiles, size_t cache_tiles)
+{
+    std::vector<TilePair> schedule;
+    const size_t panel = std::max(cache_tiles, schedule_min_cache_tiles) - 2;
+
+    for (size_t start = 0; start < n_tiles; start += panel) {
+        const size_t end = std::min(start + panel, n_tiles);
+        // Pairs within the panel, starting from the tiles streamed last
+        for (size_t ti = start; ti < end; ti++) {
+            for (size_t tj = ti; tj < end; tj++) {
+                schedule.emplace_back(ti, tj);
+            }
+        }
+        // Stream every later tile past the panel, from last to first
+        for (size_t tj = n_tiles; tj-- > end; ) {
+            for (size_t ti = start; ti < end; ti++) {
+                schedule.emplace_back(ti, tj);
+            }
+        }
+    }
+    return schedule;
+}
+
+size_t
+count_tile_loads(const std::vector<TilePair> &schedule, size_t cache_tiles)
+{
+    std::list<size_t> lru;
+    size_t loads = 0;
+
+    auto use = [&](size_t tile) {
+        auto it = std::find(lru.begin(), lru.end(), tile);
+        if (it != lru.end()) {
+            lru.erase(it);
+        } else {
+            loads++;
+        }
+        lru.push_front(tile);
+        if (lru.size() > cache_tiles) {
+            lru.pop_back();
+        }
+    };
+    for (const auto &pair: schedule) {
+        use(pair.first);
+        use(pair.second);
+    }
+    return loads;
+}
+
+} // end namespace kwip
@@ -0,0 +1,58 @@
+/*
+ * Copyright 2015 Kevin Murray <spam@kdmurray.id.au>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SCHEDULER_HH
+#define SCHEDULER_HH
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+namespace kwip
+{
+
+// A pair of tiles (row tile, column tile), with row <= column
+typedef std::pair<size_t, size_t> TilePair;
+
+// The fewest cached tiles the schedule walks with: a panel of one tile, and
+// two tiles streamed past it. With fewer, each streamed tile evicts the panel.
+const size_t schedule_min_cache_tiles = 3;
+
+// Order the pairs of tiles of the upper triangle of an `n_tiles` square so
+// that an LRU cache of `cache_tiles` tiles reloads as few tiles as possible.
+//
+// The tiles are walked as a block triangle: a panel of `cache_tiles - 2`
+// tiles is kept resident while every later tile is streamed past it through
+// the remaining two slots (two, so that LRU eviction drops the previous
+// streamed tile rather than a panel tile). Tiles are streamed from last to
+// first, so the last tiles streamed start the next panel, and are still cached
+// when it starts. This loads about n_tiles^2 / (2 * (cache_tiles - 2)) tiles,
+// rather than about n_tiles^2 / 2 for a row-by-row walk. Loading the tiles of
+// upcoming pairs ahead, into room of their own, loads no more tiles than this.
+std::vector<TilePair>
+schedule_tile_pairs             (size_t                 n_tiles,
+                                 size_t                 cache_tiles);
+
+// The number of tile loads an LRU cache of `cache_tiles` tiles makes when
+// computing `schedule` in order.
+size_t
+count_tile_loads                (const std::vector<TilePair> &schedule,
+                                 size_t                 cache_tiles);
+
+} // end namespace kwip
+
+#endif /* SCHEDULER_HH */
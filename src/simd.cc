@@ -0,0 +1,490 @@
+/*
+ * Copyright 2015 Kevin Murray <spam@kdmurray.id.au>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "simd.hh"
+
+#include <algorithm>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    #define KWIP_SIMD_X86 1
+    #include <immintrin.h>
+#endif
+
+namespace kwip
+{
+namespace simd
+{
+
+uint64_t
+dot_u8_scalar(const uint8_t *a, const uint8_t *b, size_t n)
+{
+    uint64_t sum = 0;
+    for (size_t i = 0; i < n; i++) {
+        sum += (uint32_t)a[i] * (uint32_t)b[i];
+    }
+    return sum;
+}
+
+// Weighted products are summed in 16 double lanes, lane l taking the elements
+// i = l (mod 16) of the whole groups of 16, then the lanes are added in order
+// and the remaining elements after them. Each a * b * w is exact in double,
+// so the vector paths, which keep the same lanes, give identical sums.
+static const size_t f32_lanes = 16;
+
+static double
+finish_f32_lanes(const double *lanes, const uint8_t *a, const uint8_t *b,
+                 const float *w, size_t n_vec, size_t n)
+{
+    double sum = 0.0;
+    for (size_t l = 0; l < f32_lanes; l++) {
+        sum += lanes[l];
+    }
+    for (size_t i = n_vec; i < n; i++) {
+        sum += (double)((uint32_t)a[i] * (uint32_t)b[i]) * w[i];
+    }
+    return sum;
+}
+
+double
+dot_u8_f32_scalar(const uint8_t *a, const uint8_t *b, const float *w, size_t n)
+{
+    const size_t n_vec = n - n % f32_lanes;
+    double lanes[f32_lanes] = {0.0};
+    for (size_t i = 0; i < n_vec; i += f32_lanes) {
+        for (size_t l = 0; l < f32_lanes; l++) {
+            lanes[l] += (double)((uint32_t)a[i + l] * (uint32_t)b[i + l]) *
+                        w[i + l];
+        }
+    }
+    return finish_f32_lanes(lanes, a, b, w, n_vec, n);
+}
+
+uint64_t
+add_presence_u16_scalar(uint16_t *acc, const uint8_t *a, size_t n)
+{
+    uint64_t sum = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (a[i] > 0 && acc[i] < UINT16_MAX) {
+            acc[i]++;
+        }
+        sum += a[i];
+    }
+    return sum;
+}
+
+#ifdef KWIP_SIMD_X86
+
+// The byte products are widened to 16 bits and summed pairwise into 32 bit
+// lanes with (V)PMADDWD. VPMADDUBSW and VPDPBUSD treat one operand as signed,
+// so they can't be used for counts above 127. Each lane gains at most
+// 4 * 255 * 255 per iteration, so lanes are flushed to a 64 bit total every
+// `flush_iters` iterations, well before they could overflow.
+static const size_t flush_iters = 8192;
+
+__attribute__((target("avx2")))
+static uint64_t
+dot_u8_avx2(const uint8_t *a, const uint8_t *b, size_t n)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const size_t n_vec = n - n % 32;
+    uint64_t sum = 0;
+    size_t i = 0;
+
+    while (i < n_vec) {
+        const size_t flush_at = std::min(n_vec, i + 32 * flush_iters);
+        __m256i acc = zero;
+        for (; i < flush_at; i += 32) {
+            __m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+            __m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
+            __m256i lo = _mm256_madd_epi16(_mm256_unpacklo_epi8(va, zero),
+                                           _mm256_unpacklo_epi8(vb, zero));
+            __m256i hi = _mm256_madd_epi16(_mm256_unpackhi_epi8(va, zero),
+                                           _mm256_unpackhi_epi8(vb, zero));
+            acc = _mm256_add_epi32(acc, _mm256_add_epi32(lo, hi));
+        }
+        uint32_t lanes[8];
+        _mm256_storeu_si256((__m256i *)lanes, acc);
+        for (size_t l = 0; l < 8; l++) {
+            sum += lanes[l];
+        }
+    }
+    return sum + dot_u8_scalar(a + n_vec, b + n_vec, n - n_vec);
+}
+
+__attribute__((target("avx2,fma")))
+static double
+dot_u8_f32_avx2(const uint8_t *a, const uint8_t *b, const float *w, size_t n)
+{
+    const size_t n_vec = n - n % f32_lanes;
+    __m256d acc[4];
+    for (size_t v = 0; v < 4; v++) {
+        acc[v] = _mm256_setzero_pd();
+    }
+
+    for (size_t i = 0; i < n_vec; i += f32_lanes) {
+        for (size_t h = 0; h < 2; h++) {
+            const size_t at = i + 8 * h;
+            __m256i va = _mm256_cvtepu8_epi32(
+                    _mm_loadl_epi64((const __m128i *)(a + at)));
+            __m256i vb = _mm256_cvtepu8_epi32(
+                    _mm_loadl_epi64((const __m128i *)(b + at)));
+            __m256i ab = _mm256_mullo_epi32(va, vb);
+            // Widen the exact count products and the weights to double, and
+            // FMA. The products are exact, so this rounds as mul then add.
+            __m256d ab_lo = _mm256_cvtepi32_pd(_mm256_castsi256_si128(ab));
+            __m256d ab_hi = _mm256_cvtepi32_pd(
+                    _mm256_extracti128_si256(ab, 1));
+            __m256d w_lo = _mm256_cvtps_pd(_mm_loadu_ps(w + at));
+            __m256d w_hi = _mm256_cvtps_pd(_mm_loadu_ps(w + at + 4));
+            acc[2 * h] = _mm256_fmadd_pd(ab_lo, w_lo, acc[2 * h]);
+            acc[2 * h + 1] = _mm256_fmadd_pd(ab_hi, w_hi, acc[2 * h + 1]);
+        }
+    }
+    double lanes[f32_lanes];
+    for (size_t v = 0; v < 4; v++) {
+        _mm256_storeu_pd(lanes + 4 * v, acc[v]);
+    }
+    return finish_f32_lanes(lanes, a, b, w, n_vec, n);
+}
+
+// GCC 12 falsely warns that avx512fintrin.h's casts and reductions may read
+// uninitialised vectors, in the AVX-512 paths from here to the pop below
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+__attribute__((target("avx512f,avx512bw")))
+static uint64_t
+dot_u8_avx512(const uint8_t *a, const uint8_t *b, size_t n)
+{
+    const __m512i zero = _mm512_setzero_si512();
+    const size_t n_vec = n - n % 64;
+    uint64_t sum = 0;
+    size_t i = 0;
+
+    while (i < n_vec) {
+        const size_t flush_at = std::min(n_vec, i + 64 * flush_iters);
+        __m512i acc = zero;
+        for (; i < flush_at; i += 64) {
+            __m512i va = _mm512_loadu_si512((const void *)(a + i));
+            __m512i vb = _mm512_loadu_si512((const void *)(b + i));
+            __m512i lo = _mm512_madd_epi16(_mm512_unpacklo_epi8(va, zero),
+                                           _mm512_unpacklo_epi8(vb, zero));
+            __m512i hi = _mm512_madd_epi16(_mm512_unpackhi_epi8(va, zero),
+                                           _mm512_unpackhi_epi8(vb, zero));
+            acc = _mm512_add_epi32(acc, _mm512_add_epi32(lo, hi));
+        }
+        uint32_t lanes[16];
+        _mm512_storeu_si512((void *)lanes, acc);
+        for (size_t l = 0; l < 16; l++) {
+            sum += lanes[l];
+        }
+    }
+    return sum + dot_u8_scalar(a + n_vec, b + n_vec, n - n_vec);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static double
+dot_u8_f32_avx512(const uint8_t *a, const uint8_t *b, const float *w, size_t n)
+{
+    const size_t n_vec = n - n % f32_lanes;
+    __m512d acc_lo = _mm512_setzero_pd();
+    __m512d acc_hi = _mm512_setzero_pd();
+
+    for (size_t i = 0; i < n_vec; i += f32_lanes) {
+        __m512i va = _mm512_cvtepu8_epi32(
+                _mm_loadu_si128((const __m128i *)(a + i)));
+        __m512i vb = _mm512_cvtepu8_epi32(
+                _mm_loadu_si128((const __m128i *)(b + i)));
+        __m512i ab = _mm512_mullo_epi32(va, vb);
+        __m512d ab_lo = _mm512_cvtepi32_pd(_mm512_castsi512_si256(ab));
+        __m512d ab_hi = _mm512_cvtepi32_pd(_mm512_extracti64x4_epi64(ab, 1));
+        __m512d w_lo = _mm512_cvtps_pd(_mm256_loadu_ps(w + i));
+        __m512d w_hi = _mm512_cvtps_pd(_mm256_loadu_ps(w + i + 8));
+        acc_lo = _mm512_fmadd_pd(ab_lo, w_lo, acc_lo);
+        acc_hi = _mm512_fmadd_pd(ab_hi, w_hi, acc_hi);
+    }
+    double lanes[f32_lanes];
+    _mm512_storeu_pd(lanes, acc_lo);
+    _mm512_storeu_pd(lanes + 8, acc_hi);
+    return finish_f32_lanes(lanes, a, b, w, n_vec, n);
+}
+
+// Integer weighted products. a * b * w is at most 255 * 255 * 65535, which
+// fits in 32 bits, so the products are formed in 32 bit lanes and widened to
+// 64 bits to accumulate.
+
+__attribute__((target("avx2")))
+static inline __m256i
+load_weights_avx2(const uint8_t *w)
+{
+    return _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)w));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i
+load_weights_avx2(const uint16_t *w)
+{
+    return _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)w));
+}
+
+template<typename weight_tp>
+__attribute__((target("avx2")))
+static uint64_t
+dot_u8_intw_avx2(const uint8_t *a, const uint8_t *b, const weight_tp *w,
+                 size_t n)
+{
+    const size_t n_vec = n - n % 8;
+    __m256i acc = _mm256_setzero_si256();
+
+    for (size_t i = 0; i < n_vec; i += 8) {
+        __m256i va = _mm256_cvtepu8_epi32(
+                _mm_loadl_epi64((const __m128i *)(a + i)));
+        __m256i vb = _mm256_cvtepu8_epi32(
+                _mm_loadl_epi64((const __m128i *)(b + i)));
+        __m256i abw = _mm256_mullo_epi32(_mm256_mullo_epi32(va, vb),
+                                         load_weights_avx2(w + i));
+        acc = _mm256_add_epi64(acc, _mm256_cvtepu32_epi64(
+                    _mm256_castsi256_si128(abw)));
+        acc = _mm256_add_epi64(acc, _mm256_cvtepu32_epi64(
+                    _mm256_extracti128_si256(abw, 1)));
+    }
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i *)lanes, acc);
+    uint64_t sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    return sum + dot_u8_intw_scalar(a + n_vec, b + n_vec, w + n_vec,
+                                    n - n_vec);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static inline __m512i
+load_weights_avx512(const uint8_t *w)
+{
+    return _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i *)w));
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static inline __m512i
+load_weights_avx512(const uint16_t *w)
+{
+    return _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i *)w));
+}
+
+template<typename weight_tp>
+__attribute__((target("avx512f,avx512bw")))
+static uint64_t
+dot_u8_intw_avx512(const uint8_t *a, const uint8_t *b, const weight_tp *w,
+                   size_t n)
+{
+    const size_t n_vec = n - n % 16;
+    __m512i acc = _mm512_setzero_si512();
+
+    for (size_t i = 0; i < n_vec; i += 16) {
+        __m512i va = _mm512_cvtepu8_epi32(
+                _mm_loadu_si128((const __m128i *)(a + i)));
+        __m512i vb = _mm512_cvtepu8_epi32(
+                _mm_loadu_si128((const __m128i *)(b + i)));
+        __m512i abw = _mm512_mullo_epi32(_mm512_mullo_epi32(va, vb),
+                                         load_weights_avx512(w + i));
+        acc = _mm512_add_epi64(acc, _mm512_cvtepu32_epi64(
+                    _mm512_castsi512_si256(abw)));
+        acc = _mm512_add_epi64(acc, _mm512_cvtepu32_epi64(
+                    _mm512_extracti64x4_epi64(abw, 1)));
+    }
+    uint64_t sum = _mm512_reduce_add_epi64(acc);
+    return sum + dot_u8_intw_scalar(a + n_vec, b + n_vec, w + n_vec,
+                                    n - n_vec);
+}
+
+// Bytes are widened to 16 bits and clamped to 1 for presence, which is added
+// with saturation. Byte sums come from (V)PSADBW against zero.
+__attribute__((target("avx2")))
+static uint64_t
+add_presence_u16_avx2(uint16_t *acc, const uint8_t *a, size_t n)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi16(1);
+    const size_t n_vec = n - n % 32;
+    __m256i sums = zero;
+
+    for (size_t i = 0; i < n_vec; i += 32) {
+        __m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+        sums = _mm256_add_epi64(sums, _mm256_sad_epu8(va, zero));
+        __m256i lo = _mm256_min_epu16(
+                _mm256_cvtepu8_epi16(_mm256_castsi256_si128(va)), one);
+        __m256i hi = _mm256_min_epu16(
+                _mm256_cvtepu8_epi16(_mm256_extracti128_si256(va, 1)), one);
+        __m256i *acc_lo = (__m256i *)(acc + i);
+        __m256i *acc_hi = (__m256i *)(acc + i + 16);
+        _mm256_storeu_si256(acc_lo, _mm256_adds_epu16(
+                _mm256_loadu_si256(acc_lo), lo));
+        _mm256_storeu_si256(acc_hi, _mm256_adds_epu16(
+                _mm256_loadu_si256(acc_hi), hi));
+    }
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i *)lanes, sums);
+    uint64_t sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    return sum + add_presence_u16_scalar(acc + n_vec, a + n_vec, n - n_vec);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static uint64_t
+add_presence_u16_avx512(uint16_t *acc, const uint8_t *a, size_t n)
+{
+    const __m512i zero = _mm512_setzero_si512();
+    const __m512i one = _mm512_set1_epi16(1);
+    const size_t n_vec = n - n % 64;
+    __m512i sums = zero;
+
+    for (size_t i = 0; i < n_vec; i += 64) {
+        __m512i va = _mm512_loadu_si512((const void *)(a + i));
+        sums = _mm512_add_epi64(sums, _mm512_sad_epu8(va, zero));
+        __m512i lo = _mm512_min_epu16(
+                _mm512_cvtepu8_epi16(_mm512_castsi512_si256(va)), one);
+        __m512i hi = _mm512_min_epu16(
+                _mm512_cvtepu8_epi16(_mm512_extracti64x4_epi64(va, 1)), one);
+        _mm512_storeu_si512((void *)(acc + i), _mm512_adds_epu16(
+                _mm512_loadu_si512((const void *)(acc + i)), lo));
+        _mm512_storeu_si512((void *)(acc + i + 32), _mm512_adds_epu16(
+                _mm512_loadu_si512((const void *)(acc + i + 32)), hi));
+    }
+    uint64_t sum = _mm512_reduce_add_epi64(sums);
+    return sum + add_presence_u16_scalar(acc + n_vec, a + n_vec, n - n_vec);
+}
+
+#pragma GCC diagnostic pop
+
+#endif /* KWIP_SIMD_X86 */
+
+Level
+detected_level()
+{
+#ifdef KWIP_SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") &&
+            __builtin_cpu_supports("avx512bw")) {
+        return AVX512;
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        return AVX2;
+    }
+#endif
+    return SCALAR;
+}
+
+static Level current_level = detected_level();
+
+Level
+level()
+{
+    return current_level;
+}
+
+void
+set_level(Level lvl)
+{
+    current_level = std::min(lvl, detected_level());
+}
+
+std::string
+level_name(Level lvl)
+{
+    switch (lvl) {
+        case AVX512:
+            return "AVX-512";
+        case AVX2:
+            return "AVX2";
+        default:
+            return "scalar";
+    }
+}
+
+uint64_t
+dot_u8(const uint8_t *a, const uint8_t *b, size_t n)
+{
+    switch (current_level) {
+#ifdef KWIP_SIMD_X86
+        case AVX512:
+            return dot_u8_avx512(a, b, n);
+        case AVX2:
+            return dot_u8_avx2(a, b, n);
+#endif
+        default:
+            return dot_u8_scalar(a, b, n);
+    }
+}
+
+double
+dot_u8_f32(const uint8_t *a, const uint8_t *b, const float *w, size_t n)
+{
+    switch (current_level) {
+#ifdef KWIP_SIMD_X86
+        case AVX512:
+            return dot_u8_f32_avx512(a, b, w, n);
+        case AVX2:
+            return dot_u8_f32_avx2(a, b, w, n);
+#endif
+        default:
+            return dot_u8_f32_scalar(a, b, w, n);
+    }
+}
+
+uint64_t
+dot_u8_u8w(const uint8_t *a, const uint8_t *b, const uint8_t *w, size_t n)
+{
+    switch (current_level) {
+#ifdef KWIP_SIMD_X86
+        case AVX512:
+            return dot_u8_intw_avx512(a, b, w, n);
+        case AVX2:
+            return dot_u8_intw_avx2(a, b, w, n);
+#endif
+        default:
+            return dot_u8_intw_scalar(a, b, w, n);
+    }
+}
+
+uint64_t
+dot_u8_u16w(const uint8_t *a, const uint8_t *b, const uint16_t *w, size_t n)
+{
+    switch (current_level) {
+#ifdef KWIP_SIMD_X86
+        case AVX512:
+            return dot_u8_intw_avx512(a, b, w, n);
+        case AVX2:
+            return dot_u8_intw_avx2(a, b, w, n);
+#endif
+        default:
+            return dot_u8_intw_scalar(a, b, w, n);
+    }
+}
+
+uint64_t
+add_presence_u16(uint16_t *acc, const uint8_t *a, size_t n)
+{
+    switch (current_level) {
+#ifdef KWIP_SIMD_X86
+        case AVX512:
+            return add_presence_u16_avx512(acc, a, n);
+        case AVX2:
+            return add_presence_u16_avx2(acc, a, n);
+#endif
+        default:
+            return add_presence_u16_scalar(acc, a, n);
+    }
+}
+
+}} // end namespace kwip::simd
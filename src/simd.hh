@@ -0,0 +1,120 @@
+/*
+ * Copyright 2015 Kevin Murray <spam@kdmurray.id.au>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SIMD_HH
+#define SIMD_HH
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace kwip
+{
+namespace simd
+{
+
+// Instruction set levels, in increasing order of capability.
+enum Level {
+    SCALAR = 0,
+    AVX2,
+    AVX512,
+};
+
+// Best level supported by the running CPU
+Level
+detected_level             ();
+
+// Level currently used by the dispatched functions below
+Level
+level                      ();
+
+// Use `lvl` for the dispatched functions below, capped at the detected level.
+// Not thread safe: call before any kernel calculation.
+void
+set_level                  (Level                   lvl);
+
+std::string
+level_name                 (Level                   lvl);
+
+// sum(a[i] * b[i]) for i in [0, n). Exact.
+uint64_t
+dot_u8                     (const uint8_t          *a,
+                            const uint8_t          *b,
+                            size_t                  n);
+
+// sum(a[i] * b[i] * w[i]) for i in [0, n), accumulated in double. The sum is
+// identical at every level.
+double
+dot_u8_f32                 (const uint8_t          *a,
+                            const uint8_t          *b,
+                            const float            *w,
+                            size_t                  n);
+
+// sum(a[i] * b[i] * w[i]) for i in [0, n), with integer weights. Exact.
+uint64_t
+dot_u8_u8w                 (const uint8_t          *a,
+                            const uint8_t          *b,
+                            const uint8_t          *w,
+                            size_t                  n);
+
+uint64_t
+dot_u8_u16w                (const uint8_t          *a,
+                            const uint8_t          *b,
+                            const uint16_t         *w,
+                            size_t                  n);
+
+// acc[i] += (a[i] > 0) for i in [0, n), returning sum(a[i]). Adds a sample to
+// the population presence counts. Counts saturate at 65535.
+uint64_t
+add_presence_u16           (uint16_t               *acc,
+                            const uint8_t          *a,
+                            size_t                  n);
+
+// Scalar implementations of the above, for reference and fallback.
+uint64_t
+dot_u8_scalar              (const uint8_t          *a,
+                            const uint8_t          *b,
+                            size_t                  n);
+
+double
+dot_u8_f32_scalar          (const uint8_t          *a,
+                            const uint8_t          *b,
+                            const float            *w,
+                            size_t                  n);
+
+uint64_t
+add_presence_u16_scalar    (uint16_t               *acc,
+                            const uint8_t          *a,
+                            size_t                  n);
+
+template<typename weight_tp>
+uint64_t
+dot_u8_intw_scalar         (const uint8_t          *a,
+                            const uint8_t          *b,
+                            const weight_tp        *w,
+                            size_t                  n)
+{
+    uint64_t sum = 0;
+    for (size_t i = 0; i < n; i++) {
+        sum += (uint64_t)((uint32_t)a[i] * (uint32_t)b[i]) * w[i];
+    }
+    return sum;
+}
+
+}} // end namespace kwip::simd
+
+#endif /* SIMD_HH */
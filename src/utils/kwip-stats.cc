@@ -31,16 +31,7 @@ EntVecIPSummer::
 calculate_pairwise(std::vector<std::string> &hash_fnames)
 {
     num_samples = hash_fnames.size();
-    #pragma omp parallel for num_threads(_num_threads)
-    for (size_t i = 0; i < num_samples; i++) {
-        add_hashtable(hash_fnames[i]);
-        if (verbosity > 0) {
-            #pragma omp critical
-            {
-                *outstream << "Loaded " << hash_fnames[i] << std::endl;
-            }
-        }
-    }
+    add_hashtables(hash_fnames);
 
     if (verbosity > 0) {
         *outstream << "Finished loading!" << std::endl;
@@ -49,20 +40,21 @@ calculate_pairwise(std::vector<std::string> &hash_fnames)
 
     _bin_entropies.clear();
     for (size_t tab = 0; tab < _n_tables; tab++) {
-        _bin_entropies.emplace_back(_tablesizes[tab], 0.0);
+        std::vector<float> tab_entropies(_tablesizes[tab], 0.0);
         for (size_t bin = 0; bin < _tablesizes[tab]; bin++) {
-            unsigned int bin_n_samples = _pop_counts[tab][bin];
+            unsigned int bin_n_samples = _pop_counts[tab].get(bin);
             if (bin_n_samples == 0 || bin_n_samples == num_samples) {
                 // Kmer not found in the population, or in all samples.
                 // entropy will be 0, so bail out here
-                _bin_entropies[tab][bin] = 0.0;
+                tab_entropies[bin] = 0.0;
             } else {
                 const float pop_freq = (float)bin_n_samples / (float)num_samples;
                 const float entropy = (pop_freq * -log2(pop_freq)) +
                                       ((1 - pop_freq) * -log2(1 - pop_freq));
-                _bin_entropies[tab][bin] = sqrt(entropy);
+                tab_entropies[bin] = sqrt(entropy);
             }
         }
+        _bin_entropies.emplace_back(std::move(tab_entropies));
     }
 
     if (sample_names.empty()) {
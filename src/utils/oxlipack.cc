@@ -0,0 +1,108 @@
+#include "countgraph.hh"
+#include "kwip-utils.hh"
+#include "sample.hh"
+#include <cstdio>
+#include <iostream>
+#include <getopt.h>
+
+void
+usage(FILE *stream)
+{
+    fprintf(stream, "oxlipack -- convert oxli countgraphs for faster loading by kwip\n");
+    fprintf(stream, "\n");
+    fprintf(stream, "USAGE:\n");
+    fprintf(stream, "    oxlipack [-s] [-t THREADS] [-c CHUNK] [-l LEVEL] COUNTFILE ...\n");
+    fprintf(stream, "\n");
+    fprintf(stream, "Each COUNTFILE (.ct or .ct.gz) is saved as COUNTFILE.blk, less any\n");
+    fprintf(stream, ".gz suffix. Block-compressed countgraphs inflate in parallel.\n");
+    fprintf(stream, "With -s, each is instead saved as a kWIP sketch, COUNTFILE.ks, which\n");
+    fprintf(stream, "holds only occupied bins and is used by kwip without decompression.\n");
+    fprintf(stream, "\n");
+    fprintf(stream, "OPTIONS:\n");
+    fprintf(stream, "    -s          Save kWIP sketches.\n");
+    fprintf(stream, "    -t THREADS  Threads to compress with. [default N_CPUS]\n");
+    fprintf(stream, "    -c CHUNK    Chunk size, e.g. 4M. [default 4M]\n");
+    fprintf(stream, "    -l LEVEL    zlib compression level, 1 to 9. [default 6]\n");
+}
+
+int
+pack_file(const std::string &filename, bool sketch, size_t chunk_size,
+          int level, int n_threads)
+{
+    std::string outfile = filename;
+    if (outfile.size() > 3 && outfile.substr(outfile.size() - 3) == ".gz") {
+        outfile.erase(outfile.size() - 3);
+    }
+    outfile += sketch ? ".ks" : ".blk";
+
+    std::cerr << "Packing " << filename << " to " << outfile << "\n";
+    try {
+        kwip::CountingHashShrPtr ht = kwip::load_countgraph(filename);
+        if (sketch) {
+            kwip::Sample(ht).save_sketch(outfile);
+        } else {
+            kwip::save_block_countgraph(*ht, outfile, chunk_size, level,
+                                        n_threads);
+        }
+    } catch (std::exception &err) {
+        std::cerr << "ERROR: " << err.what() << "\n";
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+int
+main(int argc, char *argv[])
+{
+    size_t chunk_size = kwip::BLOCK_COUNTGRAPH_CHUNK;
+    int level = 6;
+    int n_threads = 0;
+    bool sketch = false;
+
+    int c;
+    while ((c = getopt(argc, argv, "st:c:l:")) > 0) {
+        switch (c) {
+            case 's':
+                sketch = true;
+                break;
+            case 't':
+                n_threads = atoi(optarg);
+                break;
+            case 'c':
+                try {
+                    chunk_size = kwip::parse_size(optarg);
+                } catch (std::invalid_argument &err) {
+                    std::cerr << "ERROR: " << err.what() << "\n";
+                    return EXIT_FAILURE;
+                }
+                if (chunk_size < 1) {
+                    std::cerr << "ERROR: chunk size must be positive.\n";
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'l':
+                level = atoi(optarg);
+                if (level < 1 || level > 9) {
+                    std::cerr << "ERROR: level must be between 1 and 9 inclusive.\n";
+                    return EXIT_FAILURE;
+                }
+                break;
+            case '?':
+                usage(stderr);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (optind > argc - 1) {
+        usage(stdout);
+        return EXIT_SUCCESS;
+    }
+
+    int ret = EXIT_SUCCESS;
+    for (int i = optind; i < argc; i++) {
+        if (pack_file(argv[i], sketch, chunk_size, level, n_threads) != EXIT_SUCCESS) {
+            ret = EXIT_FAILURE;
+        }
+    }
+    return ret;
+}
@@ -0,0 +1,128 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  test-countgraph.cc
+ *    Description:  Tests of countgraph loading
+ *        License:  GPLv3+
+ *         Author:  Kevin Murray, spam@kdmurray.id.au
+ *
+ * ============================================================================
+ */
+
+#include "catch.hpp"
+#include "helpers.hh"
+
+#include <cstring>
+#include <fstream>
+#include <iterator>
+
+#include "countgraph.hh"
+
+using namespace kwip;
+
+
+static bool
+countgraphs_equal(const khmer::CountingHash &a, const khmer::CountingHash &b)
+{
+    std::vector<khmer::HashIntoType> tablesizes = a.get_tablesizes();
+
+    if (a.ksize() != b.ksize() || a.n_tables() != b.n_tables() ||
+            a.n_occupied() != b.n_occupied() ||
+            tablesizes != b.get_tablesizes()) {
+        return false;
+    }
+    for (size_t tab = 0; tab < a.n_tables(); tab++) {
+        if (memcmp(a.get_raw_tables()[tab], b.get_raw_tables()[tab],
+                   tablesizes[tab]) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+TEST_CASE("Countgraph loading", "[countgraph]") {
+    std::string filename = "data/defined-1.ct";
+    khmer::CountingHash expt(1, 1);
+    khmer::CountingHashFile::load(filename, expt);
+
+    SECTION("Mapped countgraphs match read countgraphs") {
+        REQUIRE(countgraph_is_mappable(filename));
+        CountingHashShrPtr ht = load_countgraph(filename);
+        REQUIRE(dynamic_cast<MappedCountingHash *>(ht.get()) != NULL);
+        CHECK(countgraphs_equal(*ht, expt));
+    }
+
+    SECTION("Mapping can be disabled") {
+        CountingHashShrPtr ht = load_countgraph(filename, false);
+        REQUIRE(dynamic_cast<MappedCountingHash *>(ht.get()) == NULL);
+        CHECK(countgraphs_equal(*ht, expt));
+    }
+
+    SECTION("Gzipped countgraphs are read, not mapped") {
+        std::string gzfile = "out/defined-1.ct.gz";
+        khmer::CountingHashFile::save(gzfile, expt);
+        REQUIRE_FALSE(countgraph_is_mappable(gzfile));
+        CountingHashShrPtr ht = load_countgraph(gzfile);
+        CHECK(countgraphs_equal(*ht, expt));
+        std::remove(gzfile.c_str());
+    }
+
+    SECTION("Missing files throw") {
+        REQUIRE_THROWS(MappedCountingHash("data/nonexistent.ct"));
+    }
+}
+
+
+TEST_CASE("Block-compressed countgraphs", "[countgraph]") {
+    std::string filename = "data/defined-1.ct";
+    std::string blkfile = "out/defined-1.ct.blk";
+    khmer::CountingHash expt(1, 1);
+    khmer::CountingHashFile::load(filename, expt);
+
+    SECTION("Round trip, with tables split over many chunks") {
+        std::vector<size_t> chunk_sizes {7, 64, BLOCK_COUNTGRAPH_CHUNK};
+        for (size_t chunk_size: chunk_sizes) {
+            CAPTURE(chunk_size);
+            save_block_countgraph(expt, blkfile, chunk_size);
+            REQUIRE(countgraph_is_block(blkfile));
+            REQUIRE_FALSE(countgraph_is_mappable(blkfile));
+            CountingHashShrPtr ht = load_countgraph(blkfile);
+            REQUIRE(dynamic_cast<BlockCountingHash *>(ht.get()) != NULL);
+            CHECK(countgraphs_equal(*ht, expt));
+            CountingHashShrPtr threaded = load_countgraph(blkfile, true, 4);
+            CHECK(countgraphs_equal(*threaded, expt));
+        }
+    }
+
+    SECTION("Truncated files throw") {
+        save_block_countgraph(expt, blkfile, 16);
+        std::ifstream in(blkfile, std::ios::binary);
+        std::string data((std::istreambuf_iterator<char>(in)),
+                         std::istreambuf_iterator<char>());
+        std::ofstream out(blkfile, std::ios::binary | std::ios::trunc);
+        out.write(data.data(), data.size() / 2);
+        out.close();
+        REQUIRE_THROWS_AS(load_countgraph(blkfile), std::runtime_error&);
+    }
+
+    SECTION("Corrupt chunks throw, on any number of threads") {
+        save_block_countgraph(expt, blkfile, 64);
+        std::ifstream in(blkfile, std::ios::binary);
+        std::string data((std::istreambuf_iterator<char>(in)),
+                         std::istreambuf_iterator<char>());
+        in.close();
+        // The last table's last chunks, before the bigcounts
+        const size_t bigcounts = 8 + expt._bigcounts.size() *
+                (sizeof(khmer::HashIntoType) +
+                 sizeof(khmer::BoundedCounterType));
+        std::fill(data.end() - bigcounts - 16, data.end() - bigcounts, 0x55);
+        std::ofstream out(blkfile, std::ios::binary | std::ios::trunc);
+        out.write(data.data(), data.size());
+        out.close();
+        REQUIRE_THROWS_AS(load_countgraph(blkfile), std::runtime_error&);
+        REQUIRE_THROWS_AS(load_countgraph(blkfile, true, 4),
+                          std::runtime_error&);
+    }
+    std::remove(blkfile.c_str());
+}
@@ -12,7 +12,10 @@
 #include "catch.hpp"
 #include "helpers.hh"
 
+#include <random>
+
 #include "kernel.hh"
+#include "kernels/ip.hh"
 
 
 TEST_CASE("Test kernel before computation", "[kernel]") {
@@ -94,16 +97,21 @@ TEST_CASE("Test kernel.kernel method", "[kernel]") {
 
 
 TEST_CASE("Test kernel.calculate_pairwise method", "[kernel]") {
-    kwip::Kernel kernel;
     std::ostringstream output;
     std::ostringstream kern;
     std::ostringstream dist;
-    kernel.outstream = &output;
     std::vector<std::string> filenames {
         "data/empty.ct",
         "data/empty.ct",
     };
 
+    // The base class has no partial kernels to compute kernels with
+    kwip::Kernel base;
+    base.outstream = &output;
+    REQUIRE_THROWS_AS(base.calculate_pairwise(filenames), std::logic_error&);
+
+    kwip::metrics::IPKernel kernel;
+    kernel.outstream = &output;
     REQUIRE_NOTHROW(kernel.calculate_pairwise(filenames));
 
     SECTION("Check output") {
@@ -121,3 +129,119 @@ TEST_CASE("Test kernel.calculate_pairwise method", "[kernel]") {
         REQUIRE(kern.str() == kern_matrix);
     }
 }
+
+
+TEST_CASE("Packed kernel matrices", "[kernel]") {
+    kwip::KernelMatrix packed;
+    MatrixXd dense(4, 4), expt, got;
+    std::vector<std::string> labels {"a", "b", "c", "d"};
+
+    REQUIRE(packed.empty());
+    packed.resize(4);
+    REQUIRE(packed.bytes() == 10 * sizeof(float));
+    for (size_t i = 0; i < 4; i++) {
+        for (size_t j = i; j < 4; j++) {
+            packed(i, j) = (i + 1) * 10 + j;
+            dense(i, j) = dense(j, i) = (i + 1) * 10 + j;
+        }
+    }
+    CHECK(packed(3, 1) == packed(1, 3));
+
+    SECTION("Kernels, normalised kernels and distances") {
+        packed.to_dense(got, kwip::KernelMatrix::KERNEL, 2);
+        CHECK(got == dense);
+        kwip::normalise_matrix(expt, dense);
+        packed.to_dense(got, kwip::KernelMatrix::NORMALISED, 2);
+        CHECK(got == expt);
+        kwip::kernel_to_distance(expt, dense);
+        packed.to_dense(got, kwip::KernelMatrix::DISTANCE, 2);
+        CHECK(got == expt);
+    }
+
+    SECTION("Printed rows match the full matrix") {
+        std::ostringstream expt_out, got_out;
+        kwip::kernel_to_distance(expt, dense);
+        kwip::print_lsmat(expt, expt_out, labels);
+        packed.print(got_out, labels, kwip::KernelMatrix::DISTANCE, 2);
+        CHECK(got_out.str() == expt_out.str());
+    }
+
+    SECTION("Parallel text output matches serial") {
+        std::ostringstream serial, parallel;
+        kwip::print_lsmat(dense, serial, labels);
+        kwip::print_lsmat(dense, parallel, labels, 3);
+        CHECK(parallel.str() == serial.str());
+    }
+
+    SECTION("Binary .npy output") {
+        std::ostringstream out;
+        packed.save_npy(out, kwip::KernelMatrix::KERNEL, 2);
+        const std::string npy = out.str();
+        // 128-byte header, then the float32 matrix in C order
+        REQUIRE(npy.size() == 128 + 16 * sizeof(float));
+        CHECK(npy.substr(0, 6) == "\x93NUMPY");
+        CHECK(npy.find("'shape': (4, 4)") != std::string::npos);
+        CHECK(npy[127] == '\n');
+        const float *data = (const float *)(npy.data() + 128);
+        for (size_t i = 0; i < 4; i++) {
+            for (size_t j = 0; j < 4; j++) {
+                CHECK(data[i * 4 + j] == dense(i, j));
+            }
+        }
+    }
+
+    SECTION("Positive semidefiniteness") {
+        // A large off-diagonal kernel makes the matrix indefinite, but a Gram
+        // matrix is semidefinite, even if singular
+        packed(0, 1) = dense(0, 1) = dense(1, 0) = 100;
+        CHECK_FALSE(packed.is_pos_semidef(1e-5, 2));
+        CHECK_FALSE(kwip::matrix_is_pos_semidef(dense));
+        MatrixXd gram = dense.leftCols(2) * dense.leftCols(2).transpose();
+        for (size_t i = 0; i < 4; i++) {
+            for (size_t j = i; j < 4; j++) {
+                packed(i, j) = gram(i, j);
+            }
+        }
+        CHECK(packed.is_pos_semidef(1e-5, 2));
+        CHECK(kwip::matrix_is_pos_semidef(gram));
+    }
+}
+
+
+TEST_CASE("Blocked positive semidefiniteness check", "[kernel]") {
+    // Several tiles, the last of them partial
+    const size_t n = 300;
+    std::mt19937 rng(99);
+    std::uniform_real_distribution<double> value(0.0, 1.0);
+    MatrixXd features(n, 40);
+    for (size_t i = 0; i < n; i++) {
+        for (size_t k = 0; k < 40; k++) {
+            features(i, k) = value(rng);
+        }
+    }
+    // A singular Gram matrix, as kernels of many samples can be
+    MatrixXd gram = features * features.transpose();
+    kwip::KernelMatrix packed;
+    packed.resize(n);
+    auto pack = [&packed, n](const MatrixXd &mat) {
+        for (size_t i = 0; i < n; i++) {
+            for (size_t j = i; j < n; j++) {
+                packed(i, j) = mat(i, j);
+            }
+        }
+    };
+
+    pack(gram);
+    for (int threads: {1, 3}) {
+        CHECK(packed.is_pos_semidef(1e-5, threads));
+    }
+
+    // Any eigenvalue clearly below zero is found, wherever it lies
+    for (size_t at: {(size_t)0, (size_t)150, n - 1}) {
+        CAPTURE(at);
+        MatrixXd indefinite = gram;
+        indefinite(at, at) -= gram(at, at) + 1;
+        pack(indefinite);
+        CHECK_FALSE(packed.is_pos_semidef(1e-5, 3));
+    }
+}
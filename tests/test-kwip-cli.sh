@@ -31,3 +31,131 @@ do
 	test $(filesize $d) -gt 0
 	set +x
 done
+
+# Weights saved with -C and loaded with -w give the same distances
+tst=weights-$RANDOM
+w=$tmpdir/${tst}.weights
+set -x
+$cli -t 1 -C -w $w data/defined-[123].ct 2>/dev/null
+test $(filesize $w) -gt 0
+$cli -t 1 -d $tmpdir/${tst}.calc data/defined-[123].ct 2>/dev/null
+$cli -t 1 -w $w -d $tmpdir/${tst}.load data/defined-[123].ct 2>/dev/null
+cmp $tmpdir/${tst}.calc $tmpdir/${tst}.load
+set +x
+
+# Weights from saved and extended population counts match those calculated
+# in one go
+p=$tmpdir/${tst}.pop
+set -x
+$cli -t 1 -C --save-pop $p data/defined-1.ct 2>/dev/null
+$cli -t 1 -C --load-pop $p -w $tmpdir/${tst}.merged data/defined-[23].ct 2>/dev/null
+cmp $w $tmpdir/${tst}.merged
+set +x
+
+# The PSD check is reported, unless skipped
+tst=psd-$RANDOM
+set -x
+$cli -t 1 -d $tmpdir/${tst}.dist data/defined-[123].ct 2>$tmpdir/${tst}.err
+grep -q 'positive semidefinite' $tmpdir/${tst}.err
+$cli -t 1 --no-psd-check -d $tmpdir/${tst}.nocheck data/defined-[123].ct \
+	2>$tmpdir/${tst}.err
+! grep -q 'semidefinite' $tmpdir/${tst}.err
+cmp $tmpdir/${tst}.dist $tmpdir/${tst}.nocheck
+set +x
+
+# Matrices named .npy are written as float32 arrays, with labels alongside
+tst=npy-$RANDOM
+set -x
+$cli -t 1 -k $tmpdir/${tst}.kern.npy -d $tmpdir/${tst}.dist.npy \
+	data/defined-[123].ct 2>/dev/null
+test $(filesize $tmpdir/${tst}.dist.npy) -eq $((128 + 9 * 4))
+test $(filesize $tmpdir/${tst}.kern.npy) -eq $((128 + 9 * 4))
+test $(wc -l < $tmpdir/${tst}.dist.labels) -eq 3
+set +x
+
+# Shards computed separately merge to the matrices of the whole calculation
+tst=shard-$RANDOM
+set -x
+$cli -t 1 -k $tmpdir/${tst}.kern -d $tmpdir/${tst}.dist data/defined-[123].ct \
+	2>/dev/null
+for i in 1 2 3 4
+do
+	$cli -t 1 --shard $i/4 -k $tmpdir/${tst}-$i.shard data/defined-[123].ct \
+		2>/dev/null
+done
+$cli merge -k $tmpdir/${tst}.mkern -d $tmpdir/${tst}.mdist \
+	$tmpdir/${tst}-[1234].shard 2>/dev/null
+cmp $tmpdir/${tst}.kern $tmpdir/${tst}.mkern
+cmp $tmpdir/${tst}.dist $tmpdir/${tst}.mdist
+! $cli merge $tmpdir/${tst}-[123].shard 2>/dev/null
+set +x
+
+# A run resumed from a partial checkpoint writes the same matrices
+tst=checkpoint-$RANDOM
+set -x
+$cli -t 1 -k $tmpdir/${tst}.kern -d $tmpdir/${tst}.dist \
+	--checkpoint $tmpdir/${tst}.journal data/defined-[123].ct 2>/dev/null
+test -s $tmpdir/${tst}.journal.weights
+head -c 95 $tmpdir/${tst}.journal >$tmpdir/${tst}.partial
+mv $tmpdir/${tst}.journal.weights $tmpdir/${tst}.partial.weights
+$cli -t 1 -k $tmpdir/${tst}.rkern -d $tmpdir/${tst}.rdist \
+	--checkpoint $tmpdir/${tst}.partial --resume data/defined-[123].ct \
+	2>/dev/null
+cmp $tmpdir/${tst}.kern $tmpdir/${tst}.rkern
+cmp $tmpdir/${tst}.dist $tmpdir/${tst}.rdist
+! $cli --resume data/defined-[123].ct 2>/dev/null
+set +x
+
+# Extending a kernel matrix with new samples gives that of all samples
+tst=append-$RANDOM
+set -x
+$cli -t 1 -C -w $tmpdir/${tst}.weights data/defined-[123].ct 2>/dev/null
+$cli -t 1 -w $tmpdir/${tst}.weights -k $tmpdir/${tst}.kern.npy \
+	-d $tmpdir/${tst}.dist data/defined-[123].ct 2>/dev/null
+$cli -t 1 -w $tmpdir/${tst}.weights -k $tmpdir/${tst}-2.kern.npy \
+	data/defined-[12].ct 2>/dev/null
+$cli -t 1 -w $tmpdir/${tst}.weights --append $tmpdir/${tst}-2.kern.npy \
+	-k $tmpdir/${tst}-3.kern.npy -d $tmpdir/${tst}-3.dist \
+	data/defined-[123].ct 2>/dev/null
+cmp $tmpdir/${tst}.kern.npy $tmpdir/${tst}-3.kern.npy
+cmp $tmpdir/${tst}.dist $tmpdir/${tst}-3.dist
+! $cli -t 1 -w $tmpdir/${tst}.weights --append $tmpdir/${tst}-2.kern.npy \
+	data/defined-2.ct data/defined-1.ct data/defined-3.ct 2>/dev/null
+set +x
+
+# Kernels of queries against references are a block of the whole matrix
+tst=refs-$RANDOM
+set -x
+ls data/defined-[23].ct >$tmpdir/${tst}.refs
+$cli -t 1 -C -w $tmpdir/${tst}.weights data/defined-[23].ct 2>/dev/null
+$cli -t 1 -w $tmpdir/${tst}.weights -d $tmpdir/${tst}.dist \
+	data/defined-[123].ct 2>/dev/null
+$cli -t 1 --refs $tmpdir/${tst}.refs -d $tmpdir/${tst}.rdist \
+	data/defined-1.ct 2>/dev/null
+diff <(head -2 $tmpdir/${tst}.dist | cut -f 1,3,4) $tmpdir/${tst}.rdist
+$cli -t 1 --refs $tmpdir/${tst}.refs -k $tmpdir/${tst}.kern.npy \
+	data/defined-1.ct 2>/dev/null
+test "$(cat $tmpdir/${tst}.kern.ref_labels)" = "$(printf 'defined-2\ndefined-3')"
+set +x
+
+# Nearest neighbours are a sparse list, not a matrix
+tst=knn-$RANDOM
+set -x
+$cli -t 1 --knn 1 -d $tmpdir/${tst}.knn data/defined-[123].ct 2>/dev/null
+test $(wc -l <$tmpdir/${tst}.knn) -eq 3
+test $(cut -f 1 $tmpdir/${tst}.knn | sort -u | wc -l) -eq 3
+! $cli --knn 1 -k $tmpdir/${tst}.kern data/defined-[123].ct 2>/dev/null
+set +x
+
+# Kernels estimated from a subset of bins come with standard errors
+tst=approx-$RANDOM
+set -x
+$cli -t 1 --approx 0.5 --stderr $tmpdir/${tst}.stderr -k $tmpdir/${tst}.kern \
+	-d $tmpdir/${tst}.dist data/defined-[123].ct 2>/dev/null
+test $(wc -l <$tmpdir/${tst}.stderr) -eq 4
+head -1 $tmpdir/${tst}.kern | cmp - <(head -1 $tmpdir/${tst}.stderr)
+! $cli --stderr $tmpdir/${tst}.stderr data/defined-[123].ct 2>/dev/null
+! $cli --approx 0.5 --stderr $tmpdir/${tst}.stderr \
+	--append $tmpdir/${tst}.kern data/defined-[1234].ct 2>/dev/null
+! $cli --approx 0 data/defined-[123].ct 2>/dev/null
+set +x
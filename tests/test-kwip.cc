@@ -13,7 +13,17 @@
 using Eigen::Matrix3d;
 using Eigen::MatrixXd;
 
+#include <fstream>
+#include <iterator>
+#include <mutex>
+#include <random>
+#include <thread>
+
+#include <dirent.h>
+#include <unistd.h>
+
 #include "helpers.hh"
+#include "kernels/ip.hh"
 #include "kernels/wip.hh"
 
 #include "catch.hpp"
@@ -58,3 +68,1036 @@ TEST_CASE("Test kwip.kernel method", "[kernel]") {
         CHECK(dmat.isApprox(dmat_expt, 1e-4));
     }
 }
+
+
+TEST_CASE("Test tiled pairwise calculation", "[kernel]") {
+    std::vector<std::string> filenames {
+        "data/defined-1.ct",
+        "data/defined-2.ct",
+        "data/defined-3.ct",
+        "data/defined-4.ct",
+    };
+    std::ostringstream output;
+    MatrixXd expt;
+
+    kwip::metrics::WIPKernel single;
+    single.outstream = &output;
+    single.set_tile_size(1);
+    single.calculate_pairwise(filenames);
+    single.get_kernel_matrix(expt);
+
+    for (size_t tile_size: {2, 3, 4, 10}) {
+        kwip::metrics::WIPKernel kernel;
+        MatrixXd kmat;
+
+        kernel.outstream = &output;
+        kernel.set_tile_size(tile_size);
+        kernel.calculate_pairwise(filenames);
+        kernel.get_kernel_matrix(kmat);
+
+        CAPTURE(tile_size);
+        CHECK(kmat.isApprox(expt, 1e-6));
+    }
+
+    // Without, and with deep, background prefetching
+    for (size_t io_threads: {0, 4}) {
+        kwip::metrics::WIPKernel kernel;
+        MatrixXd kmat;
+
+        kernel.outstream = &output;
+        kernel.set_tile_size(1);
+        kernel.set_io_threads(io_threads);
+        kernel.set_prefetch_depth(3);
+        kernel.calculate_pairwise(filenames);
+        kernel.get_kernel_matrix(kmat);
+
+        CAPTURE(io_threads);
+        CHECK(kmat.isApprox(expt, 1e-6));
+    }
+}
+
+
+// The number of this process's scratch copies of samples in `dir`
+static size_t
+count_scratch_copies(const std::string &dir)
+{
+    const std::string prefix = "kwip-" + std::to_string(getpid()) + "-";
+    size_t n = 0;
+    DIR *dirp = opendir(dir.c_str());
+    if (dirp == NULL) {
+        return 0;
+    }
+    for (struct dirent *entry; (entry = readdir(dirp)) != NULL;) {
+        n += std::string(entry->d_name).compare(0, prefix.size(), prefix) == 0;
+    }
+    closedir(dirp);
+    return n;
+}
+
+// Records the most scratch copies present while kernels are calculated
+class ScratchProbe : public kwip::metrics::WIPKernel
+{
+public:
+    size_t scratch_copies_seen = 0;
+
+protected:
+    void
+    _see_scratch_copies()
+    {
+        std::lock_guard<std::mutex> lock(_probe_mutex);
+        scratch_copies_seen = std::max(scratch_copies_seen,
+                                       count_scratch_copies(_scratch_dir));
+    }
+
+    double
+    _table_kernel(const khmer::Byte *A, const khmer::Byte *B, size_t tab,
+                  size_t start, size_t end)
+    {
+        _see_scratch_copies();
+        return WIPKernel::_table_kernel(A, B, tab, start, end);
+    }
+
+    double
+    _table_kernel_sparse_dense(const kwip::SparseTable &A,
+                               const khmer::Byte *B, size_t tab, size_t start,
+                               size_t end)
+    {
+        _see_scratch_copies();
+        return WIPKernel::_table_kernel_sparse_dense(A, B, tab, start, end);
+    }
+
+    double
+    _table_kernel_sparse(const kwip::SparseTable &A,
+                         const kwip::SparseTable &B, size_t tab, size_t start,
+                         size_t end)
+    {
+        _see_scratch_copies();
+        return WIPKernel::_table_kernel_sparse(A, B, tab, start, end);
+    }
+
+    std::mutex _probe_mutex;
+};
+
+TEST_CASE("Test population and pairwise passes share loads", "[kernel]") {
+    std::vector<std::string> filenames {
+        "data/defined-1.ct",
+        "data/defined-2.ct",
+        "data/defined-3.ct",
+        "data/defined-4.ct",
+    };
+    std::ostringstream output;
+    MatrixXd expt;
+
+    // The cache holds every sample, so each is loaded only once
+    kwip::metrics::WIPKernel resident;
+    resident.outstream = &output;
+    resident.set_num_threads(4);
+    resident.calculate_pairwise(filenames);
+    resident.get_kernel_matrix(expt);
+    CHECK(resident.cache_stats().misses == filenames.size());
+
+    // The cache holds 3 samples, so the pairwise pass reads scratch copies
+    ScratchProbe scratch;
+    MatrixXd kmat;
+    scratch.outstream = &output;
+    scratch.set_num_threads(1);
+    scratch.set_tile_size(1);
+    scratch.set_io_threads(0);
+    scratch.set_scratch_dir("out");
+    scratch.calculate_pairwise(filenames);
+    scratch.get_kernel_matrix(kmat);
+    CHECK(kmat.isApprox(expt, 1e-6));
+    // Every sample has a copy while kernels are calculated, the pairwise
+    // pass reloads samples from them, and they are gone afterwards
+    CHECK(scratch.scratch_copies_seen == filenames.size());
+    CHECK(scratch.cache_stats().misses > filenames.size());
+    CHECK(count_scratch_copies("out") == 0);
+}
+
+
+TEST_CASE("Test kernels over occupied-bin indexes", "[kernel]") {
+    std::vector<std::string> filenames {
+        "data/defined-1.ct",
+        "data/defined-2.ct",
+        "data/defined-3.ct",
+        "data/defined-4.ct",
+    };
+    std::ostringstream output;
+
+    // Index every sample, or none
+    SECTION("WIP") {
+        MatrixXd expt, kmat;
+        kwip::metrics::WIPKernel dense_kern, indexed_kern;
+        dense_kern.outstream = &output;
+        indexed_kern.outstream = &output;
+        dense_kern.set_sparse_below(0);
+        indexed_kern.set_sparse_below(1.1);
+        dense_kern.calculate_pairwise(filenames);
+        dense_kern.get_kernel_matrix(expt);
+        indexed_kern.calculate_pairwise(filenames);
+        indexed_kern.get_kernel_matrix(kmat);
+        CHECK(kmat.isApprox(expt, 1e-6));
+    }
+
+    SECTION("IP") {
+        MatrixXd expt, kmat;
+        kwip::metrics::IPKernel dense_kern, indexed_kern;
+        dense_kern.outstream = &output;
+        indexed_kern.outstream = &output;
+        dense_kern.set_sparse_below(0);
+        indexed_kern.set_sparse_below(1.1);
+        dense_kern.calculate_pairwise(filenames);
+        dense_kern.get_kernel_matrix(expt);
+        indexed_kern.calculate_pairwise(filenames);
+        indexed_kern.get_kernel_matrix(kmat);
+        CHECK(kmat == expt);
+    }
+}
+
+
+TEST_CASE("Test kernels on sketches", "[kernel]") {
+    std::vector<std::string> filenames {
+        "data/defined-1.ct",
+        "data/defined-2.ct",
+        "data/defined-3.ct",
+        "data/defined-4.ct",
+    };
+    std::vector<std::string> sketches;
+    for (const auto &filename: filenames) {
+        std::string sketch = "out/" + filename.substr(5) + ".ks";
+        kwip::load_sample(filename)->save_sketch(sketch);
+        sketches.push_back(sketch);
+    }
+    // Mix sketches and countgraphs, for sparse-dense pairs
+    std::vector<std::string> mixed {
+        sketches[0], filenames[1], sketches[2], filenames[3],
+    };
+    std::ostringstream output;
+
+    SECTION("WIP") {
+        for (int bits: {8, 32}) {
+            MatrixXd expt, sparse, mix;
+            kwip::metrics::WIPKernel dense_kern, sparse_kern, mixed_kern;
+            for (auto kern: {&dense_kern, &sparse_kern, &mixed_kern}) {
+                kern->outstream = &output;
+                kern->set_weight_bits(bits);
+            }
+            dense_kern.calculate_pairwise(filenames);
+            dense_kern.get_kernel_matrix(expt);
+            sparse_kern.calculate_pairwise(sketches);
+            sparse_kern.get_kernel_matrix(sparse);
+            mixed_kern.calculate_pairwise(mixed);
+            mixed_kern.get_kernel_matrix(mix);
+
+            CAPTURE(bits);
+            CHECK(sparse.isApprox(expt, 1e-6));
+            CHECK(mix.isApprox(expt, 1e-6));
+        }
+    }
+
+    SECTION("IP") {
+        MatrixXd expt, sparse;
+        kwip::metrics::IPKernel dense_kern, sparse_kern;
+        dense_kern.outstream = &output;
+        sparse_kern.outstream = &output;
+        dense_kern.calculate_pairwise(filenames);
+        dense_kern.get_kernel_matrix(expt);
+        sparse_kern.calculate_pairwise(mixed);
+        sparse_kern.get_kernel_matrix(sparse);
+        CHECK(sparse == expt);
+    }
+
+    for (const auto &sketch: sketches) {
+        std::remove(sketch.c_str());
+    }
+}
+
+
+TEST_CASE("Test binary bin weight files", "[kernel]") {
+    std::vector<std::string> filenames {
+        "data/defined-1.ct",
+        "data/defined-2.ct",
+        "data/defined-3.ct",
+        "data/defined-4.ct",
+    };
+    std::string weightfile = "out/defined.weights";
+    std::ostringstream output;
+
+    for (int bits: {8, 32}) {
+        MatrixXd expt;
+        kwip::metrics::WIPKernel calc;
+        calc.outstream = &output;
+        calc.set_weight_bits(bits);
+        calc.calculate_pairwise(filenames);
+        calc.get_kernel_matrix(expt);
+        calc.save_weights(weightfile);
+
+        // Loaded weights, mapped or read, at the same and another width
+        for (bool use_mmap: {true, false}) {
+            for (int load_bits: {8, 16, 32}) {
+                MatrixXd kmat;
+                kwip::metrics::WIPKernel kernel;
+                kernel.outstream = &output;
+                kernel.use_mmap = use_mmap;
+                kernel.set_weight_bits(load_bits);
+                kernel.load_weights(weightfile);
+                kernel.calculate_pairwise(filenames);
+                kernel.get_kernel_matrix(kmat);
+
+                CAPTURE(bits);
+                CAPTURE(load_bits);
+                CAPTURE(use_mmap);
+                if (load_bits == bits) {
+                    CHECK(kmat == expt);
+                } else {
+                    CHECK(kmat.isApprox(expt, 1e-2));
+                }
+            }
+        }
+    }
+
+    SECTION("Weights for other tables throw") {
+        std::ofstream out(weightfile);
+        out << "kWIP_BinEntVector\t3\n0\t1\n1\t1\n2\t1\n";
+        out.close();
+        kwip::metrics::WIPKernel kernel;
+        kernel.outstream = &output;
+        kernel.load_weights(weightfile);
+        REQUIRE_THROWS_AS(kernel.calculate_pairwise(filenames),
+                          std::runtime_error&);
+    }
+    std::remove(weightfile.c_str());
+}
+
+
+TEST_CASE("Test saved and merged population counts", "[kernel]") {
+    std::vector<std::string> filenames {
+        "data/defined-1.ct",
+        "data/defined-2.ct",
+        "data/defined-3.ct",
+        "data/defined-4.ct",
+    };
+    std::vector<std::string> first(filenames.begin(), filenames.begin() + 1);
+    std::vector<std::string> rest(filenames.begin() + 1, filenames.end());
+    std::string popfile_a = "out/defined-a.pop";
+    std::string popfile_b = "out/defined-b.pop";
+    std::ostringstream output;
+    MatrixXd expt, kmat;
+
+    kwip::metrics::WIPKernel whole;
+    whole.outstream = &output;
+    whole.calculate_pairwise(filenames);
+    whole.get_kernel_matrix(expt);
+
+    kwip::metrics::WIPKernel part_a, part_b;
+    part_a.outstream = &output;
+    part_b.outstream = &output;
+    part_a.add_hashtables(first);
+    part_a.save_population(popfile_a);
+    part_b.add_hashtables(rest);
+    part_b.save_population(popfile_b);
+
+    SECTION("Merged counts give the whole population's weights") {
+        kwip::metrics::WIPKernel merged;
+        merged.outstream = &output;
+        merged.merge_population(popfile_a);
+        merged.merge_population(popfile_b);
+        REQUIRE(merged.population_samples() == filenames.size());
+        merged.calculate_weights();
+        merged.calculate_pairwise(filenames);
+        merged.get_kernel_matrix(kmat);
+        CHECK(kmat == expt);
+    }
+
+    SECTION("Samples can be added to loaded counts") {
+        kwip::metrics::WIPKernel extended;
+        extended.outstream = &output;
+        extended.load_population(popfile_a);
+        extended.calculate_entropy_vector(rest);
+        REQUIRE(extended.population_samples() == filenames.size());
+        extended.calculate_pairwise(filenames);
+        extended.get_kernel_matrix(kmat);
+        CHECK(kmat == expt);
+    }
+
+    SECTION("Files that aren't population counts throw") {
+        kwip::metrics::WIPKernel other;
+        other.outstream = &output;
+        REQUIRE_THROWS_AS(other.load_population(filenames[0]),
+                          std::runtime_error&);
+    }
+    std::remove(popfile_a.c_str());
+    std::remove(popfile_b.c_str());
+}
+
+
+TEST_CASE("Test population counts added in parallel", "[kernel]") {
+    std::vector<std::string> filenames {
+        "data/defined-1.ct",
+        "data/defined-2.ct",
+        "data/defined-3.ct",
+        "data/defined-4.ct",
+    };
+    std::ostringstream output;
+    auto read_file = [](const std::string &filename) {
+        std::ifstream in(filename, std::ios::binary);
+        return std::string(std::istreambuf_iterator<char>(in),
+                           std::istreambuf_iterator<char>());
+    };
+
+    // One sample at a time, on one thread
+    kwip::metrics::WIPKernel single;
+    single.outstream = &output;
+    single.set_num_threads(1);
+    for (const auto &filename: filenames) {
+        single.add_hashtable(filename);
+    }
+    single.save_population("out/single.pop");
+    const std::string expt = read_file("out/single.pop");
+
+    SECTION("Batches of samples added over bin ranges") {
+        kwip::metrics::WIPKernel batched;
+        batched.outstream = &output;
+        batched.set_num_threads(3);
+        batched.add_hashtables(filenames);
+        batched.save_population("out/batched.pop");
+        CHECK(read_file("out/batched.pop") == expt);
+        std::remove("out/batched.pop");
+    }
+
+    SECTION("Single samples added from several threads") {
+        kwip::metrics::WIPKernel threaded;
+        threaded.outstream = &output;
+        threaded.set_num_threads(2);
+        std::vector<std::thread> threads;
+        for (const auto &filename: filenames) {
+            threads.emplace_back([&threaded, filename]() {
+                threaded.add_hashtable(filename);
+            });
+        }
+        for (auto &thread: threads) {
+            thread.join();
+        }
+        REQUIRE(threaded.population_samples() == filenames.size());
+        threaded.save_population("out/threaded.pop");
+        CHECK(read_file("out/threaded.pop") == expt);
+        std::remove("out/threaded.pop");
+    }
+    std::remove("out/single.pop");
+}
+
+
+// Exposes the weights a WIPKernel calculated
+class WeightProbe : public kwip::metrics::WIPKernel
+{
+public:
+    using WIPKernel::_bin_weight;
+};
+
+TEST_CASE("Test bin weights from the table of entropies", "[kernel]") {
+    // A table of several 64K-bin ranges, and one of less than a range
+    std::vector<khmer::HashIntoType> sizes {150001, 70001};
+    const size_t n_samples = 5;
+    std::mt19937 rng(7);
+    std::uniform_int_distribution<int> count(0, 3);
+    std::vector<std::vector<uint32_t>> pop_counts;
+    std::vector<std::string> filenames;
+    for (const auto size: sizes) {
+        pop_counts.emplace_back(size, 0);
+    }
+    for (size_t s = 0; s < n_samples; s++) {
+        khmer::CountingHash ht(21, sizes);
+        for (size_t tab = 0; tab < sizes.size(); tab++) {
+            for (size_t bin = 0; bin < sizes[tab]; bin++) {
+                // Some bins are occupied in every sample
+                uint8_t c = bin % 101 == 0 ? 1 + count(rng) : count(rng);
+                ht.get_raw_tables()[tab][bin] = c;
+                pop_counts[tab][bin] += c > 0;
+            }
+        }
+        filenames.push_back("out/entropy-" + std::to_string(s) + ".ct");
+        khmer::CountingHashFile::save(filenames.back(), ht);
+    }
+    std::ostringstream output;
+
+    for (int bits: {32, 16, 8}) {
+        CAPTURE(bits);
+        WeightProbe kernel;
+        kernel.outstream = &output;
+        kernel.set_num_threads(4);
+        kernel.set_weight_bits(bits);
+        kernel.calculate_entropy_vector(filenames);
+        const float max_code = bits == 8 ? 255 : 65535;
+
+        size_t n_mismatched = 0, n_full = 0;
+        for (size_t tab = 0; tab < sizes.size(); tab++) {
+            for (size_t bin = 0; bin < sizes[tab]; bin++) {
+                // The per-bin entropy formula weights were calculated with
+                const uint32_t pop_count = pop_counts[tab][bin];
+                float expt = 0;
+                if (0 < pop_count && pop_count < n_samples) {
+                    const float pop_freq = (float)pop_count /
+                                           (float)n_samples;
+                    expt = (pop_freq * -log2(pop_freq)) +
+                           ((1 - pop_freq) * -log2(1 - pop_freq));
+                }
+                if (bits < 32) {
+                    expt = std::lround(expt * max_code) / max_code;
+                }
+                n_mismatched += kernel._bin_weight(tab, bin) != expt;
+                if (pop_count == n_samples) {
+                    n_full++;
+                    n_mismatched += kernel._bin_weight(tab, bin) != 0;
+                }
+            }
+        }
+        CHECK(n_full > 0);
+        CHECK(n_mismatched == 0);
+    }
+    for (const auto &filename: filenames) {
+        std::remove(filename.c_str());
+    }
+}
+
+
+TEST_CASE("Test quantised bin weights", "[kernel]") {
+    std::vector<std::string> filenames {
+        "data/defined-1.ct",
+        "data/defined-2.ct",
+        "data/defined-3.ct",
+        "data/defined-4.ct",
+    };
+    std::ostringstream output;
+    MatrixXd expt;
+
+    kwip::metrics::WIPKernel exact;
+    exact.outstream = &output;
+    exact.calculate_pairwise(filenames);
+    exact.get_kernel_matrix(expt);
+
+    REQUIRE_THROWS_AS(exact.set_weight_bits(12), std::invalid_argument&);
+
+    // Each weight is within half a quantisation step of the exact weight
+    for (int bits: {8, 16}) {
+        kwip::metrics::WIPKernel kernel;
+        MatrixXd kmat;
+
+        kernel.outstream = &output;
+        kernel.set_weight_bits(bits);
+        kernel.calculate_pairwise(filenames);
+        kernel.get_kernel_matrix(kmat);
+
+        CAPTURE(bits);
+        CHECK(kmat.isApprox(expt, bits == 8 ? 1e-2 : 1e-4));
+    }
+}
+
+
+TEST_CASE("Test sharded pairwise calculation", "[kernel]") {
+    std::vector<std::string> filenames {
+        "data/defined-1.ct",
+        "data/defined-2.ct",
+        "data/defined-3.ct",
+        "data/defined-4.ct",
+        "data/defined-1.ct",
+    };
+    std::ostringstream output;
+    MatrixXd expt, kmat;
+
+    kwip::metrics::IPKernel whole;
+    whole.outstream = &output;
+    whole.calculate_pairwise(filenames);
+    whole.get_kernel_matrix(expt);
+
+    for (size_t n_shards: {2, 3, 7, 20}) {
+        std::vector<std::string> shardfiles;
+        for (size_t shard = 0; shard < n_shards; shard++) {
+            kwip::metrics::IPKernel kernel;
+            kernel.outstream = &output;
+            kernel.set_tile_size(2);
+            kernel.set_shard(shard, n_shards);
+            kernel.calculate_pairwise(filenames);
+            REQUIRE_THROWS_AS(kernel.get_kernel_matrix(kmat),
+                              std::runtime_error&);
+            shardfiles.push_back("out/defined-" + std::to_string(shard) +
+                                 ".shard");
+            kernel.save_shard(shardfiles.back());
+        }
+        CAPTURE(n_shards);
+
+        // Shards merge in any order to the whole matrix
+        kwip::Kernel merged;
+        merged.outstream = &output;
+        std::reverse(shardfiles.begin(), shardfiles.end());
+        merged.merge_shards(shardfiles);
+        merged.get_kernel_matrix(kmat);
+        CHECK(kmat == expt);
+        CHECK(merged.sample_names == whole.sample_names);
+
+        // Missing or repeated shards throw
+        std::vector<std::string> missing(shardfiles.begin() + 1,
+                                         shardfiles.end());
+        kwip::Kernel bad;
+        bad.outstream = &output;
+        REQUIRE_THROWS_AS(bad.merge_shards(missing), std::runtime_error&);
+        missing.push_back(shardfiles[1]);
+        REQUIRE_THROWS_AS(bad.merge_shards(missing), std::runtime_error&);
+
+        for (const auto &shardfile: shardfiles) {
+            std::remove(shardfile.c_str());
+        }
+    }
+
+    kwip::Kernel kernel;
+    REQUIRE_THROWS_AS(kernel.set_shard(2, 2), std::invalid_argument&);
+}
+
+
+TEST_CASE("Test resuming a checkpointed pairwise calculation", "[kernel]") {
+    std::vector<std::string> filenames {
+        "data/defined-1.ct",
+        "data/defined-2.ct",
+        "data/defined-3.ct",
+        "data/defined-4.ct",
+    };
+    const std::string journal = "out/defined.journal";
+    std::ostringstream output;
+    MatrixXd expt, kmat;
+
+    kwip::metrics::IPKernel whole;
+    whole.outstream = &output;
+    whole.set_tile_size(2);
+    whole.set_checkpoint(journal, false);
+    whole.calculate_pairwise(filenames);
+    whole.get_kernel_matrix(expt);
+
+    // Keep 3 of the 10 pairs, and part of a fourth
+    std::ifstream in(journal, std::ios::binary);
+    std::string bytes((std::istreambuf_iterator<char>(in)),
+                      std::istreambuf_iterator<char>());
+    in.close();
+    REQUIRE(bytes.size() == 64 + 10 * 16);
+    std::ofstream(journal, std::ios::binary).write(bytes.data(),
+                                                   64 + 3 * 16 + 5);
+
+    std::ostringstream resumed_output;
+    kwip::metrics::IPKernel resumed;
+    resumed.outstream = &resumed_output;
+    resumed.set_tile_size(2);
+    resumed.set_checkpoint(journal, true);
+    resumed.calculate_pairwise(filenames);
+    resumed.get_kernel_matrix(kmat);
+    CHECK(kmat == expt);
+    CHECK(resumed_output.str().find("Resuming with 3 pairs done") !=
+          std::string::npos);
+
+    // The journal is whole again, so resuming computes nothing
+    kwip::metrics::IPKernel again;
+    again.outstream = &output;
+    again.set_checkpoint(journal, true);
+    again.calculate_pairwise(filenames);
+    again.get_kernel_matrix(kmat);
+    CHECK(kmat == expt);
+
+    // A journal of other samples isn't resumed from
+    kwip::metrics::IPKernel other;
+    other.outstream = &output;
+    other.set_checkpoint(journal, true);
+    std::vector<std::string> others(filenames.begin(), filenames.end() - 1);
+    REQUIRE_THROWS_AS(other.calculate_pairwise(others), std::runtime_error&);
+
+    std::remove(journal.c_str());
+}
+
+
+TEST_CASE("Test extending a kernel matrix with new samples", "[kernel]") {
+    std::vector<std::string> filenames {
+        "data/defined-1.ct",
+        "data/defined-2.ct",
+        "data/defined-3.ct",
+        "data/defined-4.ct",
+    };
+    std::vector<std::string> first(filenames.begin(), filenames.begin() + 2);
+    std::ostringstream output;
+    MatrixXd expt, kmat;
+
+    kwip::metrics::IPKernel whole;
+    whole.outstream = &output;
+    whole.calculate_pairwise(filenames);
+    whole.get_kernel_matrix(expt);
+
+    kwip::metrics::IPKernel prev;
+    prev.outstream = &output;
+    prev.calculate_pairwise(first);
+    std::stringstream text, npy;
+    prev.print_kernel_mat(text);
+    prev.save_kernel_npy(npy);
+
+    SECTION("From text") {
+        kwip::metrics::IPKernel kernel;
+        kernel.outstream = &output;
+        kernel.load_previous(text);
+        kernel.calculate_pairwise(filenames);
+        kernel.get_kernel_matrix(kmat);
+        CHECK(kmat == expt);
+        CHECK(kernel.sample_names == whole.sample_names);
+        // Only the 7 pairs with a new sample are computed
+        CHECK(output.str().find("Extending a kernel matrix of 2 samples "
+                                "with 2 more") != std::string::npos);
+    }
+
+    SECTION("From .npy") {
+        kwip::metrics::IPKernel kernel;
+        kernel.outstream = &output;
+        kernel.load_previous_npy(npy, prev.sample_names);
+        kernel.calculate_pairwise(filenames);
+        kernel.get_kernel_matrix(kmat);
+        CHECK(kmat == expt);
+    }
+
+    SECTION("Samples must follow those of the previous matrix") {
+        kwip::metrics::IPKernel kernel;
+        kernel.outstream = &output;
+        kernel.load_previous(text);
+        std::vector<std::string> swapped {
+            "data/defined-2.ct",
+            "data/defined-1.ct",
+            "data/defined-3.ct",
+        };
+        REQUIRE_THROWS_AS(kernel.calculate_pairwise(swapped),
+                          std::runtime_error&);
+    }
+
+    SECTION("Weighted kernels need the previous weights") {
+        kwip::metrics::WIPKernel kernel;
+        kernel.outstream = &output;
+        kernel.load_previous(text);
+        REQUIRE_THROWS_AS(kernel.calculate_pairwise(filenames),
+                          std::runtime_error&);
+    }
+
+    SECTION("Malformed matrices throw") {
+        kwip::metrics::IPKernel kernel;
+        std::istringstream empty(""), short_row("\ta\tb\na\t1\t2\nb\t1\n");
+        REQUIRE_THROWS_AS(kernel.load_previous(empty),
+                          std::runtime_error&);
+        REQUIRE_THROWS_AS(kernel.load_previous(short_row),
+                          std::runtime_error&);
+        REQUIRE_THROWS_AS(kernel.load_previous_npy(text, prev.sample_names),
+                          std::runtime_error&);
+    }
+}
+
+
+TEST_CASE("Test kernels of queries against references", "[kernel]") {
+    std::vector<std::string> filenames {
+        "data/defined-1.ct",
+        "data/defined-2.ct",
+        "data/defined-3.ct",
+        "data/defined-4.ct",
+    };
+    std::vector<std::string> queries(filenames.begin(), filenames.begin() + 1);
+    std::vector<std::string> refs(filenames.begin() + 1, filenames.end());
+    std::ostringstream output;
+    MatrixXd kern, dist, kmat, dmat;
+
+    SECTION("Unweighted") {
+        kwip::metrics::IPKernel whole;
+        whole.outstream = &output;
+        whole.calculate_pairwise(filenames);
+        whole.get_kernel_matrix(kern);
+        whole.get_distance_matrix(dist);
+
+        for (size_t tile_size: {1, 2, 4}) {
+            kwip::metrics::IPKernel kernel;
+            kernel.outstream = &output;
+            kernel.set_tile_size(tile_size);
+            kernel.calculate_cross(queries, refs);
+            CAPTURE(tile_size);
+            kernel.get_kernel_matrix(kmat);
+            kernel.get_distance_matrix(dmat);
+            CHECK(kmat == kern.block(0, 1, 1, 3));
+            CHECK(dmat == dist.block(0, 1, 1, 3));
+            CHECK(kernel.num_queries() == 1);
+            CHECK(kernel.sample_names == whole.sample_names);
+        }
+    }
+
+    SECTION("Weighted by the references") {
+        kwip::metrics::WIPKernel whole;
+        whole.outstream = &output;
+        whole.calculate_entropy_vector(refs);
+        whole.calculate_pairwise(filenames);
+        whole.get_kernel_matrix(kern);
+
+        kwip::metrics::WIPKernel kernel;
+        kernel.outstream = &output;
+        kernel.calculate_cross(queries, refs);
+        kernel.get_kernel_matrix(kmat);
+        CHECK(kmat == kern.block(0, 1, 1, 3));
+    }
+
+    SECTION("Matrices are of queries by references") {
+        kwip::metrics::IPKernel kernel;
+        kernel.outstream = &output;
+        kernel.calculate_cross(refs, queries);
+        std::ostringstream text, npy;
+        kernel.print_distance_mat(text);
+        CHECK(text.str().find("\tdefined-1\ndefined-2\t") == 0);
+        kernel.save_kernel_npy(npy);
+        CHECK(npy.str().size() == 128 + 3 * sizeof(float));
+    }
+
+    kwip::metrics::IPKernel kernel;
+    std::vector<std::string> none;
+    REQUIRE_THROWS_AS(kernel.calculate_cross(queries, none),
+                      std::invalid_argument&);
+    kernel.set_shard(0, 2);
+    REQUIRE_THROWS_AS(kernel.calculate_cross(queries, refs),
+                      std::invalid_argument&);
+}
+
+
+TEST_CASE("Test keeping nearest neighbours", "[kernel]") {
+    std::vector<std::string> filenames {
+        "data/defined-1.ct",
+        "data/defined-2.ct",
+        "data/defined-3.ct",
+        "data/defined-4.ct",
+        "data/defined-1.ct",
+    };
+    const size_t n = filenames.size();
+    std::ostringstream output;
+    MatrixXd dist;
+
+    kwip::metrics::IPKernel whole;
+    whole.outstream = &output;
+    whole.calculate_pairwise(filenames);
+    whole.get_distance_matrix(dist);
+
+    for (size_t k: {1, 2, 4, 10}) {
+        // The k nearest of each row of the distance matrix, but itself
+        std::ostringstream expt;
+        for (size_t i = 0; i < n; i++) {
+            std::vector<std::pair<float, size_t>> row;
+            for (size_t j = 0; j < n; j++) {
+                if (j != i) {
+                    row.emplace_back(dist(i, j), j);
+                }
+            }
+            std::sort(row.begin(), row.end());
+            row.resize(std::min(k, row.size()));
+            for (const auto &neighbour: row) {
+                expt << whole.sample_names[i] << "\t"
+                     << whole.sample_names[neighbour.second] << "\t"
+                     << neighbour.first << "\n";
+            }
+        }
+
+        kwip::metrics::IPKernel kernel;
+        kernel.outstream = &output;
+        kernel.set_tile_size(2);
+        kernel.set_knn(k);
+        kernel.calculate_pairwise(filenames);
+        std::ostringstream knn;
+        kernel.print_neighbours(knn);
+        CAPTURE(k);
+        CHECK(knn.str() == expt.str());
+
+        // No matrix is kept
+        MatrixXd kmat;
+        REQUIRE_THROWS_AS(kernel.get_distance_matrix(kmat),
+                          std::runtime_error&);
+    }
+
+    // Resuming, with --knn, a journal of a run without it, whose pairs may
+    // precede their self kernels or lack them
+    const std::string journal = "out/knn.journal";
+    kwip::metrics::IPKernel journalled;
+    journalled.outstream = &output;
+    journalled.set_checkpoint(journal, false);
+    journalled.calculate_pairwise(filenames);
+    std::ifstream in(journal, std::ios::binary);
+    std::string bytes((std::istreambuf_iterator<char>(in)),
+                      std::istreambuf_iterator<char>());
+    in.close();
+    const size_t n_records = n * (n + 1) / 2;
+    const size_t header = bytes.size() - n_records * 16;
+    // Keep the first self kernel, and every other pair, last first
+    std::string kept = bytes.substr(0, header);
+    for (size_t r = n_records; r-- > 0; ) {
+        const uint32_t *record = (const uint32_t *)(bytes.data() + header +
+                                                    r * 16);
+        if (record[0] != record[1] || record[0] == 0) {
+            kept += bytes.substr(header + r * 16, 16);
+        }
+    }
+    std::ofstream(journal, std::ios::binary).write(kept.data(), kept.size());
+
+    kwip::metrics::IPKernel fresh, resumed;
+    fresh.outstream = &output;
+    fresh.set_knn(2);
+    fresh.calculate_pairwise(filenames);
+    std::ostringstream expt, knn;
+    fresh.print_neighbours(expt);
+    resumed.outstream = &output;
+    resumed.set_knn(2);
+    resumed.set_checkpoint(journal, true);
+    resumed.calculate_pairwise(filenames);
+    resumed.print_neighbours(knn);
+    CHECK(knn.str() == expt.str());
+    std::remove(journal.c_str());
+
+    kwip::metrics::IPKernel kernel;
+    REQUIRE_THROWS_AS(kernel.print_neighbours(output), std::runtime_error&);
+    kernel.set_knn(2);
+    kernel.set_shard(0, 2);
+    REQUIRE_THROWS_AS(kernel.calculate_pairwise(filenames),
+                      std::invalid_argument&);
+}
+
+
+TEST_CASE("Test estimating kernels from a subset of bins", "[kernel]") {
+    // Samples sharing a random half of their counts, so kernels differ
+    std::vector<khmer::HashIntoType> sizes {200003, 199999};
+    std::vector<std::string> filenames;
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<int> count(0, 15);
+    std::vector<std::vector<uint8_t>> shared;
+    for (size_t tab = 0; tab < sizes.size(); tab++) {
+        shared.emplace_back(sizes[tab]);
+        for (auto &bin: shared.back()) {
+            bin = count(rng);
+        }
+    }
+    for (size_t s = 0; s < 3; s++) {
+        khmer::CountingHash ht(21, sizes);
+        for (size_t tab = 0; tab < sizes.size(); tab++) {
+            for (size_t bin = 0; bin < sizes[tab]; bin++) {
+                ht.get_raw_tables()[tab][bin] = bin % 2 ? shared[tab][bin] :
+                                                          count(rng);
+            }
+        }
+        filenames.push_back("out/random-" + std::to_string(s) + ".ct");
+        khmer::CountingHashFile::save(filenames.back(), ht);
+    }
+    std::ostringstream output;
+    MatrixXd expt, kmat;
+
+    kwip::metrics::IPKernel exact;
+    exact.outstream = &output;
+    exact.calculate_pairwise(filenames);
+    exact.get_kernel_matrix(expt);
+    REQUIRE_THROWS_AS(exact.print_stderr_mat(output), std::runtime_error&);
+
+    kwip::metrics::IPKernel kernel;
+    kernel.outstream = &output;
+    kernel.set_bin_fraction(0.1);
+    kernel.calculate_pairwise(filenames);
+    kernel.get_kernel_matrix(kmat);
+    std::stringstream errors;
+    kernel.print_stderr_mat(errors);
+    MatrixXd stderrs;
+    std::string line, label;
+    std::getline(errors, line);
+    stderrs.resize(3, 3);
+    for (size_t i = 0; i < 3; i++) {
+        errors >> label;
+        for (size_t j = 0; j < 3; j++) {
+            errors >> stderrs(i, j);
+        }
+    }
+
+    for (size_t i = 0; i < 3; i++) {
+        for (size_t j = 0; j < 3; j++) {
+            INFO(i << "," << j << ": " << kmat(i, j) << " +/- " <<
+                 stderrs(i, j) << " vs " << expt(i, j));
+            // Close, and within the estimated error
+            CHECK(std::fabs(kmat(i, j) / expt(i, j) - 1) < 0.05);
+            CHECK(stderrs(i, j) > 0);
+            CHECK(stderrs(i, j) < 0.05 * expt(i, j));
+            CHECK(std::fabs(kmat(i, j) - expt(i, j)) < 5 * stderrs(i, j));
+        }
+    }
+
+    // Errors don't depend on how bins are split into blocks and threads. At
+    // half the bins, subset tables span several blocks.
+    std::vector<std::string> half_errors;
+    for (size_t tile_size: {1, 3}) {
+        kwip::metrics::IPKernel half;
+        half.outstream = &output;
+        half.set_bin_fraction(0.5);
+        half.set_num_threads(tile_size);
+        half.set_tile_size(tile_size);
+        half.calculate_pairwise(filenames);
+        std::ostringstream half_out;
+        half.print_stderr_mat(half_out);
+        half_errors.push_back(half_out.str());
+    }
+    CHECK(half_errors[0] == half_errors[1]);
+
+    // Resumed pairs keep the errors journalled with their kernels
+    const std::string journal = "out/random.journal";
+    {
+        kwip::metrics::IPKernel journalled;
+        journalled.outstream = &output;
+        journalled.set_bin_fraction(0.5);
+        journalled.set_checkpoint(journal, false);
+        journalled.calculate_pairwise(filenames);
+    }
+    std::ifstream in(journal, std::ios::binary);
+    std::string bytes((std::istreambuf_iterator<char>(in)),
+                      std::istreambuf_iterator<char>());
+    in.close();
+    std::ofstream(journal, std::ios::binary).write(bytes.data(),
+                                                   bytes.size() - 3 * 16);
+    kwip::metrics::IPKernel resumed;
+    resumed.outstream = &output;
+    resumed.set_bin_fraction(0.5);
+    resumed.set_checkpoint(journal, true);
+    resumed.calculate_pairwise(filenames);
+    std::ostringstream resumed_errors;
+    resumed.print_stderr_mat(resumed_errors);
+    CHECK(resumed_errors.str() == half_errors[0]);
+    std::remove(journal.c_str());
+
+    // The errors of a previous matrix's kernels are unknown
+    std::vector<std::string> first(filenames.begin(), filenames.begin() + 2);
+    std::stringstream prev_text;
+    kwip::metrics::IPKernel prev;
+    prev.outstream = &output;
+    prev.set_bin_fraction(0.5);
+    prev.calculate_pairwise(first);
+    prev.print_kernel_mat(prev_text);
+    kwip::metrics::IPKernel extended;
+    extended.outstream = &output;
+    extended.set_bin_fraction(0.5);
+    extended.load_previous(prev_text);
+    extended.calculate_pairwise(filenames);
+    REQUIRE_THROWS_AS(extended.print_stderr_mat(output), std::runtime_error&);
+
+    // Every bin makes exact kernels
+    kwip::metrics::IPKernel whole;
+    whole.outstream = &output;
+    whole.set_bin_fraction(1);
+    whole.calculate_pairwise(filenames);
+    whole.get_kernel_matrix(kmat);
+    CHECK(kmat == expt);
+    REQUIRE_THROWS_AS(whole.set_bin_fraction(0), std::invalid_argument&);
+
+    for (const auto &filename: filenames) {
+        std::remove(filename.c_str());
+    }
+}
+
+
+TEST_CASE("Test parse_size", "[utils]") {
+    CHECK(kwip::parse_size("100") == 100);
+    CHECK(kwip::parse_size("2K") == 2048);
+    CHECK(kwip::parse_size("1.5M") == 1536 * 1024);
+    CHECK(kwip::parse_size("64G") == 64ull << 30);
+    CHECK(kwip::parse_size("1tb") == 1ull << 40);
+    CHECK_THROWS_AS(kwip::parse_size("G"), std::invalid_argument&);
+    CHECK_THROWS_AS(kwip::parse_size("10Q"), std::invalid_argument&);
+    CHECK_THROWS_AS(kwip::parse_size("-1"), std::invalid_argument&);
+}
@@ -0,0 +1,88 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  test-popcounts.cc
+ *    Description:  Tests of the packed population counts
+ *        License:  GPLv3+
+ *         Author:  Kevin Murray, spam@kdmurray.id.au
+ *
+ * ============================================================================
+ */
+
+#include "catch.hpp"
+#include "helpers.hh"
+
+#include <algorithm>
+#include <random>
+
+#include "popcounts.hh"
+
+using namespace kwip;
+
+
+TEST_CASE("Population count widths", "[popcounts]") {
+    CHECK(PopCounts::bits_for(0) == 2);
+    CHECK(PopCounts::bits_for(3) == 2);
+    CHECK(PopCounts::bits_for(4) == 4);
+    CHECK(PopCounts::bits_for(255) == 8);
+    CHECK(PopCounts::bits_for(256) == 16);
+    CHECK(PopCounts::bits_for(65536) == 32);
+    CHECK(PopCounts(1000, 2).bytes() == 250);
+    CHECK(PopCounts(1001, 4).bytes() == 501);
+    CHECK(PopCounts(10, 32).bytes() == 40);
+    REQUIRE_THROWS_AS(PopCounts(10, 12), std::invalid_argument&);
+}
+
+
+TEST_CASE("Population counts at every width", "[popcounts]") {
+    std::mt19937 rng(1234);
+    std::uniform_int_distribution<int> count(0, 255);
+    const size_t n = (1 << 16) + 77;
+    std::vector<uint8_t> a(n), b(n);
+
+    for (size_t i = 0; i < n; i++) {
+        a[i] = i % 3 ? 0 : count(rng);
+        b[i] = i % 2 ? 0 : count(rng);
+    }
+
+    for (int bits: {2, 4, 8, 16, 32}) {
+        PopCounts pop(n, bits);
+        const uint32_t max = pop.max_count();
+        uint64_t expt_sum = 0;
+        std::vector<uint32_t> expt(n, 0), got(n);
+
+        CAPTURE(bits);
+        for (size_t i = 0; i < n; i++) {
+            expt[i] = (a[i] > 0) + (b[i] > 0);
+            expt_sum += a[i] + b[i];
+        }
+        uint64_t sum = pop.add_presence(a.data(), 0, n / 2);
+        sum += pop.add_presence(a.data(), n / 2, n);
+        sum += pop.add_presence(b.data(), 0, n);
+        CHECK(sum == expt_sum);
+
+        pop.decode(0, n, got.data());
+        CHECK(got == expt);
+        CHECK(pop.get(n - 1) == expt[n - 1]);
+        CHECK(pop.count_nonzero() ==
+              (size_t)(n - std::count(expt.begin(), expt.end(), 0)));
+
+        // Counts saturate rather than wrap
+        pop.add_counts(a.data(), 0, n);
+        pop.add(0, max);
+        CHECK(pop.get(0) == max);
+        for (size_t i = 1; i < n; i++) {
+            const uint64_t count = (uint64_t)expt[i] + a[i];
+            expt[i] = std::min(count, (uint64_t)max);
+        }
+        expt[0] = max;
+        pop.decode(0, n, got.data());
+        CHECK(got == expt);
+
+        // Widening keeps every count
+        pop.widen(32);
+        CHECK(pop.bits() == 32);
+        pop.decode(0, n, got.data());
+        CHECK(got == expt);
+    }
+}
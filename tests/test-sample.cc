@@ -0,0 +1,243 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  test-sample.cc
+ *    Description:  Tests of samples, sparse tables and sketches
+ *        License:  GPLv3+
+ *         Author:  Kevin Murray, spam@kdmurray.id.au
+ *
+ * ============================================================================
+ */
+
+#include "catch.hpp"
+#include "helpers.hh"
+
+#include <cstring>
+#include <fstream>
+#include <random>
+
+#include "sample.hh"
+
+using namespace kwip;
+
+
+static std::vector<uint8_t>
+random_table(size_t tablesize, double occupancy, unsigned seed)
+{
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<double> occupied(0, 1);
+    std::uniform_int_distribution<int> count(1, 255);
+    std::vector<uint8_t> table(tablesize, 0);
+    for (auto &bin: table) {
+        if (occupied(rng) < occupancy) {
+            bin = count(rng);
+        }
+    }
+    return table;
+}
+
+static double
+dense_dot(const std::vector<uint8_t> &a, const std::vector<uint8_t> &b,
+          size_t start, size_t end)
+{
+    double sum = 0;
+    for (size_t i = start; i < end; i++) {
+        sum += (double)a[i] * b[i] * (i % 7);
+    }
+    return sum;
+}
+
+
+TEST_CASE("Sparse tables", "[sample]") {
+    // Several chunks, the last partial
+    const size_t tablesize = 3 * SparseTable::CHUNK_BINS + 1234;
+    std::vector<uint8_t> a = random_table(tablesize, 0.1, 1);
+    std::vector<uint8_t> b = random_table(tablesize, 0.3, 2);
+    SparseTable a_sparse(a.data(), tablesize);
+    SparseTable b_sparse(b.data(), tablesize);
+    auto weight = [](size_t bin) { return (double)(bin % 7); };
+
+    SECTION("Index holds exactly the occupied bins") {
+        std::vector<uint8_t> rebuilt(tablesize, 0);
+        size_t nnz = 0;
+        a_sparse.for_each(0, tablesize, [&](size_t bin, uint8_t count) {
+            rebuilt[bin] = count;
+            nnz++;
+        });
+        CHECK(nnz == a_sparse.nnz());
+        CHECK(rebuilt == a);
+    }
+
+    SECTION("Moved tables stay valid") {
+        SparseTable moved(std::move(a_sparse));
+        CHECK(sparse_dense_dot(moved, b.data(), 0, tablesize, weight) ==
+              dense_dot(a, b, 0, tablesize));
+    }
+
+    SECTION("Dot products match dense ones over any range") {
+        std::vector<std::pair<size_t, size_t>> ranges {
+            {0, tablesize},
+            {0, 1},
+            {100, 100},
+            {SparseTable::CHUNK_BINS - 10, SparseTable::CHUNK_BINS + 10},
+            {SparseTable::CHUNK_BINS, 2 * SparseTable::CHUNK_BINS},
+            {12345, tablesize - 1},
+        };
+        for (const auto &range: ranges) {
+            CAPTURE(range.first);
+            CAPTURE(range.second);
+            double expt = dense_dot(a, b, range.first, range.second);
+            CHECK(sparse_dense_dot(a_sparse, b.data(), range.first,
+                                   range.second, weight) == expt);
+            CHECK(sparse_dense_dot(b_sparse, a.data(), range.first,
+                                   range.second, weight) == expt);
+            CHECK(sparse_sparse_dot(a_sparse, b_sparse, range.first,
+                                    range.second, weight) == expt);
+        }
+    }
+}
+
+
+TEST_CASE("Sketches", "[sample]") {
+    std::string filename = "data/defined-1.ct";
+    std::string sketchfile = "out/defined-1.ks";
+    SampleShrPtr dense = load_sample(filename);
+    REQUIRE(dense->countgraph());
+    REQUIRE(dense->sparse_table(0) == NULL);
+    dense->save_sketch(sketchfile);
+    REQUIRE(sample_is_sketch(sketchfile));
+
+    for (bool use_mmap: {true, false}) {
+        CAPTURE(use_mmap);
+        SampleShrPtr sketch = load_sample(sketchfile, use_mmap);
+        REQUIRE_FALSE(sketch->countgraph());
+        REQUIRE(sketch->dense_table(0) == NULL);
+        CHECK(sketch->ksize() == dense->ksize());
+        CHECK(sketch->tablesizes() == dense->tablesizes());
+        CHECK(sketch->n_occupied() == dense->n_occupied());
+        for (size_t tab = 0; tab < dense->n_tables(); tab++) {
+            size_t tablesize = dense->tablesizes()[tab];
+            std::vector<uint8_t> rebuilt(tablesize, 0);
+            sketch->sparse_table(tab)->for_each(0, tablesize,
+                    [&](size_t bin, uint8_t count) {
+                rebuilt[bin] = count;
+            });
+            CHECK(memcmp(rebuilt.data(), dense->dense_table(tab),
+                         tablesize) == 0);
+        }
+    }
+
+    SECTION("Truncated sketches throw") {
+        std::ofstream out(sketchfile, std::ios::binary | std::ios::trunc);
+        out.write(SKETCH_SIGNATURE.data(), 4);
+        out.close();
+        REQUIRE_THROWS_AS(load_sample(sketchfile), std::runtime_error&);
+    }
+    std::remove(sketchfile.c_str());
+}
+
+
+TEST_CASE("Occupied-bin indexes of countgraphs", "[sample]") {
+    SampleShrPtr sample = load_sample("data/defined-1.ct");
+    const size_t dense_bytes = sample->bytes();
+    REQUIRE(sample->sparse_table(0) == NULL);
+    CHECK(sample->occupancy() ==
+          (double)sample->n_occupied() / sample->tablesizes()[0]);
+
+    sample->index_occupied();
+    REQUIRE(sample->dense_table(0) != NULL);
+    CHECK(sample->bytes() > dense_bytes);
+    for (size_t tab = 0; tab < sample->n_tables(); tab++) {
+        const SparseTable *index = sample->sparse_table(tab);
+        REQUIRE(index != NULL);
+        const uint8_t *table = sample->dense_table(tab);
+        size_t nnz = 0;
+        for (size_t bin = 0; bin < index->tablesize(); bin++) {
+            nnz += table[bin] > 0;
+        }
+        CHECK(index->nnz() == nnz);
+    }
+}
+
+
+TEST_CASE("Bin subsets", "[sample]") {
+    std::vector<khmer::HashIntoType> sizes {100003, 99991, 50021};
+    BinSubset subset(sizes, 0.1);
+    REQUIRE(subset.tablesizes() == sizes);
+    for (size_t tab = 0; tab < sizes.size(); tab++) {
+        const std::vector<uint64_t> &bins = subset.bins(tab);
+        CHECK(subset.subset_sizes()[tab] == bins.size());
+        CHECK(bins.size() > sizes[tab] * 0.09);
+        CHECK(bins.size() < sizes[tab] * 0.11);
+        CHECK(std::is_sorted(bins.begin(), bins.end()));
+        CHECK(bins.back() < sizes[tab]);
+        CHECK(subset.scale(tab) == (double)sizes[tab] / bins.size());
+        // Tables choose different bins
+        if (tab > 0) {
+            CHECK(bins != subset.bins(0));
+        }
+    }
+
+    // The same bins are chosen every time, on any number of threads
+    BinSubset again(sizes, 0.1);
+    BinSubset threaded(sizes, 0.1, 4);
+    for (size_t tab = 0; tab < sizes.size(); tab++) {
+        CHECK(again.bins(tab) == subset.bins(tab));
+        CHECK(threaded.bins(tab) == subset.bins(tab));
+    }
+    BinSubset whole(sizes, 1.0);
+    CHECK(whole.subset_sizes() == sizes);
+
+    CHECK_THROWS_AS(BinSubset(sizes, 0), std::invalid_argument&);
+    CHECK_THROWS_AS(BinSubset(sizes, 1.5), std::invalid_argument&);
+    std::vector<khmer::HashIntoType> tiny {2};
+    CHECK_THROWS_AS(BinSubset(tiny, 1e-9), std::invalid_argument&);
+
+    SECTION("Subsets of samples") {
+        auto ht = std::make_shared<khmer::CountingHash>(21, sizes);
+        for (size_t tab = 0; tab < sizes.size(); tab++) {
+            std::vector<uint8_t> table = random_table(sizes[tab], 0.2, tab);
+            memcpy(ht->get_raw_tables()[tab], table.data(), table.size());
+        }
+        Sample dense(ht);
+        SampleShrPtr sub = subset.apply(dense);
+        REQUIRE(sub->tablesizes() == subset.subset_sizes());
+        CHECK(sub->ksize() == 21);
+        for (size_t tab = 0; tab < sizes.size(); tab++) {
+            std::vector<uint8_t> expt = subset.apply(dense.dense_table(tab),
+                                                     tab);
+            CHECK(memcmp(sub->dense_table(tab), expt.data(),
+                         expt.size()) == 0);
+        }
+        size_t occupied = 0;
+        for (size_t bin = 0; bin < sub->tablesizes()[0]; bin++) {
+            occupied += sub->dense_table(0)[bin] > 0;
+        }
+        CHECK(sub->n_occupied() == occupied);
+        SampleShrPtr threaded_sub = subset.apply(dense, 4);
+        for (size_t tab = 0; tab < sizes.size(); tab++) {
+            CHECK(memcmp(threaded_sub->dense_table(tab), sub->dense_table(tab),
+                         sub->tablesizes()[tab]) == 0);
+        }
+        CHECK(threaded_sub->n_occupied() == occupied);
+
+        // Sketches give the same subset
+        std::string sketchfile = "out/subset.ks";
+        dense.save_sketch(sketchfile);
+        SampleShrPtr sketch = load_sample(sketchfile);
+        SampleShrPtr sketch_sub = subset.apply(*sketch);
+        SampleShrPtr threaded_sketch_sub = subset.apply(*sketch, 4);
+        for (size_t tab = 0; tab < sizes.size(); tab++) {
+            CHECK(memcmp(sketch_sub->dense_table(tab), sub->dense_table(tab),
+                         sub->tablesizes()[tab]) == 0);
+            CHECK(memcmp(threaded_sketch_sub->dense_table(tab),
+                         sub->dense_table(tab), sub->tablesizes()[tab]) == 0);
+        }
+        CHECK(sketch_sub->n_occupied() == occupied);
+        std::remove(sketchfile.c_str());
+
+        std::vector<khmer::HashIntoType> other {100003, 99991, 50023};
+        Sample other_sample(std::make_shared<khmer::CountingHash>(21, other));
+        CHECK_THROWS_AS(subset.apply(other_sample), std::runtime_error&);
+    }
+}
@@ -0,0 +1,148 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  test-samplecache.cc
+ *    Description:  Test of the concurrent sample cache
+ *        License:  GPLv3+
+ *         Author:  Kevin Murray, spam@kdmurray.id.au
+ *
+ * ============================================================================
+ */
+
+#include "catch.hpp"
+#include "helpers.hh"
+
+#include <algorithm>
+#include <chrono>
+#include <list>
+#include <random>
+#include <thread>
+
+#include "samplecache.hh"
+
+using kwip::SampleCache;
+
+typedef SampleCache<int, int> IntCache;
+
+static size_t
+int_size(const int &val)
+{
+    return val;
+}
+
+TEST_CASE("Sample cache basic operations", "[sample-cache]") {
+    std::atomic<int> loads(0);
+    auto loader = [&loads](const int &key) {
+        loads++;
+        return key;
+    };
+
+    SECTION("cache.get loads once and then hits") {
+        IntCache cache(0, 0, int_size);
+        REQUIRE(cache.get(1, loader) == 1);
+        REQUIRE(cache.get(1, loader) == 1);
+        REQUIRE(loads == 1);
+        kwip::SampleCacheStats stats = cache.stats();
+        REQUIRE(stats.hits == 1);
+        REQUIRE(stats.misses == 1);
+        REQUIRE(stats.bytes_loaded == 1);
+    }
+
+    SECTION("cache is bounded by bytes") {
+        IntCache cache(10, 0, int_size);
+        cache.get(4, loader);
+        cache.get(5, loader);
+        REQUIRE(cache.bytes() == 9);
+        cache.get(3, loader);
+        REQUIRE(cache.bytes() <= 10);
+        REQUIRE(cache.exists(3));
+        REQUIRE(cache.stats().evictions >= 1);
+    }
+
+    SECTION("cache is bounded by entries, least recently used first") {
+        IntCache cache(0, 2, int_size, 1);
+        cache.get(1, loader);
+        cache.get(2, loader);
+        cache.get(1, loader);
+        cache.get(3, loader);
+        REQUIRE(cache.size() == 2);
+        REQUIRE(cache.exists(1));
+        REQUIRE_FALSE(cache.exists(2));
+        REQUIRE(cache.exists(3));
+    }
+
+    SECTION("values larger than the budget are still returned") {
+        IntCache cache(10, 0, int_size);
+        REQUIRE(cache.get(20, loader) == 20);
+        REQUIRE(cache.exists(20));
+    }
+
+    SECTION("failed loads propagate and aren't cached") {
+        IntCache cache(0, 0, int_size);
+        auto failing = [](const int &key) -> int {
+            throw std::runtime_error("load failed");
+            return key;
+        };
+        REQUIRE_THROWS_AS(cache.get(1, failing), std::runtime_error&);
+        REQUIRE_FALSE(cache.exists(1));
+        REQUIRE(cache.get(1, loader) == 1);
+    }
+}
+
+TEST_CASE("Sample cache evicts least recently used over all shards",
+          "[sample-cache]") {
+    std::mt19937 rng(1234);
+    std::uniform_int_distribution<int> key(0, 39);
+    auto loader = [](const int &key) {
+        return key;
+    };
+    IntCache cache(0, 10, int_size);
+    // A reference LRU of the same capacity
+    std::list<int> lru;
+    uint64_t misses = 0;
+
+    for (size_t i = 0; i < 5000; i++) {
+        int k = key(rng);
+        auto it = std::find(lru.begin(), lru.end(), k);
+        if (it != lru.end()) {
+            lru.erase(it);
+        } else {
+            misses++;
+        }
+        lru.push_front(k);
+        if (lru.size() > 10) {
+            lru.pop_back();
+        }
+        cache.get(k, loader);
+    }
+    REQUIRE(cache.stats().misses == misses);
+    REQUIRE(cache.size() == 10);
+    for (int k: lru) {
+        REQUIRE(cache.exists(k));
+    }
+}
+
+TEST_CASE("Sample cache concurrent misses share a load", "[sample-cache]") {
+    IntCache cache(0, 0, int_size);
+    std::atomic<int> loads(0);
+    auto slow_loader = [&loads](const int &key) {
+        loads++;
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        return key;
+    };
+
+    std::vector<std::thread> threads;
+    std::vector<int> results(8);
+    for (size_t i = 0; i < results.size(); i++) {
+        threads.emplace_back([&, i]() {
+            results[i] = cache.get(i % 2, slow_loader);
+        });
+    }
+    for (auto &thread: threads) {
+        thread.join();
+    }
+    REQUIRE(loads == 2);
+    for (size_t i = 0; i < results.size(); i++) {
+        REQUIRE(results[i] == (int)(i % 2));
+    }
+}
@@ -0,0 +1,130 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  test-scheduler.cc
+ *    Description:  Tests of the tile pair scheduler
+ *        License:  GPLv3+
+ *         Author:  Kevin Murray, spam@kdmurray.id.au
+ *
+ * ============================================================================
+ */
+
+#include "catch.hpp"
+#include "helpers.hh"
+
+#include <set>
+
+#include "samplecache.hh"
+#include "scheduler.hh"
+
+using kwip::TilePair;
+
+
+TEST_CASE("Tile pair schedule covers the upper triangle", "[scheduler]") {
+    for (size_t n_tiles: {1, 2, 5, 13}) {
+        for (size_t cache_tiles: {1, 2, 3, 4, 20}) {
+            CAPTURE(n_tiles);
+            CAPTURE(cache_tiles);
+            std::vector<TilePair> schedule =
+                kwip::schedule_tile_pairs(n_tiles, cache_tiles);
+            std::set<TilePair> seen(schedule.begin(), schedule.end());
+
+            REQUIRE(schedule.size() == n_tiles * (n_tiles + 1) / 2);
+            REQUIRE(seen.size() == schedule.size());
+            for (const auto &pair: schedule) {
+                REQUIRE(pair.first <= pair.second);
+                REQUIRE(pair.second < n_tiles);
+            }
+        }
+    }
+}
+
+
+TEST_CASE("Tile pair schedule minimises loads", "[scheduler]") {
+    const size_t n_tiles = 20;
+    std::vector<TilePair> row_major;
+    for (size_t ti = 0; ti < n_tiles; ti++) {
+        for (size_t tj = ti; tj < n_tiles; tj++) {
+            row_major.emplace_back(ti, tj);
+        }
+    }
+
+    SECTION("Two cached tiles") {
+        std::vector<TilePair> schedule = kwip::schedule_tile_pairs(n_tiles, 2);
+        // Every tile is loaded at least once
+        REQUIRE(kwip::count_tile_loads(schedule, 2) >= n_tiles);
+        REQUIRE(kwip::count_tile_loads(schedule, 2) <=
+                kwip::count_tile_loads(row_major, 2));
+    }
+
+    SECTION("More cached tiles") {
+        std::vector<TilePair> schedule = kwip::schedule_tile_pairs(n_tiles, 6);
+        size_t loads = kwip::count_tile_loads(schedule, 6);
+        // Panels of 4 tiles: 20 + 16 + 12 + 8 + 4 tiles, less those still
+        // cached from the last panel.
+        REQUIRE(loads <= 60);
+        REQUIRE(loads < kwip::count_tile_loads(row_major, 6) / 2);
+    }
+
+    SECTION("Everything cached") {
+        std::vector<TilePair> schedule =
+            kwip::schedule_tile_pairs(n_tiles, n_tiles + 1);
+        REQUIRE(kwip::count_tile_loads(schedule, n_tiles + 1) == n_tiles);
+    }
+}
+
+
+// Get every sample of each tile pair of `schedule` from a SampleCache, as the
+// kernel does, first getting those of the next `ahead` pairs, as the
+// prefetcher does. Returns the number of samples loaded.
+static uint64_t
+run_schedule(const std::vector<TilePair> &schedule, size_t tile_size,
+             size_t cache_tiles, size_t ahead)
+{
+    kwip::SampleCache<size_t, size_t> cache(
+            0, (cache_tiles + ahead) * tile_size,
+            [](const size_t &) { return (size_t)1; });
+    auto get_tiles = [&](const TilePair &pair) {
+        for (size_t tile: {pair.first, pair.second}) {
+            for (size_t i = 0; i < tile_size; i++) {
+                cache.get(tile * tile_size + i,
+                          [](const size_t &key) { return key; });
+            }
+            if (pair.first == pair.second) {
+                break;
+            }
+        }
+    };
+    for (size_t k = 0; k < schedule.size(); k++) {
+        for (size_t p = k + 1; p <= k + ahead && p < schedule.size(); p++) {
+            get_tiles(schedule[p]);
+        }
+        get_tiles(schedule[k]);
+    }
+    return cache.stats().misses;
+}
+
+
+TEST_CASE("Sample cache loads the tiles the schedule expects", "[scheduler]") {
+    const size_t tile_size = 3;
+    for (size_t n_tiles: {1, 2, 5, 13, 20}) {
+        for (size_t cache_tiles: {2, 3, 4, 6, 20}) {
+            CAPTURE(n_tiles);
+            CAPTURE(cache_tiles);
+            std::vector<TilePair> schedule =
+                kwip::schedule_tile_pairs(n_tiles, cache_tiles);
+            size_t loads = kwip::count_tile_loads(schedule, cache_tiles);
+            REQUIRE(run_schedule(schedule, tile_size, cache_tiles, 0) ==
+                    loads * tile_size);
+            if (cache_tiles < kwip::schedule_min_cache_tiles) {
+                continue;
+            }
+            // Loading ahead into room of its own never loads more
+            for (size_t ahead: {1, 2}) {
+                CAPTURE(ahead);
+                REQUIRE(run_schedule(schedule, tile_size, cache_tiles,
+                                     ahead) <= loads * tile_size);
+            }
+        }
+    }
+}
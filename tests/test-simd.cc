@@ -0,0 +1,94 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  test-simd.cc
+ *    Description:  Tests of the vectorised inner product kernels
+ *        License:  GPLv3+
+ *         Author:  Kevin Murray, spam@kdmurray.id.au
+ *
+ * ============================================================================
+ */
+
+#include "catch.hpp"
+#include "helpers.hh"
+
+#include <random>
+
+#include "simd.hh"
+
+using namespace kwip;
+
+
+TEST_CASE("Vectorised inner products match scalar", "[simd]") {
+    std::mt19937 rng(1234);
+    std::uniform_int_distribution<int> count(0, 255);
+    std::uniform_real_distribution<float> weight(0.0, 1.0);
+    // Sizes chosen to exercise the vector tails and the 32-bit lane flushes
+    const size_t n = 64 * 8192 * 2 + 77;
+    std::vector<uint8_t> a(n), b(n);
+    std::vector<float> w(n);
+    std::vector<uint8_t> w8(n);
+    std::vector<uint16_t> w16(n);
+
+    for (size_t i = 0; i < n; i++) {
+        // Mostly saturated counts, the worst case for lane overflow
+        a[i] = i % 3 ? 255 : count(rng);
+        b[i] = i % 5 ? 255 : count(rng);
+        w[i] = weight(rng);
+        w8[i] = i % 7 ? 255 : count(rng);
+        w16[i] = i % 7 ? 65535 : count(rng) * 257;
+    }
+
+    simd::Level detected = simd::detected_level();
+    for (int lvl = simd::SCALAR; lvl <= detected; lvl++) {
+        simd::set_level((simd::Level)lvl);
+        CAPTURE(simd::level_name(simd::level()));
+        for (size_t len: {(size_t)0, (size_t)1, (size_t)31, (size_t)65, n}) {
+            CAPTURE(len);
+            CHECK(simd::dot_u8(a.data(), b.data(), len) ==
+                  simd::dot_u8_scalar(a.data(), b.data(), len));
+            CHECK(simd::dot_u8_f32(a.data(), b.data(), w.data(), len) ==
+                  simd::dot_u8_f32_scalar(a.data(), b.data(), w.data(),
+                                          len));
+            CHECK(simd::dot_u8_u8w(a.data(), b.data(), w8.data(), len) ==
+                  simd::dot_u8_intw_scalar(a.data(), b.data(), w8.data(),
+                                           len));
+            CHECK(simd::dot_u8_u16w(a.data(), b.data(), w16.data(), len) ==
+                  simd::dot_u8_intw_scalar(a.data(), b.data(), w16.data(),
+                                           len));
+        }
+    }
+    simd::set_level(detected);
+}
+
+
+TEST_CASE("Vectorised presence counts match scalar", "[simd]") {
+    std::mt19937 rng(1234);
+    std::uniform_int_distribution<int> count(0, 255);
+    const size_t n = 4096 + 77;
+    std::vector<uint8_t> a(n);
+    std::vector<uint16_t> start(n);
+
+    for (size_t i = 0; i < n; i++) {
+        a[i] = i % 3 ? 0 : count(rng);
+        // Some counts about to saturate
+        start[i] = i % 11 ? count(rng) : 65535;
+    }
+
+    simd::Level detected = simd::detected_level();
+    for (int lvl = simd::SCALAR; lvl <= detected; lvl++) {
+        simd::set_level((simd::Level)lvl);
+        CAPTURE(simd::level_name(simd::level()));
+        for (size_t len: {(size_t)0, (size_t)1, (size_t)31, (size_t)65, n}) {
+            CAPTURE(len);
+            std::vector<uint16_t> expt(start), got(start);
+            uint64_t expt_sum = simd::add_presence_u16_scalar(expt.data(),
+                                                              a.data(), len);
+            uint64_t got_sum = simd::add_presence_u16(got.data(), a.data(),
+                                                      len);
+            CHECK(got_sum == expt_sum);
+            CHECK(got == expt);
+        }
+    }
+    simd::set_level(detected);
+}